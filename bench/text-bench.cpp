@@ -0,0 +1,74 @@
+// text-bench.cpp — throughput of the wa-text.hpp kernels on large message texts
+// Build: cmake -DWA_BUILD_BENCH=ON ... && ./bin/wa-text-bench [MiB]
+
+#include <nlohmann/json.hpp>
+#include "../src/wa-text.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+static std::string make_text(size_t bytes, int multibyte_pct, int invalid_per_mb){
+  static const char* mb[] = {"é", "ü", "✓", "日本", "😀"};
+  std::mt19937 r(42); std::string s; s.reserve(bytes+8);
+  while(s.size()<bytes){
+    unsigned x = r()%1000;
+    if((int)(x%100) < multibyte_pct) s += mb[r()%5];
+    else if(x==999) s += "\"quoted\"\n";
+    else s.push_back((char)('a' + r()%26));
+  }
+  s.resize(utf8_floor(s, bytes));
+  size_t mib = std::max<size_t>(1, bytes>>20);
+  for(size_t k=0; k<mib*(size_t)invalid_per_mb; k++) s[r()%s.size()] = (char)0xFF;
+  return s;
+}
+
+template<class F> static double mbps(size_t bytes, F&& f){
+  using namespace std::chrono;
+  int reps = 0; auto t0 = steady_clock::now(); double el = 0;
+  do { f(); reps++; el = duration<double>(steady_clock::now()-t0).count(); } while(el < 0.5);
+  return (double)bytes*reps / el / (1<<20);
+}
+
+int main(int argc, char** argv){
+  size_t mib = argc>1 ? std::stoul(argv[1]) : 8;
+  struct Case { const char* name; std::string s; };
+  std::vector<Case> cases = {
+    {"ascii",      make_text(mib<<20, 0, 0)},
+    {"mixed-30%",  make_text(mib<<20, 30, 0)},
+    {"invalid-4/MiB", make_text(mib<<20, 30, 4)},
+  };
+  struct Isa { const char* name; bool (*valid)(const unsigned char*, size_t); size_t (*scan)(const unsigned char*, size_t); bool ok; };
+  std::vector<Isa> isas = { {"scalar", utf8_valid_scalar, escape_scan_scalar, true} };
+#ifdef WA_TEXT_X86
+  __builtin_cpu_init();
+  isas.push_back({"sse2", utf8_valid_sse2, escape_scan_sse2, (bool)__builtin_cpu_supports("sse2")});
+  isas.push_back({"avx2", utf8_valid_avx2, escape_scan_avx2, (bool)__builtin_cpu_supports("avx2")});
+#endif
+  std::printf("dispatch: %s, %zu MiB per text\n\n", text_kernels().name, mib);
+  std::printf("%-14s %-8s %12s %12s\n", "text", "isa", "validate", "esc-scan");
+  size_t sink = 0;
+  for(auto& c : cases){
+    auto p = (const unsigned char*)c.s.data(); size_t n = c.s.size();
+    for(auto& i : isas){
+      if(!i.ok) continue;
+      double v = mbps(n, [&]{ sink += i.valid(p, n); });
+      double e = mbps(n, [&]{ size_t o=0; while(o<n){ o += i.scan(p+o, n-o) + 1; sink += o; } });
+      std::printf("%-14s %-8s %9.0f MB/s %9.0f MB/s\n", c.name, i.name, v, e);
+    }
+  }
+  std::printf("\n%-14s %16s %16s\n", "text", "put_json_str", "json::dump");
+  for(auto& c : cases){
+    std::string out;
+    double ours = mbps(c.s.size(), [&]{ out.clear(); put_json_str(out, c.s); sink += out.size(); });
+    double theirs = mbps(c.s.size(), [&]{
+      json j = c.s; sink += j.dump(-1, ' ', false, json::error_handler_t::replace).size(); });
+    std::printf("%-14s %11.0f MB/s %11.0f MB/s\n", c.name, ours, theirs);
+  }
+  std::printf("\n(checksum %zu)\n", sink);
+  return 0;
+}
@@ -1,8 +1,8 @@
 #!/usr/bin/env bash
 set -euo pipefail
 
-# Debian/Ubuntu: sudo apt-get install -y build-essential cmake libcurl4-openssl-dev nlohmann-json3-dev
-# Arch:          sudo pacman -S --needed base-devel cmake curl nlohmann-json
+# Debian/Ubuntu: sudo apt-get install -y build-essential cmake libcurl4-openssl-dev nlohmann-json3-dev zlib1g-dev libzstd-dev libsimdjson-dev
+# Arch:          sudo pacman -S --needed base-devel cmake curl nlohmann-json zlib zstd simdjson
 
 BUILD_DIR="${BUILD_DIR:-build}"
 PREFIX="${PREFIX:-/usr/local}"
@@ -1,29 +1,68 @@
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
+#include "wa-text.hpp"
+#include "wa-ring.hpp"
+#include "wa-layout.hpp"
+#include "wa-pubsub.hpp"
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <charconv>
 #include <chrono>
 #include <cstdio>
+#include <cctype>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
 #include <mutex>
 #include <sstream>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <vector>
 #include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
 #include <ctime>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#ifdef WA_HAVE_ZSTD
+  #include <zstd.h>
+#endif
+#ifdef WA_HAVE_ZLIB
+  #include <zlib.h>
+#endif
+#ifdef WA_HAVE_SIMDJSON
+  #include <simdjson.h>
+#endif
 
 using json = nlohmann::json;
+using ojson = nlohmann::ordered_json;   // keeps "op" first in control lines
 namespace fs = std::filesystem;
 
 // ---------- HTTP ----------
 static size_t sink(void* p,size_t s,size_t n,void* d){((std::string*)d)->append((char*)p,s*n);return s*n;}
-static std::string http_get(const std::string& url,long* code=nullptr){
-  CURL* c=curl_easy_init(); std::string out; if(!c) return out;
+// Fills `out` (cleared first), so a caller can reuse one buffer across polls.
+// The easy handle is kept per thread: connection and DNS caches survive.
+static void http_get_into(const std::string& url,std::string& out,long* code=nullptr){
+  out.clear();
+  thread_local std::unique_ptr<CURL, void(*)(CURL*)> h(curl_easy_init(), curl_easy_cleanup);
+  CURL* c=h.get(); if(!c) return;
+  curl_easy_reset(c);
   curl_easy_setopt(c,CURLOPT_URL,url.c_str());
   curl_easy_setopt(c,CURLOPT_WRITEFUNCTION,sink);
   curl_easy_setopt(c,CURLOPT_WRITEDATA,&out);
@@ -33,7 +72,6 @@ static std::string http_get(const std::string& url,long* code=nullptr){
   CURLcode rc=curl_easy_perform(c);
   if(code) curl_easy_getinfo(c,CURLINFO_RESPONSE_CODE,code);
   if(rc!=CURLE_OK) std::cerr<<"GET "<<url<<" err "<<curl_easy_strerror(rc)<<"\n";
-  curl_easy_cleanup(c); return out;
 }
 static std::string http_post_json(const std::string& url,const std::string& body,long* code=nullptr){
   CURL* c=curl_easy_init(); std::string out; if(!c) return out;
@@ -69,6 +107,15 @@ static fs::path resolve_path(const fs::path& base, const std::string& comp){
   return p.is_absolute()? p : (base / p);
 }
 
+struct RetentionCfg {
+  long long max_age_sec = 0;        // 0 = keep forever
+  uint64_t max_dir_bytes = 0;       // archived bytes per directory; 0 = unlimited
+  size_t max_peer_segments = 0;     // archives kept per peer; 0 = unlimited
+  int interval_sec = 60;
+  size_t batch = 256;               // deletions per pass, keeps each pass short
+  bool enabled() const { return max_age_sec || max_dir_bytes || max_peer_segments; }
+};
+
 struct Cfg {
   fs::path base_dir;        // runtime (fifo default)
   fs::path data_dir;        // default for logs/state
@@ -80,12 +127,45 @@ struct Cfg {
   std::string global_name = "events.jsonl";
   std::string per_prefix = "events.";
   std::string per_suffix = ".jsonl";
+  int per_fanout = 0;                   // hashed subdirectory levels under per_dir (0 = flat, max 2)
 
   // Rotation (new)
   uint64_t rotate_global_bytes = 0;     // 0 = disabled
   uint64_t rotate_peer_bytes   = 0;     // 0 = disabled
+  std::string rotate_global_interval;   // ""|hour|day
+  std::string rotate_peer_interval;     // ""|hour|day
+  uint64_t rotate_global_events = 0;    // 0 = disabled
+  uint64_t rotate_peer_events   = 0;    // 0 = disabled
   std::string archive_timefmt  = "%Y%m%d-%H%M%S"; // appended to archived files
 
+  // Archive compression (new)
+  std::string archive_compress = "none";    // none|auto|zstd|gzip
+  int compress_level = 3;
+  uint64_t compress_frame_bytes = 1<<20;    // uncompressed bytes per independent frame
+
+  // Retention of archived segments (new)
+  RetentionCfg retention;
+  bool manifest = true;                 // keep .manifest/<stream>.json next to the logs
+
+  // Local spool (new): write here, ship to global_dir/per_dir in the background
+  fs::path spool_dir;                   // empty = write directly to global_dir/per_dir
+  int ship_interval_ms = 1000;
+
+  // Text that is not valid UTF-8 (see wa-text.hpp): replace|drop|latin1
+  std::string utf8_policy = "replace";
+
+  // Local subscription socket (new): empty = off
+  fs::path sub_socket;
+  size_t sub_replay_events = 10000;     // events kept in memory for from_seq replay
+  size_t sub_client_buffer = 1<<20;     // max unsent bytes per subscriber
+
+  // Shared-memory event ring for local readers (see wa-ring.hpp): empty = off
+  fs::path shm_ring;
+  int shm_ring_slots = 16384;           // 256-byte slots, rounded up to a power of two
+
+  // Parsing of /lp and /pull bodies: auto (simdjson on-demand when built in) | nlohmann
+  std::string json_parser = "auto";
+
   // Meta/state
   std::string meta_log   = "meta.jsonl";
   std::string state_file = "state.json";
@@ -106,12 +186,12 @@ struct Cfg {
 
 static void merge_json(Cfg& c, const json& j, const fs::path& cfg_dir){
   auto S=[&](const char* k,std::string& v){ if(j.contains(k)) v=j[k].get<std::string>(); };
-  auto I64=[&](const char* k,uint64_t& v){ if(j.contains(k)) v=j[k].get<uint64_t>(); };
+  auto I64=[&]<class T>(const char* k,T& v){ if(j.contains(k)) v=j[k].get<T>(); };   // integer keys wider than int
   auto I=[&](const char* k,int& v){ if(j.contains(k)) v=j[k].get<int>(); };
   auto P=[&](const char* k,fs::path& v){
     if(j.contains(k)){
       fs::path tmp = j[k].get<std::string>();
-      v = tmp.is_absolute()? tmp : (cfg_dir / tmp);
+      v = tmp.empty()? fs::path() : tmp.is_absolute()? tmp : (cfg_dir / tmp);   // "" = unset
     }
   };
 
@@ -123,11 +203,43 @@ static void merge_json(Cfg& c, const json& j, const fs::path& cfg_dir){
   S("global_name",c.global_name);
   S("per_prefix",c.per_prefix);
   S("per_suffix",c.per_suffix);
+  I("per_fanout",c.per_fanout);
 
   // rotation
   I64("rotate_global_bytes", c.rotate_global_bytes);
   I64("rotate_peer_bytes",   c.rotate_peer_bytes);
+  S("rotate_global_interval", c.rotate_global_interval);
+  S("rotate_peer_interval",   c.rotate_peer_interval);
+  I64("rotate_global_events", c.rotate_global_events);
+  I64("rotate_peer_events",   c.rotate_peer_events);
   S("archive_timefmt", c.archive_timefmt);
+  S("archive_compress", c.archive_compress);
+  I("compress_level", c.compress_level);
+  I64("compress_frame_bytes", c.compress_frame_bytes);
+
+  if(j.contains("manifest")) c.manifest = j["manifest"].get<bool>();
+
+  // retention
+  I64("retain_max_age_sec", c.retention.max_age_sec);
+  I64("retain_max_dir_bytes", c.retention.max_dir_bytes);
+  I64("retain_max_peer_segments", c.retention.max_peer_segments);
+  I("retain_interval_sec", c.retention.interval_sec);
+  I64("retain_batch", c.retention.batch);
+  c.retention.batch = std::max<size_t>(1, c.retention.batch);
+
+  // spool
+  P("spool_dir", c.spool_dir);
+  I("ship_interval_ms", c.ship_interval_ms);
+
+  S("utf8_policy", c.utf8_policy);
+  S("json_parser", c.json_parser);
+
+  // subscriptions
+  P("sub_socket", c.sub_socket);
+  I64("sub_replay_events", c.sub_replay_events);
+  I64("sub_client_buffer", c.sub_client_buffer);
+  P("shm_ring", c.shm_ring);
+  I("shm_ring_slots", c.shm_ring_slots);
 
   // meta/state
   S("meta_log",c.meta_log);
@@ -197,6 +309,7 @@ static Cfg load_cfg(int argc, char** argv){
   if(c.data_dir.empty()) c.data_dir = c.base_dir;
   if(c.global_dir.empty()) c.global_dir = c.data_dir;
   if(c.per_dir.empty())    c.per_dir    = c.data_dir;
+  c.per_fanout = std::clamp(c.per_fanout, 0, 2);
 
   // legacy "global_log": if it contains '/', treat as full path; else as name
   if(!c.legacy_global_log.empty()){
@@ -218,106 +331,1077 @@ static Cfg load_cfg(int argc, char** argv){
 }
 
 // ---------- Rotation helpers ----------
-static std::string timefmt_now(const std::string& fmt){
-  std::time_t t = std::time(nullptr);
+static std::string timefmt_at(const std::string& fmt, std::time_t t){
   std::tm tm{};
   localtime_r(&t,&tm);
   char buf[64]; std::strftime(buf,sizeof(buf),fmt.c_str(),&tm);
   return std::string(buf);
 }
 
+// Archive name for `live`; suffixed -1, -2, ... when a segment with the same
+// stamp (plain or compressed) already exists, since fast rotations share a second.
+// `last`/`seq` remember the previous name for this stream, which matters when
+// archives leave the directory quickly (spool shipping).
+static fs::path archive_path(const fs::path& live, const std::string& timefmt, std::time_t when,
+                             std::string& last, int& seq){
+  fs::path base = live; base += "."; base += timefmt_at(timefmt, when);
+  auto taken=[](const fs::path& a){
+    fs::path z=a; z+=".zst"; fs::path g=a; g+=".gz";
+    return fs::exists(a) || fs::exists(z) || fs::exists(g);
+  };
+  int i = base.string()==last ? seq+1 : 0;
+  auto name=[&](int k){ fs::path a=base; if(k) a += "-" + std::to_string(k); return a; };
+  while(taken(name(i))) ++i;
+  last = base.string(); seq = i;
+  return name(i);
+}
+
+// Wall-clock segment periods, aligned in local time like archive_timefmt.
+enum class Interval { None, Hour, Day };
+
+static Interval interval_from_name(const std::string& n){
+  if(n=="hour"||n=="hourly") return Interval::Hour;
+  if(n=="day"||n=="daily")   return Interval::Day;
+  if(!n.empty() && n!="none") std::cerr<<"unknown rotation interval \""<<n<<"\" (use hour|day)\n";
+  return Interval::None;
+}
+static long long period_start_ms(long long t_ms, Interval iv){
+  std::time_t t = (std::time_t)(t_ms/1000);
+  std::tm tm{}; localtime_r(&t,&tm);
+  tm.tm_min=0; tm.tm_sec=0;
+  if(iv==Interval::Day) tm.tm_hour=0;
+  tm.tm_isdst=-1;
+  return (long long)std::mktime(&tm)*1000;
+}
+static long long period_next_ms(long long start_ms, Interval iv){
+  std::time_t t = (std::time_t)(start_ms/1000);
+  std::tm tm{}; localtime_r(&t,&tm);
+  if(iv==Interval::Day) tm.tm_mday+=1; else tm.tm_hour+=1;
+  tm.tm_isdst=-1;
+  return (long long)std::mktime(&tm)*1000;
+}
+
+// Per-segment summary recorded in the stream manifest. Values known at
+// rotation time are filled by the writer; the background indexer then
+// re-reads the archive and makes them exact.
+struct SegStats {
+  long long first_ts = 0;   // 0 = unknown
+  long long last_ts = 0;
+  uint64_t events = 0;
+  uint64_t raw_bytes = 0;   // uncompressed size
+  uint32_t crc32 = 0;       // of the file as stored
+  bool exact = false;       // filled by a full read
+};
+
+// `"ts":<int>` of a serialized event; 0 if absent. ts is the last member,
+// so it is searched from the end; an escaped \"ts\": inside a string value
+// is skipped, as in wa-sub.
+static long long line_ts(const char* p, size_t n){
+  static const char key[] = "\"ts\":";
+  std::string_view v(p, n);
+  size_t at = v.size();
+  while((at = v.rfind(key, at))!=std::string_view::npos){
+    if(at==0 || v[at-1]!='\\') return std::strtoll(p + at + sizeof(key) - 1, nullptr, 10);
+    if(at-- == 0) break;
+  }
+  return 0;
+}
+
+// Policies combine: a segment closes on whichever limit is reached first.
 struct RotatorCfg{
-  uint64_t threshold = 0;
+  uint64_t threshold = 0;                 // bytes; 0 = off
   std::string timefmt = "%Y%m%d-%H%M%S";
+  std::function<void(const fs::path&, const fs::path&, const SegStats&)> on_archive; // (live, archive) after a successful rename
+  Interval interval = Interval::None;     // close at each hour/day boundary
+  uint64_t max_events = 0;                // events per segment; 0 = off
+  std::function<void(const fs::path&)> on_append; // (live) after each write; spool shipping
+  bool enabled() const { return threshold || interval!=Interval::None || max_events; }
+};
+
+// Counters for the open segment. They are loaded once when the file is opened
+// and then kept in memory, so appends never stat the file or read the clock:
+// the time policy compares the event's own ts with the precomputed boundary.
+struct SegState{
+  uint64_t ino = 0;                     // of the open file (reported to ring readers)
+  uint64_t bytes = 0;
+  uint64_t events = 0;
+  bool events_exact = true;             // false if an existing file was not counted
+  long long first_ts = 0, last_ts = 0;
+  long long start_ms = 0;               // period start (interval policy)
+  long long next_ms = LLONG_MAX;        // first ts that belongs to the next segment
+  std::string last_stamp; int stamp_seq = 0; // previous archive name (kept across reset)
+
+  void reset(const RotatorCfg& c, long long ts){
+    bytes=0; events=0; events_exact=true; first_ts=0; last_ts=0; next_ms=LLONG_MAX;
+    if(c.interval!=Interval::None){ start_ms=period_start_ms(ts,c.interval); next_ms=period_next_ms(start_ms,c.interval); }
+  }
+  // Returns true if the existing file belongs to an earlier period and should
+  // be archived before anything new is written to it.
+  bool load(const fs::path& p, const RotatorCfg& c){
+    reset(c, now_ms());
+    struct stat st{};
+    if(::stat(p.c_str(),&st)!=0) return false;
+    bytes = (uint64_t)st.st_size;
+    long long mt = (long long)st.st_mtim.tv_sec*1000 + st.st_mtim.tv_nsec/1000000;
+    if(bytes){
+      std::ifstream f(p, std::ios::binary);
+      std::string first; std::getline(f, first);
+      first_ts = line_ts(first.data(), first.size());
+      last_ts = mt;
+      events_exact = false;
+      if(c.max_events){
+        char buf[1<<16]; events = first.size()<bytes ? 1 : 0;
+        while(f.read(buf,sizeof(buf)) || f.gcount()>0) events += (uint64_t)std::count(buf, buf+f.gcount(), '\n');
+        events_exact = true;
+      }
+    }
+    if(c.interval!=Interval::None && bytes && mt < start_ms){ start_ms = period_start_ms(mt, c.interval); return true; }
+    return false;
+  }
+  // Identity and size of the file just opened for appending.
+  void opened(const fs::path& p){
+    struct stat sb{};
+    if(::stat(p.c_str(), &sb)==0){ ino = (uint64_t)sb.st_ino; bytes = (uint64_t)sb.st_size; }
+  }
+  bool due_before(const RotatorCfg& c, long long ts){
+    if(c.interval==Interval::None || ts<next_ms) return false;
+    if(bytes) return true;
+    reset(c, ts); // nothing to archive; just move the empty segment to the current period
+    return false;
+  }
+  bool due_after(const RotatorCfg& c) const {
+    return (c.threshold && bytes>=c.threshold) || (c.max_events && events>=c.max_events);
+  }
+  void wrote(size_t n, long long ts){
+    bytes += n; events += 1;
+    if(!first_ts) first_ts = ts;
+    last_ts = ts;
+  }
+  SegStats stats() const {
+    SegStats s; s.first_ts=first_ts; s.last_ts=last_ts; s.events=events_exact?events:0; s.raw_bytes=bytes;
+    return s;
+  }
+  // Interval segments are stamped with their period start so files can be
+  // selected by name; size/count segments keep the rotation time.
+  std::time_t stamp(const RotatorCfg& c) const {
+    return c.interval!=Interval::None ? (std::time_t)(start_ms/1000) : std::time(nullptr);
+  }
 };
 
+// Close `f`, archive `live`, reopen it empty. Best-effort: if the rename fails
+// the current file keeps growing.
+static void rotate_file(const fs::path& live, std::ofstream& f, SegState& st, const RotatorCfg& c, long long ts){
+  fs::path arch = archive_path(live, c.timefmt, st.stamp(c), st.last_stamp, st.stamp_seq);
+  std::error_code ec;
+  if(f.is_open()) f.close();
+  fs::rename(live, arch, ec);
+  f.open(live, std::ios::app);
+  if(!ec){
+    SegStats ss = st.stats();
+    st.reset(c, ts);
+    st.opened(live);
+    if(c.on_archive) c.on_archive(live, arch, ss);
+  }
+}
+
+// ---------- Event serialization ----------
+// Log records have fixed shapes, so they are formatted straight into a
+// thread-local buffer instead of going through a json object. Output is
+// byte-identical to json::dump() (keys sorted, same escapes); string
+// escaping and UTF-8 repair live in wa-text.hpp.
+// One JSONL record: {"kind":..,"peer":..,<field>:..,"ts":..}\n, where field is
+// "status" or "text" (both sort between "peer" and "ts"). The view stays valid
+// until the next call on this thread; global and per-peer writers share it.
+static std::string_view event_line(long long ts, std::string_view kind, std::string_view peer,
+                                   std::string_view field, std::string_view value){
+  thread_local std::string buf;
+  buf.clear();
+  buf.reserve(48 + kind.size() + peer.size() + field.size() + value.size() + value.size()/8);
+  buf.append("{\"kind\":"); put_json_str(buf, kind);
+  buf.append(",\"peer\":"); put_json_str(buf, peer);
+  buf.push_back(','); put_json_str(buf, field); buf.push_back(':'); put_json_str(buf, value);
+  buf.append(",\"ts\":"); put_i64(buf, ts);
+  buf.append("}\n", 2);
+  return buf;
+}
+
 class RotatingStream {
   fs::path path;
   RotatorCfg cfg;
   std::ofstream ofs;
+  SegState st;
   std::mutex m;
 
   void open_append_unlocked(){
     if(ofs.is_open()) return;
     ofs.open(path, std::ios::app);
   }
-  uint64_t size_unlocked(){
-    std::error_code ec; auto s = fs::file_size(path, ec);
-    return ec ? 0 : (uint64_t)s;
-  }
-  void rotate_unlocked(){
-    if(cfg.threshold==0) return;
-    uint64_t sz = size_unlocked();
-    if(sz < cfg.threshold) return;
-    std::string stamp = timefmt_now(cfg.timefmt);
-    fs::path arch = path;
-    arch += ".";
-    arch += stamp;
-    std::error_code ec;
-    if(ofs.is_open()) ofs.close();
-    fs::rename(path, arch, ec);
-    // best-effort; if rename fails, continue writing current file
-    ofs.open(path, std::ios::app);
-  }
 
 public:
   RotatingStream(fs::path p, RotatorCfg rc):path(std::move(p)),cfg(std::move(rc)){
     fs::create_directories(path.parent_path());
     ofs.open(path, std::ios::app);
+    st.opened(path);
+    if(cfg.enabled() && st.load(path, cfg)) rotate_file(path, ofs, st, cfg, now_ms());
   }
-  void append(const json& line){
+  // `line` is one complete record including the trailing newline. Returns
+  // where it ended up.
+  LogPos append(long long ts, std::string_view line){
     std::lock_guard<std::mutex> lk(m);
     open_append_unlocked();
-    ofs<<line.dump()<<'\n';
+    if(st.due_before(cfg, ts)) rotate_file(path, ofs, st, cfg, ts);
+    ofs.write(line.data(), (std::streamsize)line.size());
     ofs.flush();
-    rotate_unlocked();
+    st.wrote(line.size(), ts);
+    LogPos at{st.ino, st.bytes};
+    if(cfg.on_append) cfg.on_append(path);
+    if(st.due_after(cfg)) rotate_file(path, ofs, st, cfg, ts);
+    return at;
   }
   const fs::path& file_path() const { return path; }
 };
 
+// ---------- Per-peer layout ----------
+// Shard directories come from peer_shard() in wa-layout.hpp.
+// Existing directories that can hold per-peer files under the given layout.
+static std::vector<fs::path> peer_dirs(const fs::path& root, int fanout){
+  std::vector<fs::path> level{root};
+  for(int i=0;i<fanout;i++){
+    std::vector<fs::path> next;
+    for(const auto& d : level){
+      std::error_code ec;
+      for(auto it=fs::directory_iterator(d, ec); !ec && it!=fs::directory_iterator(); it.increment(ec)){
+        std::string n = it->path().filename().string();
+        if(n.size()==2 && std::isxdigit((unsigned char)n[0]) && std::isxdigit((unsigned char)n[1]) && it->is_directory(ec))
+          next.push_back(it->path());
+      }
+    }
+    level.swap(next);
+  }
+  return level;
+}
+
+// Transparent hash so string-keyed maps can be probed with a string_view.
+struct StrHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+template<class V> using StrMap = std::unordered_map<std::string, V, StrHash, std::equal_to<>>;
+
 class PerContactLogs{
-  fs::path dir; std::string pre,suf; RotatorCfg rcfg;
+  fs::path dir; std::string pre,suf; RotatorCfg rcfg; int fanout;
   std::mutex m;
-  struct Entry { fs::path path; std::unique_ptr<std::ofstream> f; };
-  std::unordered_map<std::string, Entry> files;
-
-  void rotate_if_needed_unlocked(Entry& e){
-    if(rcfg.threshold==0) return;
-    std::error_code ec;
-    auto sz = fs::file_size(e.path, ec);
-    if(ec || (uint64_t)sz < rcfg.threshold) return;
-    if(e.f && e.f->is_open()) e.f->close();
-    fs::path arch = e.path; arch += "."; arch += timefmt_now(rcfg.timefmt);
-    fs::rename(e.path, arch, ec);
-    // reopen new
-    e.f = std::make_unique<std::ofstream>(e.path, std::ios::app);
-  }
+  struct Entry { fs::path path; std::unique_ptr<std::ofstream> f; SegState st; };
+  StrMap<Entry> files;
 
 public:
-  PerContactLogs(fs::path base, std::string prefix, std::string suffix, RotatorCfg rcfg_)
-    :dir(std::move(base)), pre(std::move(prefix)), suf(std::move(suffix)), rcfg(std::move(rcfg_)){
+  PerContactLogs(fs::path base, std::string prefix, std::string suffix, RotatorCfg rcfg_, int fanout_=0)
+    :dir(std::move(base)), pre(std::move(prefix)), suf(std::move(suffix)), rcfg(std::move(rcfg_)), fanout(fanout_){
     fs::create_directories(dir);
   }
-  void append(const std::string& key, const json& line){
+  LogPos append(std::string_view key_, long long ts, std::string_view line){
     std::lock_guard<std::mutex> lk(m);
-    auto it=files.find(key);
+    auto it=files.find(key_);
     if(it==files.end()){
-      fs::create_directories(dir);
+      std::string key(key_);
+      fs::path d = dir / peer_shard(key, fanout);
+      fs::create_directories(d);
       Entry e;
-      e.path = dir/(pre+key+suf);
+      e.path = d/(pre+key+suf);
       e.f = std::make_unique<std::ofstream>(e.path, std::ios::app);
+      e.st.opened(e.path);
+      if(rcfg.enabled() && e.st.load(e.path, rcfg)) rotate_file(e.path, *e.f, e.st, rcfg, ts);
       it = files.emplace(key, std::move(e)).first;
     }
-    *(it->second.f) << line.dump() << '\n';
-    it->second.f->flush();
-    rotate_if_needed_unlocked(it->second);
+    Entry& e = it->second;
+    if(e.st.due_before(rcfg, ts)) rotate_file(e.path, *e.f, e.st, rcfg, ts);
+    e.f->write(line.data(), (std::streamsize)line.size());
+    e.f->flush();
+    e.st.wrote(line.size(), ts);
+    LogPos at{e.st.ino, e.st.bytes};
+    if(rcfg.on_append) rcfg.on_append(e.path);
+    if(e.st.due_after(rcfg)) rotate_file(e.path, *e.f, e.st, rcfg, ts);
+    return at;
+  }
+};
+
+// ---------- Archive compaction ----------
+// Rotated segments are rewritten as a sequence of independent frames, each
+// ending on a line boundary, so readers can decompress frame by frame.
+// zstd output carries a trailing seek table (zstd "seekable" skippable frame);
+// gzip output is a plain multi-member .gz that any gunzip can read.
+enum class Codec { None, Zstd, Gzip };
+
+static Codec codec_from_name(const std::string& n){
+#ifdef WA_HAVE_ZSTD
+  if(n=="zstd"||n=="auto") return Codec::Zstd;
+#endif
+#ifdef WA_HAVE_ZLIB
+  if(n=="gzip"||n=="auto") return Codec::Gzip;
+#endif
+  if(n!="none") std::cerr<<"archive_compress \""<<n<<"\" not available in this build; archives stay uncompressed\n";
+  return Codec::None;
+}
+static const char* codec_ext(Codec c){ return c==Codec::Zstd? ".zst" : c==Codec::Gzip? ".gz" : ""; }
+static bool is_compressed_name(const std::string& n){
+  auto ends=[&](const char* x){ size_t l=strlen(x); return n.size()>=l && n.compare(n.size()-l,l,x)==0; };
+  return ends(".zst") || ends(".gz") || ends(".tmp");
+}
+
+static void put_le32(std::string& o, uint32_t v){ for(int i=0;i<4;i++) o.push_back((char)((v>>(8*i))&0xff)); }
+
+static bool compress_frame(Codec c, int level, const char* src, size_t n, std::string& out){
+  out.clear();
+#ifdef WA_HAVE_ZSTD
+  if(c==Codec::Zstd){
+    out.resize(ZSTD_compressBound(n));
+    size_t r = ZSTD_compress(out.data(), out.size(), src, n, level);
+    if(ZSTD_isError(r)){ std::cerr<<"zstd: "<<ZSTD_getErrorName(r)<<"\n"; return false; }
+    out.resize(r); return true;
+  }
+#endif
+#ifdef WA_HAVE_ZLIB
+  if(c==Codec::Gzip){
+    z_stream zs{};
+    if(deflateInit2(&zs, std::clamp(level,1,9), Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY)!=Z_OK) return false;
+    out.resize(deflateBound(&zs, n));
+    zs.next_in=(Bytef*)src; zs.avail_in=(uInt)n;
+    zs.next_out=(Bytef*)out.data(); zs.avail_out=(uInt)out.size();
+    int r = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out); deflateEnd(&zs);
+    return r==Z_STREAM_END;
+  }
+#endif
+  (void)c; (void)level; (void)src; (void)n;
+  return false;
+}
+
+// CRC-32 (IEEE, as zlib/gzip/python zlib.crc32), so manifest checksums can be
+// verified with standard tools.
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t n){
+  static const auto table = []{
+    std::array<uint32_t,256> t{};
+    for(uint32_t i=0;i<256;i++){ uint32_t c=i; for(int k=0;k<8;k++) c = (c&1)? 0xEDB88320u^(c>>1) : c>>1; t[i]=c; }
+    return t;
+  }();
+  const unsigned char* p=(const unsigned char*)data;
+  crc = ~crc;
+  while(n--) crc = table[(crc^*p++)&0xff] ^ (crc>>8);
+  return ~crc;
+}
+
+// Background worker for rotated segments: compresses them (when a codec is
+// configured) and indexes them for the manifest, at idle priority.
+class Compactor {
+public:
+  using Done = std::function<void(const fs::path&, const fs::path&, const SegStats&)>; // (archive, result, stats)
+
+private:
+  Codec codec; int level; uint64_t frame_bytes; bool index;
+  Done on_done;
+  std::mutex m; std::condition_variable cv;
+  std::deque<fs::path> q; std::unordered_set<std::string> queued;
+  bool stop=false;
+  std::thread th;
+
+  static void lower_priority(){
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+    // IOPRIO_WHO_PROCESS on a tid affects only this thread; class 3 = idle
+    syscall(SYS_ioprio_set, 1, tid, (3<<13));
+#endif
+  }
+
+  static void scan_lines(const char* p, size_t n, SegStats& st){
+    const char* end = p + n;
+    while(p < end){
+      const char* nl = (const char*)memchr(p, '\n', (size_t)(end-p));
+      const char* e = nl? nl : end;
+      if(e > p){
+        long long ts = line_ts(p, (size_t)(e-p));
+        if(ts){ if(!st.first_ts) st.first_ts = ts; st.last_ts = ts; }
+        st.events++;
+      }
+      p = nl? nl+1 : end;
+    }
+  }
+
+  // Index only: one sequential read for line count, ts range and checksum.
+  bool index_plain(const fs::path& src, SegStats& st){
+    std::ifstream in(src, std::ios::binary);
+    if(!in.good()) return false;
+    std::string buf(1<<20, '\0'), carry;
+    for(;;){
+      in.read(buf.data(), (std::streamsize)buf.size());
+      size_t got = (size_t)in.gcount();
+      if(got==0) break;
+      st.crc32 = crc32_update(st.crc32, buf.data(), got);
+      st.raw_bytes += got;
+      carry.append(buf.data(), got);
+      size_t nl = carry.rfind('\n');
+      if(nl==std::string::npos) continue;
+      scan_lines(carry.data(), nl+1, st);
+      carry.erase(0, nl+1);
+    }
+    scan_lines(carry.data(), carry.size(), st);
+    st.exact = true;
+    if(on_done) on_done(src, src, st);
+    return true;
+  }
+
+  bool compact(const fs::path& src, SegStats& st){
+    std::ifstream in(src, std::ios::binary);
+    if(!in.good()) return false;
+    fs::path dst = src; dst += codec_ext(codec);
+    fs::path tmp = dst; tmp += ".tmp";
+    std::ofstream out(tmp, std::ios::binary|std::ios::trunc);
+    if(!out.good()) return false;
+
+    std::vector<std::pair<uint32_t,uint32_t>> seek; // (compressed, decompressed)
+    std::string buf, carry, frame;
+    buf.resize(frame_bytes);
+    uint64_t out_total=0;
+    auto put=[&](const std::string& b){ out.write(b.data(), (std::streamsize)b.size()); st.crc32 = crc32_update(st.crc32, b.data(), b.size()); };
+    for(;;){
+      in.read(buf.data(), (std::streamsize)buf.size());
+      size_t got = (size_t)in.gcount();
+      if(got==0 && carry.empty()) break;
+      carry.append(buf.data(), got);
+      // cut at the last newline so every frame holds whole lines (unless at EOF)
+      size_t cut = carry.size();
+      if(got!=0){ size_t nl = carry.rfind('\n'); if(nl==std::string::npos) continue; cut = nl+1; }
+      if(!compress_frame(codec, level, carry.data(), cut, frame)) return false;
+      put(frame);
+      scan_lines(carry.data(), cut, st);
+      seek.emplace_back((uint32_t)frame.size(), (uint32_t)cut);
+      st.raw_bytes += cut; out_total += frame.size();
+      carry.erase(0, cut);
+      if(got==0) break;
+    }
+    if(codec==Codec::Zstd){
+      std::string t;
+      put_le32(t, 0x184D2A5E);
+      put_le32(t, (uint32_t)(seek.size()*8 + 9));
+      for(auto& e : seek){ put_le32(t, e.first); put_le32(t, e.second); }
+      put_le32(t, (uint32_t)seek.size());
+      t.push_back(0);
+      put_le32(t, 0x8F92EAB1);
+      put(t);
+    }
+    out.flush();
+    if(!out.good()) return false;
+    out.close();
+    { int fd=::open(tmp.c_str(), O_RDONLY|O_CLOEXEC); if(fd>=0){ ::fsync(fd); ::close(fd); } }
+
+    // keep mtime so time-based readers still see when the segment was last written
+    std::error_code ec;
+    auto mt = fs::last_write_time(src, ec);
+    fs::rename(tmp, dst, ec);
+    if(ec){ std::cerr<<"compact rename err: "<<ec.message()<<"\n"; fs::remove(tmp, ec); return false; }
+    if(mt!=fs::file_time_type{}) fs::last_write_time(dst, mt, ec);
+    st.exact = true;
+    if(on_done) on_done(src, dst, st);
+    fs::remove(src, ec);
+    std::cerr<<"compacted "<<src.filename().string()<<" "<<st.raw_bytes<<" -> "<<out_total<<" bytes in "<<seek.size()<<" frames\n";
+    return true;
+  }
+
+  void run(){
+    lower_priority();
+    for(;;){
+      fs::path p;
+      {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [&]{ return stop || !q.empty(); });
+        if(stop) return;
+        p = q.front(); q.pop_front(); queued.erase(p.string());
+      }
+      std::error_code ec;
+      if(!fs::exists(p, ec)) continue; // pruned before we got to it
+      SegStats st;
+      if(codec==Codec::None){
+        if(!index_plain(p, st)) std::cerr<<"index failed: "<<p.string()<<"\n";
+      } else if(!compact(p, st)){
+        fs::path tmp=p; tmp+=codec_ext(codec); tmp+=".tmp"; fs::remove(tmp, ec);
+        std::cerr<<"compact failed: "<<p.string()<<"\n";
+      }
+    }
+  }
+
+public:
+  Compactor(Codec c, int lvl, uint64_t fb, bool index_archives, Done done = {})
+    :codec(c),level(lvl),frame_bytes(fb?fb:(1<<20)),index(index_archives),on_done(std::move(done)){
+    if(enabled()) th = std::thread([this]{ run(); });
+  }
+  ~Compactor(){
+    { std::lock_guard<std::mutex> lk(m); stop=true; }
+    cv.notify_all();
+    if(th.joinable()) th.join();
+  }
+  bool enabled() const { return codec!=Codec::None || index; }
+  bool compressing() const { return codec!=Codec::None; }
+  void enqueue(const fs::path& p){
+    if(!enabled()) return;
+    {
+      std::lock_guard<std::mutex> lk(m);
+      if(!queued.insert(p.string()).second) return;
+      q.push_back(p);
+    }
+    cv.notify_one();
+  }
+};
+
+// ---------- Meta log ----------
+// meta.jsonl is written by the sender thread and by background housekeeping.
+class MetaLog {
+  std::ofstream f; std::mutex m;
+public:
+  explicit MetaLog(const fs::path& p):f(p, std::ios::app){}
+  bool good() const { return f.good(); }
+  void write(const json& line){
+    std::lock_guard<std::mutex> lk(m);
+    f<<line.dump()<<'\n'; f.flush();
   }
 };
 
+// ---------- Segment catalog ----------
+// In-memory list of archived segments per live stream, seeded by one
+// directory scan at startup and then maintained from rotation/compaction
+// callbacks, so housekeeping never has to walk per_dir again.
+//
+// Each stream's list is also persisted as a manifest,
+// <dir>/.manifest/<live name>.json, rewritten atomically (tmp + rename) on
+// every change. Readers can plan a time-range query from it without listing
+// the directory or opening any segment:
+//   {"version":1,"stream":"events.max.jsonl","updated":<ms>,"segments":[
+//     {"path":"events.max.jsonl.20250101-000000.zst","first_ts":..,"last_ts":..,
+//      "events":N,"bytes":B,"raw_bytes":R,"compression":"zstd","crc32":"1c291ca3",
+//      "exact":true}, ...]}          (oldest first; crc32 is of the file as stored)
+struct SegInfo {
+  fs::path path;
+  uint64_t bytes = 0;
+  long long mtime_ms = 0;
+  bool pending = false;   // queued for compaction; not counted against byte budgets yet
+  SegStats stats;
+};
+
+static long long mtime_ms_of(const fs::path& p){
+  struct stat st{}; if(::stat(p.c_str(),&st)!=0) return 0;
+  return (long long)st.st_mtim.tv_sec*1000 + st.st_mtim.tv_nsec/1000000;
+}
+static fs::path manifest_path(const fs::path& live){
+  return live.parent_path() / ".manifest" / (live.filename().string() + ".json");
+}
+static const char* compression_of(const fs::path& p){
+  std::string e = p.extension().string();
+  return e==".zst"? "zstd" : e==".gz"? "gzip" : "none";
+}
+
+class SegmentCatalog {
+public:
+  struct Stream { fs::path dir; bool per_peer=false; std::deque<SegInfo> segs; }; // oldest first
+
+private:
+  bool persist;
+  fs::path per_root;    // byte budgets for per-peer streams apply to the whole per_dir tree
+  std::mutex m;
+  std::unordered_map<std::string, Stream> streams;        // live path -> archives
+  std::unordered_map<std::string, std::string> owner;     // archive path -> live path
+  std::unordered_map<std::string, uint64_t> dir_bytes;    // dir -> archived bytes
+
+  void add_unlocked(const fs::path& live, bool per_peer, SegInfo si){
+    auto& s = streams[live.string()];
+    s.dir = per_peer? per_root : live.parent_path(); s.per_peer = per_peer;
+    owner[si.path.string()] = live.string();
+    if(!si.pending) dir_bytes[s.dir.string()] += si.bytes;
+    // rotations arrive in order; only seeded entries need sorting
+    auto it = s.segs.end();
+    while(it!=s.segs.begin() && std::prev(it)->mtime_ms > si.mtime_ms) --it;
+    s.segs.insert(it, std::move(si));
+  }
+
+  void save_manifest_unlocked(const std::string& live){
+    if(!persist) return;
+    json segs = json::array();
+    auto it = streams.find(live);
+    if(it!=streams.end()) for(const auto& si : it->second.segs){
+      const auto& st = si.stats;
+      char crc[9]; std::snprintf(crc, sizeof(crc), "%08x", st.crc32);
+      segs.push_back({{"path",si.path.filename().string()},{"first_ts",st.first_ts},{"last_ts",st.last_ts},
+                      {"events",st.events},{"bytes",si.bytes},{"raw_bytes",st.raw_bytes},
+                      {"compression",compression_of(si.path)},
+                      {"crc32", st.exact? json(crc) : json()},{"exact",st.exact}});
+    }
+    fs::path p = manifest_path(live);
+    json j = {{"version",1},{"stream",fs::path(live).filename().string()},{"updated",now_ms()},{"segments",segs}};
+    std::error_code ec;
+    fs::create_directories(p.parent_path(), ec);
+    fs::path tmp = p; tmp += ".tmp";
+    { std::ofstream o(tmp, std::ios::trunc); o<<j.dump()<<'\n'; }
+    fs::rename(tmp, p, ec);
+    if(ec) std::cerr<<"manifest rename err: "<<ec.message()<<"\n";
+  }
+
+  // Stats previously recorded for `live`'s segments, keyed by file name.
+  static std::unordered_map<std::string, SegStats> load_manifest(const fs::path& live){
+    std::unordered_map<std::string, SegStats> out;
+    std::ifstream f(manifest_path(live));
+    if(!f.good()) return out;
+    json j; try{ f>>j; }catch(...){ return out; }
+    if(!j.is_object() || !j.contains("segments") || !j["segments"].is_array()) return out;
+    for(const auto& e : j["segments"]){
+      if(!e.is_object() || !e.contains("path") || !e["path"].is_string()) continue;
+      SegStats st;
+      try{                               // a hand-edited entry is skipped, not fatal
+        st.first_ts = e.value("first_ts", 0LL);
+        st.last_ts = e.value("last_ts", 0LL);
+        st.events = e.value("events", (uint64_t)0);
+        st.raw_bytes = e.value("raw_bytes", (uint64_t)0);
+        st.exact = e.value("exact", false);
+        if(e.contains("crc32") && e["crc32"].is_string()) st.crc32 = (uint32_t)std::stoul(e["crc32"].get<std::string>(), nullptr, 16);
+      }catch(...){ continue; }
+      out[e["path"].get<std::string>()] = st;
+    }
+    return out;
+  }
+
+public:
+  SegmentCatalog(bool write_manifests, fs::path per_dir):persist(write_manifests),per_root(std::move(per_dir)){}
+
+  void add(const fs::path& live, bool per_peer, const fs::path& arch, bool pending, const SegStats& stats){
+    std::error_code ec; auto sz = fs::file_size(arch, ec);
+    std::lock_guard<std::mutex> lk(m);
+    add_unlocked(live, per_peer, SegInfo{arch, ec?0:(uint64_t)sz, mtime_ms_of(arch), pending, stats});
+    save_manifest_unlocked(live.string());
+  }
+  // The background worker compressed and/or indexed `from` into `to` (which
+  // may be the same path); false if `from` was pruned meanwhile.
+  bool replace(const fs::path& from, const fs::path& to, const SegStats& stats){
+    std::error_code ec; auto sz = fs::file_size(to, ec);
+    std::lock_guard<std::mutex> lk(m);
+    auto o = owner.find(from.string());
+    if(o==owner.end()) return false;
+    std::string live = o->second;
+    auto& s = streams[live];
+    for(auto& si : s.segs) if(si.path==from){
+      auto& db = dir_bytes[s.dir.string()];
+      db = db - (si.pending?0:si.bytes) + (ec?0:(uint64_t)sz);
+      si.path = to; si.bytes = ec?0:(uint64_t)sz; si.pending = false; si.stats = stats;
+      break;
+    }
+    owner.erase(o);
+    owner[to.string()] = live;
+    save_manifest_unlocked(live);
+    return true;
+  }
+  // One directory scan: archives are `<live>.<stamp>[-N][.zst|.gz]`, where
+  // the live name starts with `prefix` and ends with `live_end`. Returns the
+  // uncompressed segments that still need the background worker.
+  std::vector<fs::path> seed(const fs::path& dir, const std::string& prefix, const std::string& live_end,
+                             bool per_peer, bool compressing){
+    std::vector<fs::path> todo;
+    std::unordered_map<std::string, std::unordered_map<std::string, SegStats>> known;
+    std::unordered_set<std::string> touched;
+    std::error_code ec;
+    std::lock_guard<std::mutex> lk(m);
+    for(auto it=fs::directory_iterator(dir, ec); !ec && it!=fs::directory_iterator(); it.increment(ec)){
+      if(!it->is_regular_file(ec)) continue;
+      std::string n = it->path().filename().string();
+      if(n.rfind(prefix,0)!=0 || (n.size()>4 && n.compare(n.size()-4,4,".tmp")==0)) continue;
+      size_t at = n.find(live_end + ".");
+      if(at==std::string::npos || at + live_end.size() < prefix.size()) continue;
+      fs::path live = dir / n.substr(0, at + live_end.size());
+      if(owner.count(it->path().string())) continue;
+      auto kn = known.find(live.string());
+      if(kn==known.end()) kn = known.emplace(live.string(), load_manifest(live)).first;
+      SegInfo si{it->path(), 0, mtime_ms_of(it->path()), compressing && !is_compressed_name(n), {}};
+      std::error_code e2; auto sz = it->file_size(e2); si.bytes = e2?0:(uint64_t)sz;
+      auto st = kn->second.find(n);
+      if(st!=kn->second.end()) si.stats = st->second;
+      else si.stats.last_ts = si.mtime_ms;
+      if(!is_compressed_name(n) && (compressing || !si.stats.exact)) todo.push_back(si.path);
+      add_unlocked(live, per_peer, std::move(si));
+      touched.insert(live.string());
+    }
+    for(const auto& live : touched) save_manifest_unlocked(live);
+    return todo;
+  }
+  void remove(const fs::path& arch){
+    std::lock_guard<std::mutex> lk(m);
+    auto o = owner.find(arch.string());
+    if(o==owner.end()) return;
+    std::string live = o->second;
+    auto& s = streams[live];
+    for(auto it=s.segs.begin(); it!=s.segs.end(); ++it) if(it->path==arch){
+      if(!it->pending) dir_bytes[s.dir.string()] -= it->bytes;
+      s.segs.erase(it); break;
+    }
+    if(s.segs.empty()) streams.erase(live);
+    owner.erase(o);
+    save_manifest_unlocked(live);
+  }
+
+  struct Victim { SegInfo seg; std::string reason; };
+  // Up to `limit` segments violating a retention rule, oldest first per rule.
+  std::vector<Victim> select_expired(long long min_mtime, uint64_t max_dir_bytes,
+                                     size_t max_peer_segs, size_t limit){
+    std::lock_guard<std::mutex> lk(m);
+    std::vector<Victim> out;
+    std::unordered_set<std::string> picked;
+    auto take=[&](const SegInfo& si, const char* why){
+      if(out.size()<limit && picked.insert(si.path.string()).second) out.push_back({si, why});
+    };
+    std::unordered_map<std::string, uint64_t> over;
+    for(auto& [dir, b] : dir_bytes) if(max_dir_bytes && b>max_dir_bytes) over[dir] = b - max_dir_bytes;
+    for(auto& [live, s] : streams){
+      if(out.size()>=limit) break;
+      for(const auto& si : s.segs){ if(si.mtime_ms >= min_mtime) break; take(si, "max_age"); }
+      if(s.per_peer && max_peer_segs && s.segs.size()>max_peer_segs)
+        for(size_t i=0;i<s.segs.size()-max_peer_segs;i++) take(s.segs[i], "max_peer_segments");
+    }
+    // byte budget: repeatedly drop the oldest head segment in an over-budget dir
+    if(!over.empty()){
+      std::unordered_map<std::string, std::pair<const Stream*, size_t>> cur;
+      for(auto& [live, s] : streams) if(over.count(s.dir.string())) cur[live] = {&s, 0};
+      while(out.size()<limit && !over.empty()){
+        const SegInfo* best=nullptr; std::string best_live;
+        for(auto& [live, c] : cur){
+          if(c.second>=c.first->segs.size() || !over.count(c.first->dir.string())) continue;
+          const auto& si = c.first->segs[c.second];
+          if(si.pending){ c.second++; continue; }
+          if(!best || si.mtime_ms < best->mtime_ms){ best=&si; best_live=live; }
+        }
+        if(!best) break;
+        auto& c = cur[best_live]; c.second++;
+        std::string d = c.first->dir.string();
+        take(*best, "max_dir_bytes");
+        if(best->bytes >= over[d]) over.erase(d); else over[d] -= best->bytes;
+      }
+    }
+    return out;
+  }
+};
+
+// ---------- Spool shipping ----------
+// With spool_dir set, wa-hub appends to fast local disk (spool_dir/global,
+// spool_dir/peers) and this thread mirrors the spool into global_dir/per_dir:
+//  - live tails: new bytes of touched live files are appended to the NAS copy
+//    every ship_interval_ms, so NAS readers lag by at most one interval;
+//  - rotation: the rest of the closed segment is appended, then the NAS live
+//    file is renamed to the archive name, mirroring the local rename;
+//  - closed segments (after compaction/indexing): copied to a tmp file, read
+//    back and CRC-checked, then renamed into place; the local copy is removed.
+// Failed NAS operations stay queued and are retried with backoff; ingest only
+// ever touches the spool.
+class Shipper {
+public:
+  struct Root { fs::path spool, nas; std::string prefix, live_end; int fanout=0; };
+  using AfterRotate = std::function<void(const fs::path& arch, const SegStats&)>;
+  using Shipped = std::function<void(const fs::path& nas_live, const fs::path& nas_file, const SegStats&)>;
+
+private:
+  struct Live { uint64_t offset=0; uint64_t inode=0; bool init=false; int fd=-1; };
+  struct Event { enum Kind { Rotated, Closed, Adopt } kind; fs::path live, arch, file; SegStats st; };
+
+  std::vector<Root> roots; int interval_ms;
+  AfterRotate after_rotate; Shipped shipped;
+  std::mutex m; std::condition_variable cv; bool stop=false;
+  std::deque<Event> events;
+  std::unordered_set<std::string> dirty;
+  std::unordered_map<std::string, Live> lives;            // spool live path -> NAS tail state
+  std::unordered_map<std::string, std::string> arch_live; // spool archive -> spool live
+  std::unordered_map<std::string, int> rotations;         // spool live -> Rotated events not yet handled
+  std::thread th;
+
+  fs::path to_nas(const fs::path& p) const {
+    for(const auto& r : roots){
+      auto rel = p.lexically_relative(r.spool);
+      if(!rel.empty() && *rel.begin()!="..") return r.nas / rel;
+    }
+    return {};
+  }
+  const Root* root_of(const fs::path& p) const {
+    for(const auto& r : roots){ auto rel = p.lexically_relative(r.spool); if(!rel.empty() && *rel.begin()!="..") return &r; }
+    return nullptr;
+  }
+  static bool write_all(int fd, const char* p, size_t n){
+    while(n){ ssize_t w = ::write(fd, p, n); if(w<0){ if(errno==EINTR) continue; return false; } p+=w; n-=(size_t)w; }
+    return true;
+  }
+  // CRC and size of `p`, or of its first `limit` bytes.
+  static bool crc_file(const fs::path& p, uint32_t& crc, uint64_t& size, uint64_t limit = UINT64_MAX){
+    int fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC); if(fd<0) return false;
+    crc=0; size=0; char buf[1<<16]; ssize_t r = 0;
+    while(size<limit && (r=::read(fd, buf, (size_t)std::min<uint64_t>(sizeof(buf), limit-size)))>0){
+      crc = crc32_update(crc, buf, (size_t)r); size += (uint64_t)r;
+    }
+    ::close(fd); return size==limit || r==0;
+  }
+  // Where shipping of spool file `src` resumes after a restart: the NAS
+  // copy's size if it holds exactly the first bytes of `src`. Anything else
+  // (an older segment left by a crash between local rotation and the NAS
+  // rename, a torn write) is truncated and shipped again from 0.
+  static uint64_t resume_offset(const fs::path& src, const fs::path& nas){
+    struct stat ss{}, ns{};
+    if(::stat(nas.c_str(), &ns)!=0 || ns.st_size==0) return 0;
+    uint32_t a=0, b=0; uint64_t na=0, nb=0;
+    if(::stat(src.c_str(), &ss)==0 && ns.st_size<=ss.st_size &&
+       crc_file(nas, a, na) && crc_file(src, b, nb, na) && a==b && na==nb) return na;
+    std::cerr<<"ship: "<<nas<<" is not a prefix of "<<src<<", shipping it again\n";
+    std::error_code ec; fs::resize_file(nas, 0, ec);
+    return 0;
+  }
+  // src -> dst via dst.tmp, fsync, read-back CRC check, rename.
+  static bool copy_verified(const fs::path& src, const fs::path& dst){
+    std::error_code ec;
+    fs::create_directories(dst.parent_path(), ec);
+    fs::path tmp = dst; tmp += ".tmp";
+    int in = ::open(src.c_str(), O_RDONLY|O_CLOEXEC); if(in<0) return false;
+    int out = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(out<0){ ::close(in); return false; }
+    uint32_t crc=0; uint64_t n=0; char buf[1<<16]; ssize_t r; bool ok=true;
+    while((r=::read(in, buf, sizeof(buf)))>0){
+      crc = crc32_update(crc, buf, (size_t)r); n += (uint64_t)r;
+      if(!write_all(out, buf, (size_t)r)){ ok=false; break; }
+    }
+    ok = ok && r==0 && ::fsync(out)==0;
+    ::close(in); ok = (::close(out)==0) && ok;
+    uint32_t crc2=0; uint64_t n2=0;
+    ok = ok && crc_file(tmp, crc2, n2) && crc2==crc && n2==n;
+    if(ok){ fs::rename(tmp, dst, ec); ok = !ec; }
+    if(!ok) fs::remove(tmp, ec);
+    return ok;
+  }
+  // Append spool bytes [offset, EOF) of `src` to the NAS live copy.
+  bool append_tail(Live& ls, const fs::path& src, const fs::path& nas_live){
+    int in = ::open(src.c_str(), O_RDONLY|O_CLOEXEC); if(in<0) return errno==ENOENT;
+    if(ls.fd<0){
+      std::error_code ec; fs::create_directories(nas_live.parent_path(), ec);
+      ls.fd = ::open(nas_live.c_str(), O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+      if(ls.fd<0){ ::close(in); return false; }
+    }
+    char buf[1<<16]; ssize_t r; bool ok=true; uint64_t off=ls.offset;
+    while((r=::pread(in, buf, sizeof(buf), (off_t)off))>0){
+      if(::pwrite(ls.fd, buf, (size_t)r, (off_t)off)!=r){ ok=false; break; }
+      off += (uint64_t)r;
+    }
+    ::close(in);
+    ok = ok && r==0 && ::fdatasync(ls.fd)==0;
+    if(ok) ls.offset = off;
+    else { ::close(ls.fd); ls.fd=-1; }
+    return ok;
+  }
+  bool sync_live(const std::string& live){
+    { std::lock_guard<std::mutex> lk(m); auto it=rotations.find(live); if(it!=rotations.end() && it->second>0) return true; }
+    auto& ls = lives[live];
+    fs::path nas = to_nas(live);
+    struct stat st{};
+    if(::stat(live.c_str(), &st)!=0) return true;
+    if(ls.init && ls.inode==0) ls.inode = st.st_ino; // first sync after a rotation
+    if(!ls.init){ ls.offset = resume_offset(live, nas); ls.inode = st.st_ino; ls.init = true; }
+    if(st.st_ino!=ls.inode) return true; // rotated; the Rotated event finishes the old segment
+    if((uint64_t)st.st_size<=ls.offset) return true;
+    return append_tail(ls, live, nas);
+  }
+
+  bool handle(Event& e){
+    switch(e.kind){
+    case Event::Rotated: {
+      auto& ls = lives[e.live.string()];
+      fs::path nas_live = to_nas(e.live), nas_arch = to_nas(e.arch);
+      if(!ls.init){ ls.offset = resume_offset(e.arch, nas_live); ls.init=true; }
+      if(!append_tail(ls, e.arch, nas_live)) return false;
+      ::close(ls.fd); ls.fd=-1;
+      std::error_code ec;
+      fs::rename(nas_live, nas_arch, ec);
+      if(ec) return false;
+      // fresh NAS live file, so NAS tailers see the rotation right away
+      ls = Live{}; ls.init = true;
+      ls.fd = ::open(nas_live.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+      {
+        std::lock_guard<std::mutex> lk(m);
+        arch_live[e.arch.string()] = e.live.string(); dirty.insert(e.live.string());
+        if(--rotations[e.live.string()]<=0) rotations.erase(e.live.string());
+      }
+      after_rotate(e.arch, e.st);
+      return true;
+    }
+    case Event::Adopt: {
+      // leftover uncompressed archive from an earlier run
+      fs::path nas_arch = to_nas(e.arch);
+      std::error_code ec;
+      uint32_t a=0,b=0; uint64_t na=0,nb=0;
+      bool same = fs::exists(nas_arch, ec) && crc_file(e.arch, a, na) && crc_file(nas_arch, b, nb) && a==b && na==nb;
+      if(!same && !copy_verified(e.arch, nas_arch)) return false;
+      { std::lock_guard<std::mutex> lk(m); arch_live[e.arch.string()] = e.live.string(); }
+      after_rotate(e.arch, e.st);
+      return true;
+    }
+    case Event::Closed: {
+      std::string live;
+      { std::lock_guard<std::mutex> lk(m); auto it=arch_live.find(e.arch.string()); if(it!=arch_live.end()) live=it->second; }
+      if(live.empty()) live = e.live.string();
+      fs::path nas_arch = to_nas(e.arch), nas_file = to_nas(e.file);
+      std::error_code ec;
+      if(e.file==e.arch){
+        // NAS copy was built from tail appends; check it against the spool bytes
+        uint32_t a=0,b=0; uint64_t na=0,nb=0;
+        bool same = crc_file(e.file, a, na) && crc_file(nas_file, b, nb) && a==b && na==nb;
+        if(!same && !copy_verified(e.file, nas_file)) return false;
+      } else {
+        if(!copy_verified(e.file, nas_file)) return false;
+        fs::remove(nas_arch, ec);
+      }
+      auto mt = fs::last_write_time(e.file, ec);
+      if(!ec) fs::last_write_time(nas_file, mt, ec);
+      fs::remove(e.file, ec);
+      { std::lock_guard<std::mutex> lk(m); arch_live.erase(e.arch.string()); }
+      shipped(to_nas(live), nas_file, e.st);
+      return true;
+    }
+    }
+    return true;
+  }
+
+  void run(){
+    int backoff_ms = 0;
+    for(;;){
+      std::vector<std::string> tails;
+      {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait_for(lk, std::chrono::milliseconds(backoff_ms? backoff_ms : interval_ms),
+                    [&]{ return stop || (!backoff_ms && !events.empty()); });
+        if(stop) return;
+        tails.assign(dirty.begin(), dirty.end()); dirty.clear();
+      }
+      bool failed=false;
+      for(size_t i=0;i<tails.size();i++){
+        if(failed || !sync_live(tails[i])){
+          failed=true;
+          std::lock_guard<std::mutex> lk(m); dirty.insert(tails[i]);
+        }
+      }
+      while(!failed){
+        Event e;
+        { std::lock_guard<std::mutex> lk(m); if(events.empty()) break; e = events.front(); }
+        if(!handle(e)){ failed=true; break; }
+        std::lock_guard<std::mutex> lk(m); events.pop_front();
+      }
+      if(failed){
+        backoff_ms = std::min(30000, backoff_ms? backoff_ms*2 : 1000);
+        std::cerr<<"ship: NAS unavailable, retrying in "<<backoff_ms<<" ms\n";
+      } else backoff_ms = 0;
+    }
+  }
+  void push(Event e){
+    { std::lock_guard<std::mutex> lk(m); events.push_back(std::move(e)); }
+    cv.notify_one();
+  }
+
+public:
+  Shipper(std::vector<Root> r, int interval, AfterRotate ar, Shipped done)
+    :roots(std::move(r)),interval_ms(std::max(50,interval)),after_rotate(std::move(ar)),shipped(std::move(done)){
+    th = std::thread([this]{ run(); });
+  }
+  ~Shipper(){
+    { std::lock_guard<std::mutex> lk(m); stop=true; }
+    cv.notify_all();
+    if(th.joinable()) th.join();
+    for(auto& [k, ls] : lives) if(ls.fd>=0) ::close(ls.fd);
+  }
+  bool owns(const fs::path& p) const { return root_of(p)!=nullptr; }
+
+  void touched(const fs::path& live){ std::lock_guard<std::mutex> lk(m); dirty.insert(live.string()); }
+  void rotated(const fs::path& live, const fs::path& arch, const SegStats& st){
+    { std::lock_guard<std::mutex> lk(m); rotations[live.string()]++; }
+    push({Event::Rotated, live, arch, arch, st});
+  }
+  void closed(const fs::path& arch, const fs::path& file, const SegStats& st){ push({Event::Closed, {}, arch, file, st}); }
+
+  // Startup: queue unshipped tails and archives left in the spool.
+  void recover(){
+    for(const auto& r : roots) for(const auto& d : peer_dirs(r.spool, r.fanout)){
+      std::error_code ec;
+      for(auto it=fs::directory_iterator(d, ec); !ec && it!=fs::directory_iterator(); it.increment(ec)){
+        if(!it->is_regular_file(ec)) continue;
+        std::string n = it->path().filename().string();
+        if(n.rfind(r.prefix,0)!=0 || (n.size()>4 && n.compare(n.size()-4,4,".tmp")==0)) continue;
+        if(n.size()>=r.live_end.size() && n.compare(n.size()-r.live_end.size(), r.live_end.size(), r.live_end)==0){
+          touched(it->path()); continue;
+        }
+        size_t at = n.find(r.live_end + ".");
+        if(at==std::string::npos || at + r.live_end.size() < r.prefix.size()) continue;
+        fs::path live = d / n.substr(0, at + r.live_end.size());
+        SegStats st; st.last_ts = mtime_ms_of(it->path());
+        if(is_compressed_name(n)){
+          fs::path arch = it->path(); arch.replace_extension();
+          push({Event::Closed, live, arch, it->path(), st});
+        } else {
+          push({Event::Adopt, live, it->path(), it->path(), st});
+        }
+      }
+    }
+  }
+};
+
+// ---------- Retention ----------
+class Retention {
+  RetentionCfg cfg; SegmentCatalog& cat; MetaLog& meta;
+  std::mutex m; std::condition_variable cv; bool stop=false;
+  std::thread th;
+
+  void pass(){
+    long long min_mtime = cfg.max_age_sec ? now_ms() - cfg.max_age_sec*1000 : LLONG_MIN;
+    for(;;){
+      auto victims = cat.select_expired(min_mtime, cfg.max_dir_bytes, cfg.max_peer_segments, cfg.batch);
+      uint64_t freed=0; size_t n=0;
+      for(auto& v : victims){
+        std::error_code ec;
+        fs::remove(v.seg.path, ec);
+        if(ec && fs::exists(v.seg.path)){ std::cerr<<"prune "<<v.seg.path.string()<<": "<<ec.message()<<"\n"; continue; }
+        cat.remove(v.seg.path);
+        freed += v.seg.bytes; n++;
+        meta.write({{"ts",now_ms()},{"op","prune"},{"path",v.seg.path.string()},
+                    {"bytes",v.seg.bytes},{"reason",v.reason}});
+      }
+      if(n) std::cerr<<"retention: pruned "<<n<<" segments, "<<freed<<" bytes\n";
+      if(victims.size()<cfg.batch) return;
+      std::unique_lock<std::mutex> lk(m);
+      if(cv.wait_for(lk, std::chrono::milliseconds(100), [&]{ return stop; })) return;
+    }
+  }
+
+public:
+  Retention(RetentionCfg c, SegmentCatalog& catalog, MetaLog& ml):cfg(c),cat(catalog),meta(ml){
+    if(!cfg.enabled()) return;
+    th = std::thread([this]{
+      setpriority(PRIO_PROCESS, (pid_t)syscall(SYS_gettid), 19);
+      for(;;){
+        pass();
+        std::unique_lock<std::mutex> lk(m);
+        if(cv.wait_for(lk, std::chrono::seconds(std::max(1,cfg.interval_sec)), [&]{ return stop; })) return;
+      }
+    });
+  }
+  ~Retention(){
+    { std::lock_guard<std::mutex> lk(m); stop=true; }
+    cv.notify_all();
+    if(th.joinable()) th.join();
+  }
+};
+
+// ---------- Local subscriptions ----------
+// With sub_socket set, wa-hub pushes every event to local consumers over a
+// Unix stream socket as soon as it is logged (SubServer, wa-pubsub.hpp). The
+// files stay the durable record; this is the low-latency path. The last
+// sub_replay_events events are kept for from_seq replay and each client may
+// have sub_client_buffer bytes of unsent output.
+
 // ---------- Aliases ----------
 struct Aliases{
-  std::unordered_map<std::string,std::string> alias_to_num;
-  std::unordered_map<std::string,std::string> num_to_alias;
+  StrMap<std::string> alias_to_num;
+  StrMap<std::string> num_to_alias;
 };
 static Aliases load_aliases(const fs::path& path){
   Aliases A; std::ifstream f(path); if(!f.good()) return A;
@@ -334,10 +1418,33 @@ static Aliases load_aliases(const fs::path& path){
   }
   return A;
 }
-static std::string peer_key(const Aliases& A, const std::string& number){
-  auto it=A.num_to_alias.find(number); return it==A.num_to_alias.end()? number : it->second;
+// View into A or into `number`; valid as long as both are.
+static std::string_view peer_key(const Aliases& A, std::string_view number){
+  auto it=A.num_to_alias.find(number); return it==A.num_to_alias.end()? number : std::string_view(it->second);
 }
 
+// The aliases file is re-read only when its mtime or size changes; every
+// batch and every send used to parse it again. Readers hold a snapshot.
+class AliasCache {
+  fs::path path;
+  std::mutex m;
+  std::shared_ptr<const Aliases> cur;
+  bool present = false; struct timespec mtime{}; off_t size = -1;
+public:
+  explicit AliasCache(fs::path p):path(std::move(p)){}
+  std::shared_ptr<const Aliases> get(){
+    struct stat st{};
+    bool ok = ::stat(path.c_str(), &st)==0;
+    std::lock_guard<std::mutex> lk(m);
+    if(cur && ok==present && (!ok || (st.st_size==size && st.st_mtim.tv_sec==mtime.tv_sec && st.st_mtim.tv_nsec==mtime.tv_nsec)))
+      return cur;
+    cur = std::make_shared<const Aliases>(load_aliases(path));
+    present = ok;
+    if(ok){ mtime = st.st_mtim; size = st.st_size; }
+    return cur;
+  }
+};
+
 // ---------- State ----------
 static fs::path state_path(const Cfg& c){ return resolve_path(c.data_dir, c.state_file); }
 static long long load_since_state(const Cfg& c){
@@ -357,9 +1464,51 @@ static void save_since_state(const Cfg& c,long long since){
   if(ec) std::cerr<<"state rename err: "<<ec.message()<<"\n";
 }
 
+// ---------- Batch arena ----------
+// Scratch built while handling one /lp or /pull body (decoded event list,
+// per-value status lists) dies together at the end of the batch. It is
+// carved from a monotonic arena and dropped with one release(). The first
+// block is kept across batches and overflow chunks go back to a pool, so a
+// steady stream of batches does not reach malloc.
+class BatchArena {
+  std::vector<std::byte> block;
+  std::pmr::unsynchronized_pool_resource pool;
+  std::pmr::monotonic_buffer_resource mono;
+public:
+  explicit BatchArena(size_t bytes = 64<<10)
+    :block(bytes), mono(block.data(), block.size(), &pool){}
+  std::pmr::memory_resource* resource(){ return &mono; }
+  void release(){ mono.release(); }
+};
+
 // ---------- Envelope processing ----------
-static void process_envelope_and_log(const json& j, const Aliases& A,
-                                     RotatingStream& global, PerContactLogs& pcl){
+// Where an event goes: the global stream, the peer's file and, when
+// enabled, local subscribers and the shared-memory ring. `order` makes the
+// four one step: ring and socket order is file order, so a reader's
+// position (the end offset of the last event it took) never passes an
+// event it has not seen yet.
+struct Sinks {
+  RotatingStream& global; PerContactLogs& pcl; SubServer* pub; RingWriter* ring;
+  std::mutex order;
+};
+
+static void emit_event(Sinks& out, long long ts, std::string_view kind, std::string_view peer,
+                       std::string_view field, std::string_view value){
+  auto ev = event_line(ts, kind, peer, field, value);
+  std::lock_guard<std::mutex> lk(out.order);
+  LogPos g = out.global.append(ts, ev);
+  LogPos p = out.pcl.append(peer, ts, ev);
+  if(out.pub) out.pub->publish(ts, kind, peer, field=="text" ? value : std::string_view(), ev);
+  if(out.ring) out.ring->publish(ts, kind, peer, value, ev, g, p);
+}
+static void log_received(const Aliases& A, std::string_view from, std::string_view text, Sinks& out){
+  emit_event(out, now_ms(), "received", peer_key(A, from), "text", text);
+}
+static void log_status(const Aliases& A, std::string_view to, std::string_view st, Sinks& out){
+  emit_event(out, now_ms(), "status", peer_key(A, to), "status", st);
+}
+
+static void process_envelope_and_log(const json& j, const Aliases& A, Sinks& out){
   if(!j.contains("messages") || !j["messages"].is_array()) return;
   for(const auto& b : j["messages"]){
     if(!b.contains("entry")||!b["entry"].is_array()) continue;
@@ -371,48 +1520,150 @@ static void process_envelope_and_log(const json& j, const Aliases& A,
 
         if(v.contains("messages") && v["messages"].is_array()){
           for(const auto& m : v["messages"]){
-            if(m.value("type",std::string())=="text"){
-              std::string from = m.value("from","");
-              std::string text = m["text"].value("body","");
-              std::string peer = peer_key(A, from);
-              json ev = { {"ts", now_ms()}, {"kind","received"}, {"peer",peer}, {"text",text} };
-              global.append(ev);
-              pcl.append(peer, ev);
-            }
+            if(m.value("type",std::string())=="text")
+              log_received(A, m.value("from",""), m["text"].value("body",""), out);
           }
         }
         if(v.contains("statuses") && v["statuses"].is_array()){
-          for(const auto& s : v["statuses"]){
-            std::string to = s.value("recipient_id","");
-            std::string peer = peer_key(A, to);
-            std::string st = s.value("status","");
-            json ev = { {"ts", now_ms()}, {"kind","status"}, {"peer",peer}, {"status",st} };
-            global.append(ev);
-            pcl.append(peer, ev);
+          for(const auto& s : v["statuses"])
+            log_status(A, s.value("recipient_id",""), s.value("status",""), out);
+        }
+      }
+    }
+  }
+}
+
+#ifdef WA_HAVE_SIMDJSON
+// On-demand walk of a /lp or /pull body: one pass over the bytes, no DOM.
+// Only the common shape is handled here. Anything else (wrong types,
+// malformed input) returns false before a single event is logged, and the
+// caller re-parses with nlohmann, which stays the reference semantics.
+// String views point into the parser's buffer and live until the next body.
+struct WireEvent { bool status; std::string_view num, val; };
+
+static bool scan_body_ondemand(std::string& body, std::pmr::vector<WireEvent>& out,
+                               long long& next_since, long long& count){
+  namespace od = simdjson::ondemand;
+  thread_local od::parser parser;
+  auto key=[](od::field& f)->std::string_view{ return f.unescaped_key(); };
+  out.clear();
+  try{
+    body.reserve(body.size() + simdjson::SIMDJSON_PADDING);
+    od::document doc = parser.iterate(simdjson::padded_string_view(body.data(), body.size(), body.capacity()));
+    std::pmr::vector<WireEvent> statuses(out.get_allocator());
+    for(od::field top : doc.get_object()){
+      std::string_view k = key(top);
+      if(k=="next_since") next_since = top.value().get_int64();
+      else if(k=="count") count = top.value().get_int64();
+      else if(k!="messages") continue;
+      else for(od::object b : top.value().get_array()){
+        for(od::field bf : b){
+          if(key(bf)!="entry") continue;
+          for(od::object e : bf.value().get_array()){
+            for(od::field ef : e){
+              if(key(ef)!="changes") continue;
+              for(od::object ch : ef.value().get_array()){
+                for(od::field cf : ch){
+                  if(key(cf)!="value") continue;
+                  statuses.clear();   // json path: all messages of a value, then its statuses
+                  for(od::field vf : cf.value().get_object()){
+                    std::string_view vk = key(vf);
+                    if(vk=="messages"){
+                      for(od::object m : vf.value().get_array()){
+                        WireEvent w{false, {}, {}}; bool text = false;
+                        for(od::field mf : m){
+                          std::string_view mk = key(mf);
+                          if(mk=="type") text = mf.value().get_string().value()=="text";
+                          else if(mk=="from") w.num = mf.value().get_string();
+                          else if(mk=="text"){
+                            for(od::field tf : mf.value().get_object())
+                              if(key(tf)=="body") w.val = tf.value().get_string();
+                          }
+                        }
+                        if(text) out.push_back(w);
+                      }
+                    } else if(vk=="statuses"){
+                      for(od::object st : vf.value().get_array()){
+                        WireEvent w{true, {}, {}};
+                        for(od::field sf : st){
+                          std::string_view sk = key(sf);
+                          if(sk=="recipient_id") w.num = sf.value().get_string();
+                          else if(sk=="status") w.val = sf.value().get_string();
+                        }
+                        statuses.push_back(w);
+                      }
+                    }
+                  }
+                  out.insert(out.end(), statuses.begin(), statuses.end());
+                }
+              }
+            }
           }
         }
       }
     }
+    if(!doc.at_end()) return false;
+  } catch(const simdjson::simdjson_error&){ return false; }
+  return true;
+}
+
+// simdjson's "fallback" kernel is plain scalar code; nlohmann is used instead.
+static bool ondemand_usable(){
+  static const bool ok = simdjson::get_active_implementation()->name() != "fallback";
+  return ok;
+}
+#endif
+
+// Logs the events of one /lp or /pull body. next_since/count keep their
+// value when absent. Returns false if the body is not JSON. Batch scratch
+// comes from `arena`, which is released before returning.
+static bool ingest_body(std::string& body, const Cfg& c, const Aliases& A, BatchArena& arena,
+                        Sinks& out, long long& next_since, long long& count){
+#ifdef WA_HAVE_SIMDJSON
+  if(c.json_parser!="nlohmann" && ondemand_usable()){
+    bool ok;
+    {
+      std::pmr::vector<WireEvent> evs(arena.resource());
+      evs.reserve(c.pull_limit*2);
+      long long ns = next_since, n = count;
+      ok = scan_body_ondemand(body, evs, ns, n);
+      if(ok){
+        for(const auto& w : evs){
+          if(w.status) log_status(A, w.num, w.val, out);
+          else log_received(A, w.num, w.val, out);
+        }
+        next_since = ns; count = n;
+      }
+    }
+    arena.release();
+    if(ok) return true;
   }
+#else
+  (void)c; (void)arena;
+#endif
+  auto j = json::parse(body, nullptr, false);
+  if(j.is_discarded()) return false;
+  process_envelope_and_log(j, A, out);
+  next_since = j.value("next_since", next_since);
+  count = j.value("count", count);
+  return true;
 }
 
 // ---------- Catch-up ----------
-static long long catch_up_all_history(const Cfg& c, RotatingStream& global, PerContactLogs& pcl){
+static long long catch_up_all_history(const Cfg& c, AliasCache& aliases, Sinks& out){
   long long cursor = 0;
+  BatchArena arena;
+  std::string body;
   for(;;){
     long code=0;
     std::ostringstream url;
     url<<c.worker<<"/pull?since="<<cursor<<"&limit="<<c.pull_limit;
-    auto body = http_get(url.str(), &code);
+    http_get_into(url.str(), body, &code);
     if(code/100!=2){ std::cerr<<"pull http "<<code<<"\n"; break; }
-    auto j = json::parse(body, nullptr, false);
-    if(j.is_discarded()) break;
-
-    Aliases A = load_aliases(c.aliases_path);
-    process_envelope_and_log(j, A, global, pcl);
 
-    long long next_since = j.value("next_since", cursor);
-    long long count = j.value("count", 0LL);
+    auto A = aliases.get();
+    long long next_since = cursor, count = 0;
+    if(!ingest_body(body, c, *A, arena, out, next_since, count)) break;
     cursor = next_since;
     save_since_state(c, cursor);
 
@@ -421,9 +1672,83 @@ static long long catch_up_all_history(const Cfg& c, RotatingStream& global, PerC
   return cursor;
 }
 
+// ---------- Layout migration ----------
+// `wa-hub --migrate-layout [--jobs N]` moves every per-peer file (live log,
+// archives, manifest) to the directory per_fanout assigns it, in either
+// direction. Run it with wa-hub stopped. Moves are renames within per_dir,
+// one metadata operation each; N workers overlap them on high-latency mounts.
+static int migrate_layout(const Cfg& c, int jobs){
+  const std::string& pre = c.per_prefix; const std::string& suf = c.per_suffix;
+  auto key_of=[&](const std::string& n, std::string& key){
+    if(n.rfind(pre,0)!=0 || n.size() < pre.size()+suf.size()+1) return false;
+    if(n.compare(n.size()-suf.size(), suf.size(), suf)==0){ key = n.substr(pre.size(), n.size()-pre.size()-suf.size()); return true; }
+    size_t at = n.find(suf + ".", pre.size()+1);
+    if(at==std::string::npos) return false;
+    key = n.substr(pre.size(), at-pre.size());
+    return true;
+  };
+
+  struct Move { fs::path from, to; };
+  std::vector<Move> moves;
+  std::unordered_set<std::string> seen;
+  for(int f=0; f<=2; f++) for(const auto& d : peer_dirs(c.per_dir, f)){
+    if(!seen.insert(d.string()).second) continue;
+    std::error_code ec;
+    for(auto it=fs::directory_iterator(d, ec); !ec && it!=fs::directory_iterator(); it.increment(ec)){
+      if(!it->is_regular_file(ec)) continue;
+      std::string n = it->path().filename().string(), key;
+      if(d==c.global_dir && n.rfind(c.global_name,0)==0) continue;
+      if(!key_of(n, key)) continue;
+      fs::path to = c.per_dir / peer_shard(key, c.per_fanout) / n;
+      if(to!=it->path()) moves.push_back({it->path(), to});
+    }
+    for(auto it=fs::directory_iterator(d / ".manifest", ec); !ec && it!=fs::directory_iterator(); it.increment(ec)){
+      std::string n = it->path().filename().string(), key;
+      if(n.size()<6 || n.compare(n.size()-5,5,".json")!=0 || !key_of(n.substr(0, n.size()-5), key)) continue;
+      fs::path to = c.per_dir / peer_shard(key, c.per_fanout) / ".manifest" / n;
+      if(to!=it->path()) moves.push_back({it->path(), to});
+    }
+  }
+
+  std::atomic<size_t> next{0}, moved{0}, failed{0};
+  auto work=[&]{
+    for(size_t i; (i=next++) < moves.size();){
+      const auto& mv = moves[i];
+      std::error_code ec;
+      fs::create_directories(mv.to.parent_path(), ec);
+      if(fs::exists(mv.to, ec)){ std::cerr<<"skip (target exists): "<<mv.to.string()<<"\n"; failed++; continue; }
+      fs::rename(mv.from, mv.to, ec);
+      if(ec){ std::cerr<<"move "<<mv.from.string()<<": "<<ec.message()<<"\n"; failed++; continue; }
+      moved++;
+    }
+  };
+  std::vector<std::thread> pool;
+  for(int i=0;i<std::max(1,jobs);i++) pool.emplace_back(work);
+  for(auto& t : pool) t.join();
+  // drop shard directories the move emptied (remove() refuses non-empty ones)
+  for(int f=2; f>=1; f--) for(const auto& d : peer_dirs(c.per_dir, f)){
+    std::error_code ec; fs::remove(d / ".manifest", ec); fs::remove(d, ec);
+  }
+  std::cerr<<"migrate-layout: per_fanout="<<c.per_fanout<<" moved "<<moved<<" of "<<moves.size()
+           <<" files"<<(failed? (", "+std::to_string(failed.load())+" failed") : std::string())<<"\n";
+  return failed? 5 : 0;
+}
+
 // ---------- MAIN ----------
 int main(int argc,char**argv){
   Cfg cfg = load_cfg(argc, argv);
+  for(int i=1;i<argc;i++) if(std::string(argv[i])=="--migrate-layout"){
+    int jobs = 8;
+    for(int k=1;k<argc;k++) if(std::string(argv[k])=="--jobs"){
+      const char* v = k+1<argc ? argv[k+1] : "";
+      auto [end, ec] = std::from_chars(v, v+std::strlen(v), jobs);
+      if(ec!=std::errc() || *end || jobs<1 || jobs>256){
+        std::cerr<<"usage: wa-hub --migrate-layout [--jobs N]   (N: 1..256)\n";
+        return 2;
+      }
+    }
+    return migrate_layout(cfg, jobs);
+  }
   if(cfg.worker.empty() || cfg.phone_id.empty()){
     std::cerr<<"Set worker and phone_id via config/env/CLI\n";
     return 1;
@@ -444,21 +1769,86 @@ int main(int argc,char**argv){
   FILE* fifo_in = fdopen(fd_r, "r");
   if(!fifo_in){ std::perror("fdopen fifo"); return 2; }
 
-  // Global/per logs (rotating)
-  RotatorCfg g_rcfg{cfg.rotate_global_bytes, cfg.archive_timefmt};
-  RotatorCfg p_rcfg{cfg.rotate_peer_bytes,   cfg.archive_timefmt};
-  fs::path glog_path = cfg.global_dir / cfg.global_name;
-
-  RotatingStream global(glog_path, g_rcfg);
-  PerContactLogs pcl(cfg.per_dir, cfg.per_prefix, cfg.per_suffix, p_rcfg);
-
   // Meta log (no rotation)
   fs::create_directories(cfg.data_dir);
-  std::ofstream meta(cfg.data_dir / cfg.meta_log, std::ios::app);
+  utf8_policy() = utf8_policy_from_name(cfg.utf8_policy);
+  MetaLog meta(cfg.data_dir / cfg.meta_log);
   if(!meta.good()){ std::cerr<<"cannot open meta log\n"; return 4; }
 
+  // Archived segments: catalog (seeded once), compaction/indexing, retention
+  Codec codec = codec_from_name(cfg.archive_compress);
+  SegmentCatalog catalog(cfg.manifest, cfg.per_dir);
+  auto todo_g = catalog.seed(cfg.global_dir, cfg.global_name, cfg.global_name, false, codec!=Codec::None);
+  std::vector<fs::path> todo_p;
+  for(const auto& d : peer_dirs(cfg.per_dir, cfg.per_fanout)){
+    auto t = catalog.seed(d, cfg.per_prefix, cfg.per_suffix, true, codec!=Codec::None);
+    todo_p.insert(todo_p.end(), t.begin(), t.end());
+  }
+
+  // Tiered mode: live logs go to the local spool, the shipper mirrors them to
+  // global_dir/per_dir; the catalog and retention only ever see NAS paths.
+  bool spooled = !cfg.spool_dir.empty();
+  fs::path w_global_dir = spooled? cfg.spool_dir / "global" : cfg.global_dir;
+  fs::path w_per_dir    = spooled? cfg.spool_dir / "peers"  : cfg.per_dir;
+  fs::path glog_path = cfg.global_dir / cfg.global_name;
+  std::unique_ptr<Shipper> shipper;
+
+  Compactor compactor(codec, cfg.compress_level, cfg.compress_frame_bytes, cfg.manifest,
+    [&](const fs::path& from, const fs::path& to, const SegStats& st){
+      if(shipper && shipper->owns(from)){ shipper->closed(from, to, st); return; }
+      std::error_code ec;
+      if(!catalog.replace(from, to, st) && to!=from) fs::remove(to, ec); // pruned while compacting
+    });
+  // archives left uncompressed/unindexed by an earlier run (or a crash mid-compaction)
+  for(const auto& p : todo_g) compactor.enqueue(p);
+  for(const auto& p : todo_p) compactor.enqueue(p);
+
+  if(spooled){
+    fs::create_directories(w_global_dir); fs::create_directories(w_per_dir);
+    shipper = std::make_unique<Shipper>(
+      std::vector<Shipper::Root>{{w_global_dir, cfg.global_dir, cfg.global_name, cfg.global_name, 0},
+                                 {w_per_dir, cfg.per_dir, cfg.per_prefix, cfg.per_suffix, cfg.per_fanout}},
+      cfg.ship_interval_ms,
+      [&](const fs::path& arch, const SegStats& st){
+        if(compactor.enabled()) compactor.enqueue(arch); else shipper->closed(arch, arch, st);
+      },
+      [&](const fs::path& nas_live, const fs::path& nas_file, const SegStats& st){
+        catalog.add(nas_live, nas_live!=glog_path, nas_file, false, st);
+      });
+    shipper->recover();
+  }
+
+  Retention retention(cfg.retention, catalog, meta);
+
+  // Global/per logs (rotating)
+  auto on_archive = [&](const fs::path& live, const fs::path& arch, const SegStats& st){
+    if(shipper){ shipper->rotated(live, arch, st); return; }
+    catalog.add(live, live!=glog_path, arch, compactor.compressing(), st);
+    compactor.enqueue(arch);
+  };
+  std::function<void(const fs::path&)> on_append;
+  if(shipper) on_append = [&](const fs::path& live){ shipper->touched(live); };
+  RotatorCfg g_rcfg{cfg.rotate_global_bytes, cfg.archive_timefmt, on_archive,
+                    interval_from_name(cfg.rotate_global_interval), cfg.rotate_global_events, on_append};
+  RotatorCfg p_rcfg{cfg.rotate_peer_bytes,   cfg.archive_timefmt, on_archive,
+                    interval_from_name(cfg.rotate_peer_interval),   cfg.rotate_peer_events, on_append};
+
+  RotatingStream global(w_global_dir / cfg.global_name, g_rcfg);
+  PerContactLogs pcl(w_per_dir, cfg.per_prefix, cfg.per_suffix, p_rcfg, cfg.per_fanout);
+
+  std::unique_ptr<SubServer> pub;
+  if(!cfg.sub_socket.empty()) pub = std::make_unique<SubServer>(cfg.sub_socket, cfg.sub_replay_events, cfg.sub_client_buffer, "sub_socket");
+  RingWriter ring;
+  if(!cfg.shm_ring.empty()){
+    std::error_code ec; fs::create_directories(cfg.shm_ring.parent_path(), ec);
+    if(!ring.open(cfg.shm_ring.string(), (uint32_t)std::max(64, cfg.shm_ring_slots), (uint64_t)now_ms()))
+      std::perror(("shm_ring " + cfg.shm_ring.string()).c_str());
+  }
+  Sinks sinks{global, pcl, pub && pub->good() ? pub.get() : nullptr, ring.good() ? &ring : nullptr, {}};
+
   long long s0 = load_since_state(cfg);
-  if(s0 < 0){ s0 = catch_up_all_history(cfg, global, pcl); }
+  AliasCache aliases(cfg.aliases_path);
+  if(s0 < 0){ s0 = catch_up_all_history(cfg, aliases, sinks); }
   std::atomic<long long> since{s0};
   std::atomic<bool> running{true};
 
@@ -472,17 +1862,17 @@ int main(int argc,char**argv){
       json cmd = json::parse(s, nullptr, false);
       if(cmd.is_discarded()){ std::cerr<<"bad send JSON: "<<s<<"\n"; continue; }
 
-      Aliases A = load_aliases(cfg.aliases_path);
+      auto A = aliases.get();
       std::string to = cmd.value("to","");
       if(to.empty() && cmd.contains("alias")) to = cmd.value("alias","");
       std::string text = cmd.value("text","");
       if(to.empty()||text.empty()){ std::cerr<<"send needs {to|alias, text}\n"; continue; }
-      if(A.alias_to_num.count(to)) to = A.alias_to_num[to];
+      if(auto it=A->alias_to_num.find(to); it!=A->alias_to_num.end()) to = it->second;
 
-      json payload = {{"phone_number_id",cfg.phone_id},{"to",to},{"text",text}};
+      json payload = {{"phone_number_id",cfg.phone_id},{"to",to},{"text",utf8_clean(text)}};
       long code=0; auto resp=http_post_json(cfg.worker+"/send", payload.dump(), &code);
       long long ts = now_ms();
-      std::string peer = peer_key(A, to);
+      std::string peer(peer_key(*A, to));
 
       // meta/debug
       json jr = json::parse(resp, nullptr, false);
@@ -505,39 +1895,34 @@ int main(int argc,char**argv){
           err["message"]=e.value("message",std::string());
           if(e.contains("error_data")) err["details"]=e["error_data"].value("details",std::string());
           err["fbtrace_id"]=e.value("fbtrace_id",std::string());
-        } else { err["message"]="non-JSON or empty response"; err["raw"]=resp; }
+        } else { err["message"]="non-JSON or empty response"; err["raw"]=utf8_clean(resp); }
         meta_line["error"]=err;
       }
-      meta<<meta_line.dump()<<'\n'; meta.flush();
+      meta.write(meta_line);
 
       // event logs
       if(code/100==2){
-        json ev = { {"ts",ts},{"kind","sent"},{"peer",peer},{"text",text} };
-        global.append(ev);
-        pcl.append(peer, ev);
+        emit_event(sinks, ts, "sent", peer, "text", text);
       } else {
-        json ev = { {"ts",ts},{"kind","status"},{"peer",peer},{"status","failed"} };
-        global.append(ev);
-        pcl.append(peer, ev);
+        emit_event(sinks, ts, "status", peer, "status", "failed");
       }
     }
   });
 
   // Receiver loop (long-poll)
+  BatchArena arena;
+  std::string body;
   while(running){
     long code=0;
     std::ostringstream url;
     url<<cfg.worker<<"/lp?since="<<since.load()<<"&timeout="<<cfg.lp_timeout_sec
        <<"&limit="<<cfg.pull_limit;
-    auto body = http_get(url.str(), &code);
+    http_get_into(url.str(), body, &code);
     if(code/100!=2){ std::cerr<<"lp http "<<code<<"\n"; std::this_thread::sleep_for(std::chrono::milliseconds(250)); continue; }
 
-    auto j = json::parse(body, nullptr, false);
-    if(j.is_discarded()) continue;
-    long long next_since = j.value("next_since", since.load());
-
-    Aliases A = load_aliases(cfg.aliases_path);
-    process_envelope_and_log(j, A, global, pcl);
+    auto A = aliases.get();
+    long long next_since = since.load(), count = 0;
+    if(!ingest_body(body, cfg, *A, arena, sinks, next_since, count)) continue;
 
     since.store(next_since);
     save_since_state(cfg, next_since);
@@ -0,0 +1,25 @@
+// wa-layout.hpp — on-disk layout of per-peer logs, shared by wa-hub and wa-sub.
+//
+// With per_fanout = N (1 or 2), per-peer files live N hashed levels below
+// per_dir, e.g. per_dir/3f/a0/events.max.jsonl, so no directory holds more
+// than a few hundred entries. Shard = leading bytes of FNV-1a-32(key) in hex.
+// wa-hub writes and migrates this layout and wa-sub finds files with it, so
+// there is exactly one copy.
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+inline uint32_t fnv1a32(const std::string& s){
+  uint32_t h = 2166136261u;
+  for(unsigned char c : s){ h ^= c; h *= 16777619u; }
+  return h;
+}
+
+// Directory of `key`'s files relative to per_dir ("" for fanout 0).
+inline std::filesystem::path peer_shard(const std::string& key, int fanout){
+  std::filesystem::path p; uint32_t h = fnv1a32(key);
+  for(int i=0;i<fanout && i<4;i++){ char b[3]; std::snprintf(b, sizeof(b), "%02x", (h>>(24-8*i))&0xff); p /= b; }
+  return p;
+}
@@ -0,0 +1,265 @@
+// wa-pubsub.hpp — fan-out of log events to local subscribers over a Unix socket.
+//
+// Shared by wa-hub (sub_socket) and wa-sub --serve. A client sends one JSON
+// line (all keys optional)
+//   {"kinds":["received"],"peers":["max"],"grep":"(?i)deploy","from_seq":1200,"seq":true}
+// and receives {"op":"hello","next_seq":S,"oldest_seq":O,...}, then matching
+// events exactly as logged, or as {"seq":N,"event":{...}} with "seq":true.
+// Events are numbered from 1 per server run; the last `window_events` are
+// held for from_seq replay. Each client has a cursor into that window and at
+// most `client_buffer` bytes of unsent output; one that falls off the window
+// gets {"op":"dropped","count":K,"next_seq":S} and should fill the hole from
+// the files. A binary adds its own request keys, hello fields and filters
+// through SubServer::Hooks.
+//
+// Window entries are immutable and shared: the server thread takes handles
+// under the lock and filters and formats after releasing it, so publish()
+// (the logging path) never waits on a subscriber's grep.
+#pragma once
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct SubEvent {
+  uint64_t seq = 0;
+  long long ts = 0;
+  std::string kind, peer, text, line;   // text: "" if the event has none; line ends in '\n'
+};
+
+// What a binary's request hook adds to one subscription.
+struct SubExtra {
+  std::function<bool(const SubEvent&)> accept;   // further filter, run without the lock
+  long long start_ts = 0;                        // without from_seq: start at the first held event with ts >= this
+};
+
+class SubServer {
+public:
+  struct Hooks {
+    // Extra request keys; returns an error for the client, or "".
+    std::function<std::string(const nlohmann::json& req, SubExtra& x)> request;
+    // Extra hello fields (called under the window lock).
+    std::function<void(nlohmann::ordered_json& hello)> hello;
+    // An event leaves the window (called under the window lock).
+    std::function<void(const SubEvent&)> evicted;
+  };
+
+private:
+  using EvPtr = std::shared_ptr<const SubEvent>;
+  static constexpr size_t kFillBatch = 256;        // handles taken per lock
+
+  struct Client {
+    int fd = -1;
+    std::string in;
+    bool subscribed = false, close_after_flush = false, with_seq = false;
+    std::unordered_set<std::string> kinds, peers;
+    std::optional<std::regex> re;
+    SubExtra extra;
+    std::string out; size_t sent = 0;
+    uint64_t next = 0;
+  };
+
+  std::filesystem::path path; size_t window_cap, buf_cap;
+  Hooks hooks;
+  std::mutex m;
+  std::deque<EvPtr> window;
+  uint64_t next_seq = 1;
+  int lfd = -1, efd = -1;
+  std::atomic<bool> wake_pending{false}, stop{false};
+  std::vector<Client> clients;   // server thread only
+  std::vector<EvPtr> batch;      // server thread only
+  std::thread th;
+
+  static void control(Client& c, const nlohmann::ordered_json& j){ c.out += j.dump() + "\n"; }
+  void drop(Client& c){ if(c.fd>=0) ::close(c.fd); c.fd = -1; }
+
+  void subscribe(Client& c, const std::string& req){
+    auto fail=[&](const std::string& msg){
+      control(c, {{"op","error"},{"message",msg}}); c.close_after_flush = true;
+    };
+    nlohmann::json j = nlohmann::json::parse(req, nullptr, false);
+    if(j.is_discarded() || !j.is_object()) return fail("request must be one JSON object per line");
+    auto strings=[&](const char* k, std::unordered_set<std::string>& dst){
+      if(j.contains(k) && j[k].is_array()) for(const auto& v : j[k]) if(v.is_string()) dst.insert(v.get<std::string>());
+    };
+    strings("kinds", c.kinds); strings("peers", c.peers);
+    if(j.contains("grep") && j["grep"].is_string()){
+      std::string pat = j["grep"].get<std::string>();
+      auto flags = std::regex::ECMAScript;
+      if(pat.rfind("(?i)",0)==0){ flags |= std::regex::icase; pat = pat.substr(4); }
+      try{ c.re.emplace(pat, flags); }catch(const std::regex_error& e){ return fail(std::string("bad grep: ")+e.what()); }
+    }
+    if(hooks.request){ std::string err = hooks.request(j, c.extra); if(!err.empty()) return fail(err); }
+    c.with_seq = j.value("seq", false);
+    std::lock_guard<std::mutex> lk(m);
+    uint64_t oldest = window.empty()? next_seq : window.front()->seq;
+    if(j.contains("from_seq") && j["from_seq"].is_number_unsigned()) c.next = std::min(j["from_seq"].get<uint64_t>(), next_seq);
+    else {
+      c.next = next_seq;
+      if(c.extra.start_ts) for(const auto& e : window) if(e->ts >= c.extra.start_ts){ c.next = e->seq; break; }
+    }
+    c.subscribed = true;
+    nlohmann::ordered_json hello = {{"op","hello"},{"next_seq",next_seq},{"oldest_seq",oldest}};
+    if(hooks.hello) hooks.hello(hello);
+    control(c, hello);
+  }
+
+  bool wanted(const Client& c, const SubEvent& e) const {
+    if(!c.kinds.empty() && !c.kinds.count(e.kind)) return false;
+    if(!c.peers.empty() && !c.peers.count(e.peer)) return false;
+    if(c.re && !std::regex_search(e.text, *c.re)) return false;
+    return !c.extra.accept || c.extra.accept(e);
+  }
+
+  // Moves matching events into c.out up to buf_cap. Returns true if it
+  // stopped because the buffer is full.
+  bool fill(Client& c){
+    if(!c.subscribed || c.close_after_flush) return false;
+    for(;;){
+      batch.clear();
+      {
+        std::lock_guard<std::mutex> lk(m);
+        uint64_t oldest = window.empty()? next_seq : window.front()->seq;
+        if(c.next < oldest){
+          control(c, {{"op","dropped"},{"count",oldest-c.next},{"next_seq",oldest}});
+          c.next = oldest;
+        }
+        for(uint64_t s = c.next; s < next_seq && batch.size() < kFillBatch; s++) batch.push_back(window[s - oldest]);
+      }
+      if(batch.empty()) return false;
+      for(const EvPtr& p : batch){
+        if(c.out.size()-c.sent >= buf_cap){ c.next = p->seq; return true; }
+        const SubEvent& e = *p;
+        c.next = e.seq + 1;
+        if(!wanted(c, e)) continue;
+        if(c.with_seq){
+          c.out += "{\"seq\":"; c.out += std::to_string(e.seq); c.out += ",\"event\":";
+          c.out.append(e.line.data(), e.line.size()-1); c.out += "}\n";
+        } else c.out += e.line;
+      }
+    }
+  }
+  // Writes what the socket takes without blocking. True if c.out drained.
+  bool flush(Client& c){
+    while(c.fd>=0 && c.sent < c.out.size()){
+      ssize_t n = ::send(c.fd, c.out.data()+c.sent, c.out.size()-c.sent, MSG_NOSIGNAL|MSG_DONTWAIT);
+      if(n>0){ c.sent += (size_t)n; continue; }
+      if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)) return false;
+      drop(c); return false;
+    }
+    c.out.clear(); c.sent = 0;
+    if(c.close_after_flush) drop(c);
+    return c.fd>=0;
+  }
+  void pump(Client& c){ while(c.fd>=0 && fill(c) && flush(c)){} if(c.fd>=0) flush(c); }
+
+  void read_request(Client& c){
+    char buf[4096];
+    for(;;){
+      ssize_t n = ::recv(c.fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if(n==0){ drop(c); return; }
+      if(n<0){ if(errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) drop(c); return; }
+      if(c.subscribed) continue;          // one request per connection; later input is ignored
+      c.in.append(buf, (size_t)n);
+      size_t nl = c.in.find('\n');
+      if(nl!=std::string::npos){ subscribe(c, c.in.substr(0, nl)); c.in.clear(); }
+      else if(c.in.size() > 64*1024){ drop(c); return; }
+    }
+  }
+
+  void run(){
+    while(!stop){
+      std::vector<pollfd> pf{{efd,POLLIN,0},{lfd,POLLIN,0}};
+      for(const auto& c : clients) pf.push_back({c.fd, (short)(POLLIN | (c.sent<c.out.size()? POLLOUT : 0)), 0});
+      if(::poll(pf.data(), pf.size(), 1000)<0 && errno!=EINTR) break;
+      if(pf[0].revents & POLLIN){ uint64_t v; if(::read(efd, &v, sizeof(v))<0){} wake_pending = false; }
+      for(size_t i=0;i<clients.size();i++){
+        auto& c = clients[i];
+        short rev = pf[i+2].revents;
+        if(rev & POLLIN) read_request(c);
+        if(c.fd>=0 && (rev & (POLLERR|POLLHUP|POLLNVAL)) && !(rev & POLLIN)) drop(c);
+        if(c.fd>=0) pump(c);
+      }
+      if(pf[1].revents & POLLIN){
+        for(int fd; (fd = ::accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC))>=0; ){
+          Client c; c.fd = fd; clients.push_back(std::move(c));
+        }
+      }
+      clients.erase(std::remove_if(clients.begin(), clients.end(), [](const Client& c){ return c.fd<0; }), clients.end());
+    }
+    for(auto& c : clients) drop(c);
+  }
+
+public:
+  // `what` names the socket in error messages.
+  SubServer(std::filesystem::path p, size_t window_events, size_t client_buffer, const char* what, Hooks h = {})
+    :path(std::move(p)), window_cap(std::max<size_t>(1, window_events)), buf_cap(std::max<size_t>(4096, client_buffer)),
+     hooks(std::move(h)){
+    sockaddr_un a{}; a.sun_family = AF_UNIX;
+    if(path.string().size() >= sizeof(a.sun_path)){ std::cerr<<what<<" path too long: "<<path<<"\n"; return; }
+    std::strncpy(a.sun_path, path.c_str(), sizeof(a.sun_path)-1);
+    std::error_code ec; std::filesystem::create_directories(path.parent_path(), ec);
+    ::unlink(path.c_str());   // stale socket from an earlier run
+    lfd = ::socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(lfd<0 || ::bind(lfd, (sockaddr*)&a, sizeof(a))!=0 || ::listen(lfd, 64)!=0){
+      std::perror(what); if(lfd>=0) ::close(lfd); lfd = -1; return;
+    }
+    ::chmod(path.c_str(), 0600);
+    efd = ::eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    th = std::thread([this]{ run(); });
+  }
+  SubServer(const SubServer&) = delete;
+  SubServer& operator=(const SubServer&) = delete;
+  bool good() const { return lfd>=0; }
+
+  // Called on the logging path: one copy into the window, a wakeup only if
+  // the server thread is not already due to run. `line` with or without '\n'.
+  void publish(long long ts, std::string_view kind, std::string_view peer, std::string_view text, std::string_view line){
+    if(lfd<0) return;
+    auto e = std::make_shared<SubEvent>();
+    e->ts = ts; e->kind = kind; e->peer = peer; e->text = text;
+    e->line.reserve(line.size()+1); e->line = line;
+    if(e->line.empty() || e->line.back()!='\n') e->line += '\n';
+    EvPtr old;                               // freed after the lock is released
+    {
+      std::lock_guard<std::mutex> lk(m);
+      e->seq = next_seq++;
+      window.push_back(std::move(e));
+      if(window.size() > window_cap){
+        old = std::move(window.front()); window.pop_front();
+        if(hooks.evicted) hooks.evicted(*old);
+      }
+    }
+    if(!wake_pending.exchange(true)){ uint64_t one = 1; if(::write(efd, &one, sizeof(one))<0){} }
+  }
+
+  ~SubServer(){
+    if(lfd<0) return;
+    stop = true;
+    uint64_t one = 1; if(::write(efd, &one, sizeof(one))<0){}
+    if(th.joinable()) th.join();
+    ::close(lfd); ::close(efd);
+    ::unlink(path.c_str());
+  }
+};
@@ -0,0 +1,241 @@
+// wa-ring.hpp — shared-memory event ring between wa-hub and local readers.
+//
+// wa-hub appends every logged event to a file-backed ring (normally under
+// /dev/shm); readers in other processes map it read-only and consume events
+// with plain loads, blocking on a futex only when they have caught up.
+//
+// Layout: a RingHeader page, then a power-of-two array of 256-byte slots.
+// Positions count slots monotonically; slot index = pos & (slots-1). One
+// event is a RingRec header plus kind, peer, value and the exact log line,
+// spread over as many consecutive slots as it needs. Each slot has its own
+// seqlock (odd while being written) and records the position it holds, so a
+// reader that was lapped sees it and falls back to the log files.
+// Every event also says where its line ends in the global and the peer log
+// (inode, offset), so readers can tell which events they already read from
+// a file and resume from the exact line after the last one taken.
+// wa-hub replaces the file (new inode, new epoch) when it restarts.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+constexpr uint32_t kRingMagic     = 0x47524157;   // "WARG"
+constexpr uint32_t kRingVersion   = 2;
+constexpr uint32_t kRingSlotBytes = 256;
+
+struct RingHeader {
+  uint32_t magic, version, slots, slot_bytes;
+  uint64_t epoch;                                  // wa-hub start, ms
+  alignas(64) std::atomic<uint64_t> head;          // first position not yet published
+  std::atomic<int64_t>  last_ts;                   // ts of the newest event
+  alignas(64) std::atomic<uint32_t> notify;        // futex word, bumped per event
+};
+struct RingSlot {
+  std::atomic<uint32_t> ver;                       // seqlock: odd while being written
+  uint32_t used;                                   // payload bytes in this slot
+  uint64_t pos;                                    // position this content belongs to
+  char data[kRingSlotBytes - 16];
+};
+struct LogPos {
+  uint64_t ino = 0, end = 0;                       // log file inode; offset just past the line
+};
+struct RingRec {
+  uint32_t nslots;                                 // slots this event occupies
+  uint32_t flags;                                  // kRecNoValue: value omitted (oversized), kRecGap: event not stored
+  int64_t  ts;
+  uint32_t kind_len, peer_len, value_len, line_len;
+  LogPos   global_at, peer_at;                     // where wa-hub wrote the line
+};
+constexpr uint32_t kRecNoValue = 1, kRecGap = 2;
+constexpr size_t kRingHeaderBytes = 4096;
+static_assert(sizeof(RingSlot)==kRingSlotBytes, "slot layout");
+static_assert(sizeof(RingHeader)<=kRingHeaderBytes, "header layout");
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "ring atomics must be address-free");
+
+inline size_t ring_bytes(uint32_t slots){ return kRingHeaderBytes + (size_t)slots*kRingSlotBytes; }
+
+// ---------- Writer (wa-hub) ----------
+class RingWriter {
+  std::string path;
+  void* base = nullptr; size_t bytes = 0;
+  RingHeader* h = nullptr; RingSlot* slot = nullptr; uint64_t mask = 0;
+  std::mutex m;          // several hub threads log events; the ring has one producer
+  std::string rec;
+
+  void put_slot(uint64_t pos, const char* p, uint32_t n){
+    RingSlot& s = slot[pos & mask];
+    uint32_t v = s.ver.load(std::memory_order_relaxed);
+    s.ver.store(v+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.pos = pos; s.used = n;
+    std::memcpy(s.data, p, n);
+    s.ver.store(v+2, std::memory_order_release);
+  }
+
+public:
+  RingWriter() = default;
+  RingWriter(const RingWriter&) = delete;
+  RingWriter& operator=(const RingWriter&) = delete;
+
+  // Creates a fresh ring at `p` (built under a temporary name, then renamed
+  // over any previous one so existing readers keep a valid mapping).
+  bool open(const std::string& p, uint32_t slots, uint64_t epoch){
+    uint32_t n = 64; while(n < slots && n < (1u<<24)) n <<= 1;
+    path = p; bytes = ring_bytes(n);
+    std::string tmp = p + ".tmp";
+    int fd = ::open(tmp.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(fd<0) return false;
+    if(::ftruncate(fd, (off_t)bytes)!=0){ ::close(fd); ::unlink(tmp.c_str()); return false; }
+    base = ::mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(base==MAP_FAILED){ base = nullptr; ::unlink(tmp.c_str()); return false; }
+    h = new (base) RingHeader{};
+    h->version = kRingVersion; h->slots = n; h->slot_bytes = kRingSlotBytes; h->epoch = epoch;
+    slot = (RingSlot*)((char*)base + kRingHeaderBytes); mask = n-1;
+    std::atomic_thread_fence(std::memory_order_release);
+    h->magic = kRingMagic;
+    if(::rename(tmp.c_str(), p.c_str())!=0){ ::munmap(base, bytes); base = nullptr; ::unlink(tmp.c_str()); return false; }
+    return true;
+  }
+  bool good() const { return base!=nullptr; }
+
+  void publish(long long ts, std::string_view kind, std::string_view peer,
+               std::string_view value, std::string_view line, LogPos global_at, LogPos peer_at){
+    if(!base) return;
+    const size_t payload = sizeof(RingSlot::data);
+    const size_t max_slots = (mask+1)/4;             // keep room for other events
+    RingRec r{0, 0, ts, (uint32_t)kind.size(), (uint32_t)peer.size(), (uint32_t)value.size(), (uint32_t)line.size(),
+              global_at, peer_at};
+    auto need=[&]{ return (sizeof(RingRec)+r.kind_len+r.peer_len+r.value_len+r.line_len + payload-1)/payload; };
+    if(need() > max_slots){ r.flags |= kRecNoValue; r.value_len = 0; }
+    if(need() > max_slots){ r.flags |= kRecGap; r.line_len = 0; }
+    r.nslots = (uint32_t)need();
+
+    std::lock_guard<std::mutex> lk(m);
+    rec.assign((const char*)&r, sizeof(r));
+    rec.append(kind); rec.append(peer);
+    rec.append(value.data(), r.value_len); rec.append(line.data(), r.line_len);
+    uint64_t pos = h->head.load(std::memory_order_relaxed);
+    for(uint32_t i=0; i<r.nslots; i++){
+      size_t off = (size_t)i*payload;
+      put_slot(pos+i, rec.data()+off, (uint32_t)std::min(payload, rec.size()-off));
+    }
+    h->last_ts.store(ts, std::memory_order_relaxed);
+    h->head.store(pos + r.nslots, std::memory_order_release);
+    h->notify.fetch_add(1, std::memory_order_release);
+    ::syscall(SYS_futex, &h->notify, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+  ~RingWriter(){ if(base) ::munmap(base, bytes); }
+};
+
+// ---------- Reader (wa-sub) ----------
+struct RingEvent {
+  long long ts = 0;
+  bool no_value = false;                            // value omitted: take it from `line`
+  std::string_view kind, peer, value, line;   // value: text, or the status of a status event
+  LogPos global_at, peer_at;                        // where the line ends in the global / peer log
+};
+
+class RingReader {
+  std::string path;
+  void* base = nullptr; size_t bytes = 0;
+  const RingHeader* h = nullptr; const RingSlot* slot = nullptr; uint64_t mask = 0;
+  ino_t ino = 0;
+  uint64_t pos = 0;
+  std::string buf;
+
+  // Copies one slot if it still holds `p`; false if it was overwritten.
+  bool get_slot(uint64_t p){
+    const RingSlot& s = slot[p & mask];
+    uint32_t v1 = s.ver.load(std::memory_order_acquire);
+    if(v1 & 1) return false;
+    uint64_t sp = s.pos; uint32_t n = std::min<uint32_t>(s.used, sizeof(s.data));
+    size_t at = buf.size(); buf.resize(at + n);
+    std::memcpy(buf.data()+at, s.data, n);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return s.ver.load(std::memory_order_relaxed)==v1 && sp==p;
+  }
+
+public:
+  enum Result { Event, Empty, Lapped };
+
+  RingReader() = default;
+  RingReader(const RingReader&) = delete;
+  RingReader& operator=(const RingReader&) = delete;
+  ~RingReader(){ detach(); }
+
+  void detach(){ if(base) ::munmap(base, bytes); base = nullptr; h = nullptr; }
+  bool attached() const { return base!=nullptr; }
+
+  // Maps the ring and positions the cursor at its head (only new events).
+  bool attach(const std::string& p){
+    detach(); path = p;
+    int fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd<0) return false;
+    struct stat st{};
+    if(::fstat(fd, &st)!=0 || (size_t)st.st_size < kRingHeaderBytes){ ::close(fd); return false; }
+    base = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(base==MAP_FAILED){ base = nullptr; return false; }
+    bytes = (size_t)st.st_size; ino = st.st_ino;
+    h = (const RingHeader*)base;
+    if(h->magic!=kRingMagic || h->version!=kRingVersion || h->slot_bytes!=kRingSlotBytes ||
+       h->slots==0 || (h->slots & (h->slots-1)) || ring_bytes(h->slots) > bytes){ detach(); return false; }
+    slot = (const RingSlot*)((const char*)base + kRingHeaderBytes); mask = h->slots-1;
+    pos = h->head.load(std::memory_order_acquire);
+    return true;
+  }
+  long long last_ts() const { return h ? (long long)h->last_ts.load(std::memory_order_relaxed) : 0; }
+
+  // True if wa-hub has replaced the ring (restart) since attach.
+  bool stale() const {
+    struct stat st{};
+    return !base || ::stat(path.c_str(), &st)!=0 || st.st_ino!=ino;
+  }
+
+  // Next event at the cursor. Views stay valid until the next call.
+  Result next(RingEvent& ev){
+    uint64_t head = h->head.load(std::memory_order_acquire);
+    if(pos==head) return Empty;
+    if(head - pos > mask+1) return Lapped;
+    buf.clear();
+    if(!get_slot(pos) || buf.size() < sizeof(RingRec)) return Lapped;
+    RingRec r; std::memcpy(&r, buf.data(), sizeof(r));
+    if(r.nslots==0 || r.nslots > mask+1) return Lapped;
+    for(uint32_t i=1; i<r.nslots; i++) if(!get_slot(pos+i)) return Lapped;
+    size_t need = sizeof(RingRec)+(size_t)r.kind_len+r.peer_len+r.value_len+r.line_len;
+    if(buf.size() < need || (r.flags & kRecGap)) return Lapped;
+    const char* p = buf.data()+sizeof(RingRec);
+    ev.ts = r.ts; ev.no_value = r.flags & kRecNoValue;
+    ev.global_at = r.global_at; ev.peer_at = r.peer_at;
+    ev.kind = {p, r.kind_len}; p += r.kind_len;
+    ev.peer = {p, r.peer_len}; p += r.peer_len;
+    ev.value = {p, r.value_len}; p += r.value_len;
+    ev.line = {p, r.line_len};
+    pos += r.nslots;
+    return Event;
+  }
+
+  // Blocks until something is published or timeout_ms passes.
+  void wait(int timeout_ms){
+    uint32_t seen = h->notify.load(std::memory_order_acquire);
+    if(h->head.load(std::memory_order_acquire)!=pos) return;
+    struct timespec ts{timeout_ms/1000, (long)(timeout_ms%1000)*1000000L};
+    ::syscall(SYS_futex, &h->notify, FUTEX_WAIT, seen, &ts, nullptr, 0);
+  }
+};
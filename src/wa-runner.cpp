@@ -5,17 +5,25 @@
 // Build: g++ -std=c++20 -O2 wa-runner.cpp -o wa-runner
 
 #include <nlohmann/json.hpp>
+#include "wa-text.hpp"
 
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <climits>
 #include <csignal>
 #include <cctype>
+#include <cerrno>
 #include <cstdio>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <optional>
 #include <regex>
 #include <sstream>
@@ -24,9 +32,18 @@
 #include <vector>
 
 #if defined(__unix__) || defined(__APPLE__)
+  #include <fcntl.h>
+  #include <poll.h>
   #include <unistd.h>
   #include <sys/wait.h>
-  #include <sys/select.h>
+#endif
+#ifdef __linux__
+  #include <sys/prctl.h>
+  #include <sys/socket.h>
+  #include <sys/syscall.h>
+  #if defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+    #define WA_HAVE_PIDFD 1
+  #endif
 #endif
 
 using json = nlohmann::json;
@@ -64,13 +81,13 @@ USAGE (choose one source)
     wa-runner --file /path/to/events.jsonl --wa-sub /usr/local/bin/wa-sub \
               --commands commands.json [--fifo /path/send.fifo] [--auto-reply] \
               [--log-dir DIR] [--log-prefix PFX] [--log-ext EXT] \
-              [--cmd-timeout SEC] [--debug]
+              [--cmd-timeout SEC] [--utf8 POLICY] [--debug]
 
   Single peer (legacy mode):
     wa-runner --peer NAME --config /path/wa-hub.json --wa-sub /usr/local/bin/wa-sub \
               --commands commands.json [--fifo /path/send.fifo] [--auto-reply] \
               [--log-dir DIR] [--log-prefix PFX] [--log-ext EXT] \
-              [--cmd-timeout SEC] [--debug]
+              [--cmd-timeout SEC] [--utf8 POLICY] [--debug]
 
 OPTIONS
   --file PATH              Global events JSONL written by wa-hub (covers all peers).
@@ -80,11 +97,18 @@ OPTIONS
   --commands PATH          Command map JSON file (templates). See “COMMAND MAP JSON”.
   --fifo PATH              wa-hub send FIFO. When set with --auto-reply, replies via FIFO.
   --auto-reply             After a command runs, reply with “ok <cmd> rc=<code>” and
-                           up to 800 chars of stdout.
+                           its stdout, in pages (see “LONG REPLIES”).
+  --reply-bytes N          Page size for replies, in bytes. Default 800.
+  --reply-pages N          Pages sent per reply; the rest via /more. Default 4, 0 = all.
+  --stream                 With --auto-reply: forward stdout of external commands while
+                           they run (see “STREAMING REPLIES”). Entries can opt in or out.
+  --stream-ms MS           Send pending streamed output MS after it arrived. Default 2000.
+  --stream-bytes N         Send streamed output in replies of at most N bytes. Default 1024.
   --cmd-timeout SEC        Kill a command after SEC seconds. Default 30.
   --log-dir DIR            Runner log directory. Default ./runner-logs.
   --log-prefix PFX         Filename prefix for per-peer runner logs. Default runner_
   --log-ext EXT            Filename extension for runner logs. Default .jsonl
+  --utf8 POLICY            Invalid UTF-8 in command output: replace (U+FFFD, default), drop, latin1.
   --debug                  Print resolved wa-sub command and other diagnostics to stderr.
   --help                   This help.
   --version                Print version.
@@ -93,7 +117,8 @@ CONFIG FALLBACKS (wa-hub.json optional keys)
   When --config is provided, the following keys are read unless overridden by CLI:
     "runner_log_dir":   "/abs/or/relative/dir",
     "runner_log_prefix":"runner_",
-    "runner_log_ext":   ".jsonl"
+    "runner_log_ext":   ".jsonl",
+    "utf8_policy":      "replace"
 
 EVENT FORMAT (input from wa-sub)
   Each line is a JSON object. Only events with {"kind":"received"} are considered.
@@ -121,6 +146,63 @@ COMMAND MAP JSON (templates)
   Template tokens:
     {args}   — pass the entire argument tail as a single argv element (spaces preserved)
     {args*}  — shlex-split the argument tail into multiple argv elements
+  An entry can also be an object:
+    "report": {"argv": ["/opt/bin/report", "{args*}"], "timeout": 120}
+  "timeout" (seconds) overrides --cmd-timeout for that command.
+
+BUILTINS
+  Trivial handlers are compiled in and run inline, without fork/exec:
+    "echo":   "builtin:echo",                 the argument tail as given
+    "date":   "builtin:date",                 local time, ISO 8601 (date -Is)
+    "utc":    ["builtin:date", "%H:%M %Z"],   or a strftime format
+    "uptime": "builtin:uptime",               from /proc/uptime and /proc/loadavg
+    "help":   "builtin:help",                 the commands this peer can run
+    "stats":  "builtin:stats"                 commands run, failures, average time
+  A bare "builtin:NAME" gets {args}; in an array the rest of the template is
+  expanded as usual and becomes the handler's arguments. Builtins are logged like
+  any other command (argv is the template). Unknown names are reported at startup
+  and answer rc 127.
+
+LONG REPLIES
+  stdout (up to 256 KiB) is split into pages of at most --reply-bytes, at a line
+  end or space where possible and never inside a UTF-8 character. Pages are
+  numbered and sent together:
+    ok report rc=0 (1/7)        (2/7)        ...   (4/7, /more for the rest)
+  /more sends the next --reply-pages pages of the peer's last reply, for an hour
+  after it (only if the command map has no "more" entry of its own).
+
+STREAMING REPLIES
+  For long jobs the output can be sent while the command runs:
+    "backup": {"argv": ["/opt/bin/backup", "{args*}"], "timeout": 600, "stream": true,
+               "stream_ms": 5000, "stream_bytes": 2048}
+  stdout is collected for up to stream_ms (default --stream-ms) or stream_bytes
+  (default --stream-bytes) and sent as its own reply, cut at a line end where
+  possible. When the command exits a final “ok <cmd> rc=<code> (N parts)” follows.
+  "stream": false turns it off for an entry under --stream. Only external commands
+  stream (not builtins or workers), and only with --auto-reply and --fifo. The log
+  record keeps the first 64 KiB of stdout, plus "stdout_bytes" and "streamed" (replies sent).
+
+PERSISTENT WORKERS
+  Scripts with a slow start (Python, Node) can stay running between requests:
+    "summarize": {"argv": ["/usr/bin/python3", "/opt/bots/summarize.py"], "worker": true,
+                  "timeout": 20, "health_sec": 60}
+  The worker is started when wa-runner starts (argv is used as is; {args} is not
+  expanded) and gets one JSON line per request on stdin:
+    {"id":7,"cmd":"summarize","peer":"max","args":"raw tail","argv":["raw","tail"],"ts":MS}
+  It answers with one line on stdout (other lines are ignored):
+    {"id":7,"rc":0,"stdout":"...","stderr":"..."}
+  Every health_sec (default 60, 0 = never) of idleness it gets {"id":N,"op":"ping"}
+  and must answer {"id":N}. A worker that exits, misses a ping or takes longer than
+  its timeout is killed and restarted (rc 128 for the request it was on; backoff
+  up to 60 s if it keeps dying). Its stderr goes to wa-runner's stderr. Entries
+  that are the same object share one process.
+
+PROCESS SPAWNING
+  Commands, workers and wa-sub are started by a small helper process forked before
+  the command map is loaded, so the cost of each fork does not grow with the
+  runner. Children start with default signal dispositions and are waited on and
+  killed through pidfds (Linux 5.3+). Elsewhere, or if the helper cannot be
+  restarted, wa-runner forks them itself.
 
 SECURITY NOTES
   • Only whitelisted commands in commands.json are runnable.
@@ -151,9 +233,9 @@ EXAMPLES
   # 3) Commands JSON snippet
   {
     "global": {
-      "echo":   ["/usr/bin/printf","%s","{args}"],
+      "echo":   "builtin:echo",
       "say":    ["/usr/bin/espeak","{args*}"],
-      "uptime": ["/usr/bin/uptime"]
+      "uptime": "builtin:uptime"
     },
     "max": {
       "tail":   ["/usr/bin/tail","-n","100","/var/log/syslog"]
@@ -165,7 +247,7 @@ EXAMPLES
     /say 'quoted arg'  another
     /uptime
 
-  # 5) With auto-reply, runner will send back “ok <cmd> rc=<code>” and a snippet of stdout.
+  # 5) With auto-reply, runner will send back “ok <cmd> rc=<code>” and stdout in numbered pages.
 
 SYSTEMD (user) quick sketch
   ~/.config/systemd/user/wa-runner.service
@@ -238,87 +320,810 @@ static std::vector<std::string> build_argv(const std::vector<std::string>& tmpl,
   return argv;
 }
 
-static int run_argv(const std::vector<std::string>& argv, std::string& out, std::string& err, int timeout_sec){
+// ------- process spawning -------
+// Commands are not forked from wa-runner itself, whose address space grows
+// with its maps and buffers (and which forks in the middle of other work),
+// but from a small zygote forked at startup before anything is loaded. It
+// takes requests on a socketpair:
+//   spawn: argv -> fork + exec; replies with the pid, passing a pidfd and
+//          the parent ends of the child's pipes back with SCM_RIGHTS
+//   reap:  pid  -> waits for it; replies with the wait status
+// wa-runner waits on and signals its children through their pidfds. The
+// zygote ignores SIGINT/SIGTERM (the runner decides when children stop)
+// and exits when the runner goes away. Without pidfd support, or if the
+// zygote dies and cannot be restarted, commands are forked locally.
+enum : uint32_t { kSpawnStdin = 1, kSpawnStderr = 2 };   // pipes to create (stdout always)
+
+struct Child {
+  pid_t pid = -1;
+  int pidfd = -1;                      // -1: forked locally, waited with waitpid
+  int in = -1, out = -1, err = -1;     // our ends of its stdin/stdout/stderr, if piped
+  bool reaped = false; int status = 0;
+};
+
 #if defined(__unix__) || defined(__APPLE__)
-  int out_pipe[2], err_pipe[2];
-  if(pipe(out_pipe)!=0 || pipe(err_pipe)!=0) return 1;
+// In a freshly forked child: wire up the pipes and exec; never returns.
+[[noreturn]] static void exec_child(const std::vector<std::string>& argv, int in, int out, int err){
+  signal(SIGINT, SIG_DFL); signal(SIGTERM, SIG_DFL); signal(SIGPIPE, SIG_DFL);
+  if(in>=0) dup2(in, STDIN_FILENO);
+  dup2(out, STDOUT_FILENO);
+  if(err>=0) dup2(err, STDERR_FILENO);
+  std::vector<char*> cargv;
+  cargv.reserve(argv.size()+1);
+  for(const auto& s: argv) cargv.push_back(const_cast<char*>(s.c_str()));
+  cargv.push_back(nullptr);
+  execvp(cargv[0], cargv.data());
+  std::perror("execvp");
+  _exit(127);
+}
 
-  pid_t pid=fork();
-  if(pid<0) return 1;
+// Makes the pipes, forks and execs. Fills c's fds (ours) and pid.
+static bool fork_child(const std::vector<std::string>& argv, uint32_t flags, Child& c){
+  if(argv.empty()) return false;
+  int in[2]={-1,-1}, out[2]={-1,-1}, err[2]={-1,-1};
+  auto close_all=[&]{ for(int fd: {in[0],in[1],out[0],out[1],err[0],err[1]}) if(fd>=0) close(fd); };
+  if(((flags & kSpawnStdin) && pipe2(in, O_CLOEXEC)!=0) || pipe2(out, O_CLOEXEC)!=0 ||
+     ((flags & kSpawnStderr) && pipe2(err, O_CLOEXEC)!=0)){ close_all(); return false; }
+  pid_t pid = fork();
+  if(pid<0){ close_all(); return false; }
+  if(pid==0) exec_child(argv, in[0], out[1], err[1]);
+  for(int fd: {in[0], out[1], err[1]}) if(fd>=0) close(fd);
+  c = Child{}; c.pid = pid; c.in = in[1]; c.out = out[0]; c.err = err[0];
+  return true;
+}
+#endif
 
-  if(pid==0){
-    dup2(out_pipe[1], STDOUT_FILENO);
-    dup2(err_pipe[1], STDERR_FILENO);
-    close(out_pipe[0]); close(out_pipe[1]);
-    close(err_pipe[0]); close(err_pipe[1]);
+#ifdef WA_HAVE_PIDFD
+static int pidfd_open_(pid_t pid){ return (int)syscall(SYS_pidfd_open, pid, 0); }
+static int pidfd_signal_(int pidfd, int sig){ return (int)syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0); }
+
+struct ZyMsg { uint32_t op, flags; int32_t pid, status; };   // request and reply header
+enum : uint32_t { kZySpawn = 1, kZyReap = 2 };
+
+static bool send_fds(int sock, const ZyMsg& m, const int* fds, int nfds){
+  iovec iov{const_cast<ZyMsg*>(&m), sizeof(m)};
+  alignas(cmsghdr) char ctl[CMSG_SPACE(4*sizeof(int))]{};
+  msghdr mh{}; mh.msg_iov = &iov; mh.msg_iovlen = 1;
+  if(nfds){
+    mh.msg_control = ctl; mh.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+    cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET; cm->cmsg_type = SCM_RIGHTS; cm->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+    std::memcpy(CMSG_DATA(cm), fds, nfds*sizeof(int));
+  }
+  ssize_t r;
+  do r = sendmsg(sock, &mh, MSG_NOSIGNAL); while(r<0 && errno==EINTR);
+  return r==(ssize_t)sizeof(m);
+}
+// Receives one reply; `fds` gets up to 4 passed descriptors (CLOEXEC).
+static bool recv_fds(int sock, ZyMsg& m, int* fds, int& nfds){
+  iovec iov{&m, sizeof(m)};
+  alignas(cmsghdr) char ctl[CMSG_SPACE(4*sizeof(int))]{};
+  msghdr mh{}; mh.msg_iov = &iov; mh.msg_iovlen = 1; mh.msg_control = ctl; mh.msg_controllen = sizeof(ctl);
+  ssize_t r;
+  do r = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC); while(r<0 && errno==EINTR);
+  nfds = 0;
+  for(cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)){
+    if(cm->cmsg_level!=SOL_SOCKET || cm->cmsg_type!=SCM_RIGHTS) continue;
+    int n = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    for(int i=0; i<n; i++){
+      int fd; std::memcpy(&fd, CMSG_DATA(cm) + i*sizeof(int), sizeof(int));
+      if(nfds<4) fds[nfds++] = fd; else close(fd);
+    }
+  }
+  return r==(ssize_t)sizeof(m);
+}
 
-    std::vector<char*> cargv;
-    cargv.reserve(argv.size()+1);
-    for(const auto& s: argv) cargv.push_back(const_cast<char*>(s.c_str()));
-    cargv.push_back(nullptr);
+[[noreturn]] static void zygote_main(int sock){
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  signal(SIGINT, SIG_IGN); signal(SIGTERM, SIG_IGN);
+  std::vector<char> buf(1<<20);
+  for(;;){
+    ssize_t n = recv(sock, buf.data(), buf.size(), 0);
+    if(n<0 && errno==EINTR) continue;
+    if(n<(ssize_t)sizeof(ZyMsg)) _exit(0);                   // runner gone (or garbage)
+    ZyMsg m; std::memcpy(&m, buf.data(), sizeof(m));
+    if(m.op==kZyReap){
+      int st = 0; pid_t r;
+      do r = waitpid(m.pid, &st, 0); while(r<0 && errno==EINTR);
+      ZyMsg rep{kZyReap, 0, m.pid, r==m.pid ? st : -1};
+      send_fds(sock, rep, nullptr, 0);
+      continue;
+    }
+    std::vector<std::string> argv;                           // NUL-terminated strings
+    for(const char *p = buf.data()+sizeof(m), *e = buf.data()+n; p<e; ){
+      const char* z = (const char*)std::memchr(p, 0, e-p);
+      if(!z) break;
+      argv.emplace_back(p, z); p = z+1;
+    }
+    Child c; ZyMsg rep{kZySpawn, m.flags, -1, 0};
+    int fds[4]; int nfds = 0;
+    errno = 0;
+    if(fork_child(argv, m.flags, c)){
+      int pidfd = pidfd_open_(c.pid);
+      if(pidfd<0){ kill(c.pid, SIGKILL); waitpid(c.pid, nullptr, 0); }
+      else{
+        rep.pid = c.pid; fds[nfds++] = pidfd;
+        for(int fd: {c.out, c.in, c.err}) if(fd>=0) fds[nfds++] = fd;
+      }
+      if(pidfd<0) for(int fd: {c.out, c.in, c.err}) if(fd>=0) close(fd);
+    }
+    if(rep.pid<0) rep.status = errno ? errno : EAGAIN;
+    send_fds(sock, rep, fds, nfds);
+    for(int i=0; i<nfds; i++) close(fds[i]);
+  }
+}
+#endif
 
-    execvp(cargv[0], cargv.data());
-    std::perror("execvp");
-    _exit(127);
+class Spawner {
+  int sock = -1;
+  pid_t zpid = -1;
+  bool debug = false;
+
+#ifdef WA_HAVE_PIDFD
+  bool zy_spawn(const std::vector<std::string>& argv, uint32_t flags, Child& c){
+    ZyMsg h{kZySpawn, flags, 0, 0};
+    std::string req((const char*)&h, sizeof(h));
+    for(const auto& a: argv){ req += a; req.push_back('\0'); }
+    if(send(sock, req.data(), req.size(), MSG_NOSIGNAL)!=(ssize_t)req.size()) return false;
+    ZyMsg rep{}; int fds[4]; int nfds = 0;
+    if(!recv_fds(sock, rep, fds, nfds)) return false;
+    c = Child{};
+    if(rep.pid<=0 || nfds<2){ for(int i=0;i<nfds;i++) close(fds[i]); c.status = rep.status; return true; }
+    int k = 0;
+    c.pid = rep.pid; c.pidfd = fds[k++]; c.out = fds[k++];
+    if((flags & kSpawnStdin) && k<nfds) c.in = fds[k++];
+    if((flags & kSpawnStderr) && k<nfds) c.err = fds[k++];
+    return true;
   }
+#endif
 
-  close(out_pipe[1]); close(err_pipe[1]);
+public:
+  Spawner() = default;
+  Spawner(const Spawner&) = delete;
+  Spawner& operator=(const Spawner&) = delete;
+  ~Spawner(){ stop(); }
+
+  // Forks the zygote; false (local forks from then on) if that is not possible.
+  bool start(bool dbg){
+    debug = dbg;
+#ifdef WA_HAVE_PIDFD
+    int probe = pidfd_open_(getpid());
+    if(probe<0){ if(debug) std::cerr<<"zygote: no pidfd support, forking locally\n"; return false; }
+    close(probe);
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv)!=0) return false;
+    pid_t p = fork();
+    if(p<0){ close(sv[0]); close(sv[1]); return false; }
+    if(p==0){ close(sv[0]); zygote_main(sv[1]); }
+    close(sv[1]);
+    sock = sv[0]; zpid = p;
+    if(debug) std::cerr<<"zygote: pid "<<zpid<<"\n";
+    return true;
+#else
+    return false;
+#endif
+  }
+  void stop(){
+    if(sock<0) return;
+    close(sock); sock = -1;
+    waitpid(zpid, nullptr, 0); zpid = -1;
+  }
 
-  auto read_fd = [](int fd, std::string& dst){
-    char buf[4096];
-    ssize_t r;
-    while((r=read(fd,buf,sizeof(buf)))>0) dst.append(buf, buf+r);
-  };
+  // Starts argv with a stdout pipe (and stdin/stderr pipes per flags;
+  // stderr is ours otherwise).
+  bool spawn(const std::vector<std::string>& argv, uint32_t flags, Child& c){
+#ifdef WA_HAVE_PIDFD
+    if(sock>=0){
+      if(zy_spawn(argv, flags, c)) return c.pid>0;
+      std::cerr<<"zygote: lost, restarting\n";
+      stop();
+      if(start(debug) && zy_spawn(argv, flags, c)) return c.pid>0;
+      stop();
+    }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    return fork_child(argv, flags, c);
+#else
+    (void)argv; (void)flags; (void)c; return false;
+#endif
+  }
 
-  auto t0 = std::chrono::steady_clock::now();
-  int status = 0;
-  bool child_done = false;
+  // True once the child has exited (it may still need reap()); waits up
+  // to wait_ms for that.
+  bool exited(Child& c, int wait_ms = 0){
+    if(c.reaped) return true;
+#ifdef WA_HAVE_PIDFD
+    if(c.pidfd>=0){ pollfd p{c.pidfd, POLLIN, 0}; return poll(&p, 1, wait_ms)>0; }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    for(int i=0; c.pid>0; i++){
+      if(waitpid(c.pid, &c.status, WNOHANG)==c.pid){ c.reaped = true; break; }
+      if(i*10 >= wait_ms) break;
+      usleep(10*1000);
+    }
+#endif
+    return c.reaped;
+  }
 
-  while(!child_done){
-    int r = waitpid(pid, &status, WNOHANG);
-    if(r == pid){
-      child_done = true;
-      break;
+  void signal(Child& c, int sig){
+    if(c.reaped || c.pid<=0) return;
+#ifdef WA_HAVE_PIDFD
+    if(c.pidfd>=0){ pidfd_signal_(c.pidfd, sig); return; }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    kill(c.pid, sig);
+#endif
+  }
+
+  // Waits for the child and returns its wait status (-1 if unknown).
+  int reap(Child& c){
+#ifdef WA_HAVE_PIDFD
+    if(c.pidfd>=0){
+      c.status = -1;
+      ZyMsg req{kZyReap, 0, c.pid, 0}, rep{}; int fds[4]; int nfds = 0;
+      if(sock>=0 && send_fds(sock, req, nullptr, 0) && recv_fds(sock, rep, fds, nfds)) c.status = rep.status;
+      for(int i=0;i<nfds;i++) close(fds[i]);
+      close(c.pidfd); c.pidfd = -1; c.reaped = true;
     }
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(out_pipe[0], &set);
-    FD_SET(err_pipe[0], &set);
-    timeval tv{0,200*1000}; // 200ms
-    select(std::max(out_pipe[0],err_pipe[0])+1, &set, nullptr, nullptr, &tv);
-    if(FD_ISSET(out_pipe[0], &set)) read_fd(out_pipe[0], out);
-    if(FD_ISSET(err_pipe[0], &set)) read_fd(err_pipe[0], err);
-
-    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now()-t0).count();
-    if(timeout_sec>0 && elapsed >= timeout_sec){
-      kill(pid, SIGKILL);
-      waitpid(pid, &status, 0);
-      break;
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    if(!c.reaped && c.pid>0){
+      pid_t r;
+      do r = waitpid(c.pid, &c.status, 0); while(r<0 && errno==EINTR);
+      if(r!=c.pid) c.status = -1;
+      c.reaped = true;
     }
-    if(!FD_ISSET(out_pipe[0], &set) && !FD_ISSET(err_pipe[0], &set)) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+#endif
+    return c.status;
+  }
+
+  // Closes our ends of its pipes.
+  static void close_pipes(Child& c){
+    for(int* fd: {&c.in, &c.out, &c.err}) if(*fd>=0){ close(*fd); *fd = -1; }
+  }
+};
+
+// ------- streaming replies -------
+// For long jobs: stdout is forwarded as it comes instead of after exit. It
+// is cut into replies of at most `bytes` (at the last newline in the
+// window when there is one, never inside a UTF-8 sequence), and whatever is
+// pending goes out `ms` after its first byte arrived. Only the first
+// kStreamLogCap bytes are kept for the runner log.
+static constexpr size_t kStreamLogCap = 64*1024;
+
+class ReplyStream {
+  std::function<void(std::string)> send;
+  long long ms; size_t bytes;
+  std::string pending;
+  long long pending_since = 0;
+
+  void emit(size_t n){
+    std::string part = pending.substr(0, n);
+    pending.erase(0, n);
+    part.erase(std::remove(part.begin(), part.end(), '\r'), part.end());
+    while(!part.empty() && part.back()=='\n') part.pop_back();
+    if(!part.empty()){ send(std::move(part)); sent++; }
+    pending_since = now_ms();
+  }
+
+public:
+  std::string head;                    // first kStreamLogCap bytes, for the log
+  size_t total = 0;
+  int sent = 0;
+
+  ReplyStream(std::function<void(std::string)> fn, long long window_ms, size_t window_bytes)
+    :send(std::move(fn)), ms(std::max(100LL, window_ms)), bytes(std::max<size_t>(64, window_bytes)){}
+
+  void feed(std::string_view d){
+    if(head.size() < kStreamLogCap) head.append(d.substr(0, kStreamLogCap - head.size()));
+    total += d.size();
+    if(pending.empty()) pending_since = now_ms();
+    pending.append(d);
+    while(pending.size() >= bytes){
+      size_t nl = pending.rfind('\n', bytes-1);
+      emit(nl!=std::string::npos ? nl+1 : utf8_floor(pending, bytes));
     }
   }
-  { std::string tmp; read_fd(out_pipe[0], tmp); out+=tmp; }
-  { std::string tmp; read_fd(err_pipe[0], tmp); err+=tmp; }
-  close(out_pipe[0]); close(err_pipe[0]);
+  // When the pending text is due, LLONG_MAX if nothing is pending.
+  long long due() const { return pending.empty() ? LLONG_MAX : pending_since + ms; }
+  void tick(){ if(!pending.empty() && now_ms() >= due()) emit(utf8_complete(pending)); }
+  void flush(){ if(!pending.empty()) emit(pending.size()); }
+};
+
+// Runs argv with a deadline; stdout goes to `out`, or to `stream` if set.
+static int run_argv(Spawner& sp, const std::vector<std::string>& argv, std::string& out, std::string& err, int timeout_sec,
+                    ReplyStream* stream = nullptr){
+#if defined(__unix__) || defined(__APPLE__)
+  Child c;
+  if(!sp.spawn(argv, kSpawnStderr, c)) return 1;
 
-  if(WIFEXITED(status)) return WEXITSTATUS(status);
+  std::string chunk;
+  auto drain = [](int& fd, std::string& dst){      // what is there now; closes on EOF
+    char buf[4096];
+    ssize_t r = read(fd, buf, sizeof(buf));
+    if(r>0) dst.append(buf, (size_t)r);
+    else if(r==0 || errno!=EINTR){ close(fd); fd = -1; }
+  };
+
+  // Read until both pipes close or the child is gone (a grandchild may
+  // keep them open); kill it at the deadline.
+  long long deadline = timeout_sec>0 ? now_ms() + (long long)timeout_sec*1000 : LLONG_MAX;
+  bool killed = false;
+  while(c.out>=0 || c.err>=0){
+    bool gone = sp.exited(c);
+    // an exited child's pidfd stays readable; leave it out so r==0 still
+    // means "nothing more in the pipes right now"
+    pollfd p[3] = {{c.out, POLLIN, 0}, {c.err, POLLIN, 0}, {gone ? -1 : c.pidfd, POLLIN, 0}};
+    long long wait = gone ? 0 : std::min<long long>(deadline - now_ms(), c.pidfd>=0 ? 1000 : 200);
+    if(stream) wait = std::min(wait, stream->due() - now_ms());
+    int r = poll(p, 3, (int)std::max(0LL, wait));
+    if(r<0 && errno!=EINTR) break;
+    if(c.out>=0 && (p[0].revents & (POLLIN|POLLHUP))){
+      if(!stream) drain(c.out, out);
+      else { chunk.clear(); drain(c.out, chunk); stream->feed(chunk); }
+    }
+    if(c.err>=0 && (p[1].revents & (POLLIN|POLLHUP))) drain(c.err, err);
+    if(stream) stream->tick();
+    if(gone && (r==0 || now_ms() >= deadline)) break;
+    if(!killed && now_ms() >= deadline){ sp.signal(c, SIGKILL); killed = true; }
+  }
+  Spawner::close_pipes(c);
+  // It may close or redirect its pipes and keep running; the deadline
+  // still holds, so only reap once it has exited.
+  while(!killed && !sp.exited(c, (int)std::clamp<long long>(deadline - now_ms(), 0, 1000)))
+    if(now_ms() >= deadline){ sp.signal(c, SIGKILL); killed = true; }
+  int status = sp.reap(c);
+
+  if(status>=0 && WIFEXITED(status)) return WEXITSTATUS(status);
   return 128;
 #else
-  (void)argv; (void)out; (void)err; (void)timeout_sec;
+  (void)sp; (void)argv; (void)out; (void)err; (void)timeout_sec; (void)stream;
   return 127;
 #endif
 }
 
+// ------- command map entries -------
+// An entry is an argv template, or an object {"argv":[...], "timeout":S,
+// "worker":bool, "health_sec":S}, or a bare "builtin:NAME" string.
+static std::vector<std::string> entry_argv(const json& m){
+  if(m.is_string()) return { m.get<std::string>() };
+  const json& a = m.is_object() ? (m.contains("argv") ? m["argv"] : json::array()) : m;
+  std::vector<std::string> out;
+  if(a.is_array()) for(auto& v: a) if(v.is_string()) out.push_back(v.get<std::string>());
+  return out;
+}
+static int entry_int(const json& m, const char* k, int dflt){
+  return m.is_object() && m.contains(k) && m[k].is_number_integer() ? m[k].get<int>() : dflt;
+}
+
+// ------- builtins -------
+// Templates starting with "builtin:NAME" run a compiled-in handler inline
+// instead of fork/exec. The rest of the template is expanded as usual and
+// becomes the handler's arguments; a bare "builtin:NAME" gets {args}.
+//   echo    the arguments as given
+//   date    local time, ISO 8601 (or strftime format from the arguments)
+//   uptime  from /proc/uptime and /proc/loadavg
+//   help    the commands this peer can run, from the loaded map
+//   stats   what this runner has run since it started
+static constexpr std::string_view kBuiltinPrefix = "builtin:";
+
+struct CmdStats { long long n = 0, failed = 0, total_us = 0; };
+struct RunnerStats {
+  long long started = now_ms();
+  long long unknown = 0;
+  std::map<std::string, CmdStats> cmds;
+  void add(const std::string& cmd, int rc, long long us){
+    auto& c = cmds[cmd]; c.n++; c.total_us += us; if(rc!=0) c.failed++;
+  }
+};
+
+struct BuiltinCall {
+  const std::string& peer;
+  const std::vector<std::string>& args;
+  const json& cmdmap;
+  const RunnerStats& stats;
+};
+using BuiltinFn = int(*)(const BuiltinCall&, std::string& out, std::string& err);
+
+static std::string join_args(const std::vector<std::string>& a){
+  std::string s;
+  for(size_t i=0;i<a.size();++i){ if(i) s.push_back(' '); s += a[i]; }
+  return s;
+}
+static std::string fmt_duration(long long sec){
+  char b[64];
+  long long d = sec/86400, h = sec/3600%24, m = sec/60%60;
+  if(d>0) std::snprintf(b, sizeof(b), "%lld day%s, %lld:%02lld", d, d==1?"":"s", h, m);
+  else if(h>0) std::snprintf(b, sizeof(b), "%lld:%02lld", h, m);
+  else std::snprintf(b, sizeof(b), "%lld min", m);
+  return b;
+}
+
+static int bi_echo(const BuiltinCall& c, std::string& out, std::string&){
+  out = join_args(c.args);
+  return 0;
+}
+static int bi_date(const BuiltinCall& c, std::string& out, std::string& err){
+  std::string f = join_args(c.args);
+  bool iso = f.empty();
+  if(iso) f = "%Y-%m-%dT%H:%M:%S%z";
+  time_t t = time(nullptr); struct tm tmv{};
+  localtime_r(&t, &tmv);
+  char b[256];
+  size_t n = strftime(b, sizeof(b), f.c_str(), &tmv);
+  if(n==0 && !f.empty()){ err = "date: bad or too long format"; return 1; }
+  out.assign(b, n);
+  if(iso && out.size()>=5) out.insert(out.size()-2, ":");   // +0100 -> +01:00, as date -Is
+  out.push_back('\n');
+  return 0;
+}
+static int bi_uptime(const BuiltinCall&, std::string& out, std::string& err){
+  double up = 0, l1 = 0, l5 = 0, l15 = 0;
+  std::ifstream u("/proc/uptime"), l("/proc/loadavg");
+  if(!(u>>up) || !(l>>l1>>l5>>l15)){ err = "uptime: /proc not available"; return 1; }
+  time_t t = time(nullptr); struct tm tmv{};
+  localtime_r(&t, &tmv);
+  char now[16]; strftime(now, sizeof(now), "%H:%M:%S", &tmv);
+  char b[160];
+  std::snprintf(b, sizeof(b), "%s up %s, load average: %.2f, %.2f, %.2f\n",
+                now, fmt_duration((long long)up).c_str(), l1, l5, l15);
+  out = b;
+  return 0;
+}
+static int bi_help(const BuiltinCall& c, std::string& out, std::string&){
+  std::vector<std::string> names;
+  for(const char* scope: {c.peer.c_str(), "global"}){
+    auto it = c.cmdmap.find(scope);
+    if(it==c.cmdmap.end() || !it->is_object()) continue;
+    for(auto& [name, m] : it->items()) names.push_back(name);
+  }
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+  out = "Commands:";
+  for(auto& n: names) out += " /" + n;
+  out.push_back('\n');
+  return 0;
+}
+static int bi_stats(const BuiltinCall& c, std::string& out, std::string&){
+  long long n = 0, failed = 0;
+  for(auto& [k, v] : c.stats.cmds){ n += v.n; failed += v.failed; }
+  std::ostringstream o;
+  o<<kVersion<<", up "<<fmt_duration((now_ms() - c.stats.started)/1000)<<"\n"
+   <<n<<" commands, "<<failed<<" failed, "<<c.stats.unknown<<" unknown\n";
+  std::vector<std::pair<std::string, CmdStats>> v(c.stats.cmds.begin(), c.stats.cmds.end());
+  std::sort(v.begin(), v.end(), [](auto& a, auto& b){ return a.second.n > b.second.n; });
+  char b[64];
+  for(auto& [name, s] : v){
+    std::snprintf(b, sizeof(b), "%.3f", s.total_us/1000.0/s.n);
+    o<<"/"<<name<<" "<<s.n<<" runs, "<<s.failed<<" failed, avg "<<b<<" ms\n";
+  }
+  out = o.str();
+  return 0;
+}
+
+static BuiltinFn find_builtin(std::string_view name){
+  static const std::map<std::string_view, BuiltinFn> table = {
+    {"echo", bi_echo}, {"date", bi_date}, {"uptime", bi_uptime}, {"help", bi_help}, {"stats", bi_stats},
+  };
+  auto it = table.find(name);
+  return it==table.end() ? nullptr : it->second;
+}
+
+static bool is_builtin(const std::vector<std::string>& tmpl){
+  return !tmpl.empty() && tmpl[0].rfind(kBuiltinPrefix, 0)==0;
+}
+static std::string_view builtin_name(const std::vector<std::string>& tmpl){
+  return std::string_view(tmpl[0]).substr(kBuiltinPrefix.size());
+}
+
+// Runs a builtin template; rc 127 for a name that is not compiled in.
+static int run_builtin(const std::vector<std::string>& tmpl, const std::string& argline, const std::string& peer,
+                       const json& cmdmap, const RunnerStats& stats, std::string& out, std::string& err){
+  BuiltinFn fn = find_builtin(builtin_name(tmpl));
+  if(!fn){ err = "unknown builtin: " + std::string(builtin_name(tmpl)); return 127; }
+  std::vector<std::string> args = tmpl.size()>1
+    ? build_argv(std::vector<std::string>(tmpl.begin()+1, tmpl.end()), argline)
+    : std::vector<std::string>{argline};
+  if(args.size()==1 && args[0].empty()) args.clear();
+  return fn(BuiltinCall{peer, args, cmdmap, stats}, out, err);
+}
+
+// Warns about "builtin:" entries naming a handler that does not exist.
+static void check_builtins(const json& cmdmap){
+  for(auto& [scope, block] : cmdmap.items()){
+    if(!block.is_object()) continue;
+    for(auto& [name, m] : block.items()){
+      auto tmpl = entry_argv(m);
+      if(is_builtin(tmpl) && !find_builtin(builtin_name(tmpl)))
+        std::cerr<<"commands: "<<scope<<"/"<<name<<": unknown builtin '"<<builtin_name(tmpl)<<"'\n";
+    }
+  }
+}
+
+// ------- warm workers -------
+// A command mapped to {"argv":[...],"worker":true} is started once (at boot)
+// and kept running, so slow-starting scripts pay their startup only once.
+// Each request is one JSON line on the worker's stdin,
+//   {"id":N,"cmd":"name","peer":"max","args":"raw tail","argv":["split","tail"],"ts":MS}
+// answered by one line on its stdout,
+//   {"id":N,"rc":0,"stdout":"...","stderr":"..."}
+// (rc defaults to 0, missing output to ""); lines with another id are
+// skipped. An idle worker gets {"id":N,"op":"ping"} every health_sec and
+// must answer with that id. A worker that exits, misses a ping or overruns
+// a request is killed and started again, with backoff if it keeps dying.
+// Its stderr is passed through to ours.
+struct WorkerSpec {
+  std::vector<std::string> argv;
+  int timeout_sec = 0;                 // 0: --cmd-timeout
+  int health_sec = 60;                 // 0: no pings
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+class Worker {
+  Spawner& sp;
+  WorkerSpec spec;
+  std::string label;
+  bool debug;
+  Child c;                             // c.in: its stdin, c.out: its stdout
+  std::string rbuf;
+  uint64_t next_id = 1;
+  long long last_used = 0, restart_at = 0;
+  int failures = 0;                    // deaths since the last good reply
+
+  // Reads until a complete line is buffered or `deadline`; false on EOF/timeout.
+  bool read_line(std::string& line, long long deadline){
+    for(;;){
+      size_t nl = rbuf.find('\n');
+      if(nl!=std::string::npos){ line.assign(rbuf, 0, nl); rbuf.erase(0, nl+1); return true; }
+      long long left = deadline - now_ms();
+      if(left <= 0) return false;
+      pollfd p{c.out, POLLIN, 0};
+      int r = poll(&p, 1, (int)std::min<long long>(left, 1000));
+      if(r<0 && errno!=EINTR) return false;
+      if(r<=0) continue;
+      char buf[65536];
+      ssize_t k = read(c.out, buf, sizeof(buf));
+      if(k<=0){ if(k<0 && errno==EINTR) continue; return false; }
+      rbuf.append(buf, (size_t)k);
+    }
+  }
+
+  bool write_all(const std::string& s){
+    size_t off = 0;
+    while(off < s.size()){
+      ssize_t k = write(c.in, s.data()+off, s.size()-off);
+      if(k<0){ if(errno==EINTR) continue; return false; }
+      off += (size_t)k;
+    }
+    return true;
+  }
+
+  // Sends `req` with a fresh id; on the matching reply returns it in `rep`.
+  bool exchange(json req, json& rep, int timeout_sec){
+    uint64_t id = next_id++;
+    req["id"] = id;
+    if(!write_all(req.dump() + "\n")) return false;
+    long long deadline = now_ms() + (long long)std::max(1, timeout_sec)*1000;
+    std::string line;
+    while(read_line(line, deadline)){
+      json j = json::parse(line, nullptr, false);
+      if(j.is_object() && j.contains("id") && j["id"].is_number_unsigned() && j["id"].get<uint64_t>()==id){ rep = std::move(j); return true; }
+      if(debug) std::cerr<<"worker "<<label<<": skipped line: "<<line.substr(0, 200)<<"\n";
+    }
+    return false;
+  }
+
+  // Kills the process and schedules the next start.
+  void fail(const char* why){
+    std::cerr<<"worker "<<label<<": "<<why<<", restarting\n";
+    stop(false);
+    failures++;
+    restart_at = now_ms() + (failures<=1 ? 0 : std::min(60000LL, 1000LL << std::min(failures-2, 6)));
+  }
+
+public:
+  Worker(Spawner& spawner, WorkerSpec s, std::string l, bool dbg)
+    :sp(spawner), spec(std::move(s)), label(std::move(l)), debug(dbg){}
+  ~Worker(){ stop(true); }
+  Worker(const Worker&) = delete;
+  Worker& operator=(const Worker&) = delete;
+
+  bool alive() const { return c.pid>0; }
+
+  bool start(){
+    if(!sp.spawn(spec.argv, kSpawnStdin, c)){ c = Child{}; return false; }
+    rbuf.clear();
+    last_used = now_ms();
+    if(debug) std::cerr<<"worker "<<label<<": started pid "<<c.pid<<"\n";
+    return true;
+  }
+
+  // Closes its stdin; graceful: gives it a second to leave on its own
+  // before SIGKILL.
+  void stop(bool graceful){
+    if(c.in>=0){ close(c.in); c.in = -1; }
+    if(alive()){
+      if(!sp.exited(c, graceful ? 1000 : 0)) sp.signal(c, SIGKILL);
+      sp.reap(c);
+    }
+    Spawner::close_pipes(c);
+    c = Child{};
+  }
+
+  // True if it is still running; restarts the clock on one that exited.
+  bool check(){
+    if(alive() && sp.exited(c)) fail("exited");
+    return alive();
+  }
+
+  // Runs one request. rc as for an external command: 127 if the worker
+  // cannot be started, 128 if it died or timed out on this request.
+  int call(json req, std::string& out, std::string& err, int timeout_sec){
+    if(spec.timeout_sec>0) timeout_sec = spec.timeout_sec;
+    if(!check() && (now_ms() < restart_at || !start())){ err = "worker not running"; return 127; }
+    json rep;
+    if(!exchange(std::move(req), rep, timeout_sec)){
+      err = sp.exited(c, 100) ? "worker exited" : "worker timed out";
+      fail(err.c_str());
+      return 128;
+    }
+    failures = 0; last_used = now_ms();
+    auto str=[&](const char* k){ return rep.contains(k) && rep[k].is_string() ? rep[k].get<std::string>() : std::string(); };
+    out = str("stdout"); err = str("stderr");
+    return rep.contains("rc") && rep["rc"].is_number_integer() ? rep["rc"].get<int>() : 0;
+  }
+
+  // Between messages: restart a dead worker when due, ping an idle one.
+  void tick(long long now){
+    if(!check()){ if(now_ms() >= restart_at) start(); return; }
+    if(spec.health_sec>0 && now - last_used >= (long long)spec.health_sec*1000){
+      json rep;
+      if(exchange({{"op","ping"}}, rep, std::min(5, std::max(1, spec.health_sec)))){ failures = 0; last_used = now_ms(); }
+      else fail("no answer to ping");
+    }
+  }
+};
+
+// One warm process per distinct worker entry in commands.json (the same
+// entry under several peers shares it).
+class WorkerPool {
+  Spawner& sp;
+  std::map<std::string, std::unique_ptr<Worker>> workers;   // key: the entry's JSON
+  long long next_tick = 0;
+public:
+  explicit WorkerPool(Spawner& spawner):sp(spawner){}
+
+  // Starts a worker for every {"worker":true} entry in the map.
+  void load(const json& cmdmap, bool debug){
+    for(auto& [scope, block] : cmdmap.items()){
+      if(!block.is_object()) continue;
+      for(auto& [name, m] : block.items()){
+        auto spec = worker_spec(m);
+        if(!spec) continue;
+        auto& w = workers[m.dump()];
+        if(!w){ w = std::make_unique<Worker>(sp, *spec, name, debug); w->start(); }
+      }
+    }
+  }
+  static std::optional<WorkerSpec> worker_spec(const json& m){
+    if(!m.is_object() || !m.contains("worker") || !m["worker"].is_boolean() || !m["worker"].get<bool>()) return std::nullopt;
+    WorkerSpec s;
+    s.argv = entry_argv(m);
+    if(s.argv.empty()) return std::nullopt;
+    s.timeout_sec = entry_int(m, "timeout", 0);
+    s.health_sec = entry_int(m, "health_sec", 60);
+    return s;
+  }
+  Worker* find(const json& m){ auto it = workers.find(m.dump()); return it==workers.end()? nullptr : it->second.get(); }
+  bool empty() const { return workers.empty(); }
+  void tick(){
+    long long now = now_ms();
+    if(now < next_tick) return;
+    next_tick = now + 1000;
+    for(auto& [k, w] : workers) w->tick(now);
+  }
+  void stop(){ for(auto& [k, w] : workers) w->stop(true); }
+};
+#endif
+
 static bool fifo_send(const fs::path& fifo, const std::string& peer, const std::string& text){
-  json msg = {{"to",peer},{"text",text}};
+  json msg = {{"to",peer},{"text",utf8_clean(text)}};
   std::ofstream f(fifo);
   if(!f.good()) return false;
   f<<msg.dump()<<'\n';
   return true;
 }
 
+// Several messages in one write, so they stay together and in order.
+static bool fifo_send_batch(const fs::path& fifo, const std::string& peer, const std::vector<std::string>& texts){
+  std::string buf;
+  for(const auto& t: texts) buf += json{{"to",peer},{"text",utf8_clean(t)}}.dump() + "\n";
+  std::ofstream f(fifo);
+  if(!f.good()) return false;
+  f.write(buf.data(), (std::streamsize)buf.size());
+  return f.good();
+}
+
+// ------- reply pages -------
+// Command output is split into messages of at most page_bytes (header
+// included): at the last
+// line end in the window if it is past half of it, else at the last space,
+// else at a UTF-8 boundary. A reply sends up to max_pages of them, numbered
+// (k/n); the rest waits in a per-peer cache for /more.
+static constexpr size_t kReplyMaxBytes = 256*1024;     // output considered for pages
+static constexpr long long kMoreTtlMs = 3600*1000;
+
+static std::vector<std::string> paginate(std::string_view text, size_t page_bytes){
+  std::vector<std::string> pages;
+  auto push=[&](std::string_view p){
+    std::string s(p);
+    s.erase(std::remove(s.begin(), s.end(), '\r'), s.end());
+    while(!s.empty() && (s.back()=='\n' || s.back()==' ')) s.pop_back();
+    while(!s.empty() && s.front()=='\n') s.erase(0, 1);
+    if(!s.empty()) pages.push_back(std::move(s));
+  };
+  page_bytes = std::max<size_t>(page_bytes, 64);
+  while(text.size() > page_bytes){
+    std::string_view w = text.substr(0, page_bytes);
+    size_t cut = w.rfind('\n');
+    if(cut==std::string_view::npos || cut < page_bytes/2){
+      cut = w.rfind(' ');
+      if(cut==std::string_view::npos || cut < page_bytes/2) cut = utf8_floor(text, page_bytes);
+      else cut++;
+    } else cut++;
+    if(cut==0) cut = page_bytes;
+    push(text.substr(0, cut));
+    text.remove_prefix(cut);
+  }
+  push(text);
+  return pages;
+}
+
+class ReplyPager {
+  struct Pending { std::string cmd; std::vector<std::string> pages; size_t next = 0; long long at = 0; };
+  std::map<std::string, Pending> more;                 // peer -> pages not sent yet
+  size_t page_bytes, max_pages;
+
+  // The next batch for `p`, numbered; the first page of a reply carries `head`.
+  std::vector<std::string> batch(Pending& p, const std::string& head){
+    std::vector<std::string> out;
+    size_t n = p.pages.size(), end = max_pages ? std::min(n, p.next + max_pages) : n;
+    for(; p.next < end; p.next++){
+      std::string m = out.empty() ? head : std::string();
+      if(n>1) m += (m.empty() ? "(" : " (") + std::to_string(p.next+1) + "/" + std::to_string(n)
+                   + (p.next+1==end && end<n ? ", /more for the rest)" : ")");
+      if(!m.empty()) m.push_back('\n');
+      out.push_back(m + p.pages[p.next]);
+    }
+    return out;
+  }
+
+public:
+  ReplyPager(size_t bytes, size_t pages):page_bytes(bytes), max_pages(pages){}
+
+  // Messages for a command's reply; remembers what did not fit.
+  std::vector<std::string> reply(const std::string& peer, const std::string& cmd, const std::string& head, std::string_view out){
+    size_t room = page_bytes > head.size()+64 ? page_bytes - head.size() - 32 : 64;   // " (k/n, /more for the rest)\n"
+    Pending p{cmd, paginate(out.substr(0, utf8_floor(out, kReplyMaxBytes)), room), 0, now_ms()};
+    std::vector<std::string> msgs = batch(p, head);
+    if(msgs.empty()) msgs.push_back(head);
+    if(p.next < p.pages.size()) more[peer] = std::move(p);
+    else more.erase(peer);
+    return msgs;
+  }
+
+  // Messages for /more.
+  std::vector<std::string> next(const std::string& peer){
+    long long now = now_ms();
+    for(auto it = more.begin(); it!=more.end(); ) it = now - it->second.at > kMoreTtlMs ? more.erase(it) : std::next(it);
+    auto it = more.find(peer);
+    if(it==more.end()) return { "nothing more" };
+    std::vector<std::string> msgs = batch(it->second, "more " + it->second.cmd);
+    if(it->second.next >= it->second.pages.size()) more.erase(it);
+    return msgs;
+  }
+};
+
 static void on_sigint(int){ g_running=false; }
 
 // ---------------- main ----------------
@@ -338,8 +1143,11 @@ int main(int argc, char** argv){
   bool auto_reply=false;
   bool debug=false;
   int timeout_sec=30;
+  bool stream_all=false;
+  int stream_ms=2000, stream_bytes=1024;
+  int reply_bytes=800, reply_pages=4;
 
-  bool cli_log_dir=false, cli_log_prefix=false, cli_log_ext=false;
+  bool cli_log_dir=false, cli_log_prefix=false, cli_log_ext=false, cli_utf8=false;
 
   // parse
   for(int i=1;i<argc;i++){
@@ -355,7 +1163,13 @@ int main(int argc, char** argv){
     else if(s=="--log-prefix"){ if(need("--log-prefix")) return 2; log_prefix=argv[++i]; cli_log_prefix=true; }
     else if(s=="--log-ext"){ if(need("--log-ext")) return 2; log_ext=argv[++i]; cli_log_ext=true; }
     else if(s=="--cmd-timeout"){ if(need("--cmd-timeout")) return 2; timeout_sec=std::stoi(argv[++i]); }
+    else if(s=="--utf8"){ if(need("--utf8")) return 2; utf8_policy()=utf8_policy_from_name(argv[++i]); cli_utf8=true; }
     else if(s=="--auto-reply"){ auto_reply=true; }
+    else if(s=="--reply-bytes"){ if(need("--reply-bytes")) return 2; reply_bytes=std::stoi(argv[++i]); }
+    else if(s=="--reply-pages"){ if(need("--reply-pages")) return 2; reply_pages=std::stoi(argv[++i]); }
+    else if(s=="--stream"){ stream_all=true; }
+    else if(s=="--stream-ms"){ if(need("--stream-ms")) return 2; stream_ms=std::stoi(argv[++i]); }
+    else if(s=="--stream-bytes"){ if(need("--stream-bytes")) return 2; stream_bytes=std::stoi(argv[++i]); }
     else if(s=="--debug"){ debug=true; }
     else if(s=="--help"){ print_help_long(); return 0; }
     else if(s=="--version"){ std::cout<<kVersion<<"\n"; return 0; }
@@ -365,6 +1179,10 @@ int main(int argc, char** argv){
   if(!file.empty() && !peer.empty()){ std::cerr<<"choose one of --file or --peer\n\n"; print_help_long(); return 2; }
   if(file.empty() && peer.empty()){ std::cerr<<"--file or --peer required\n\n"; print_help_long(); return 2; }
 
+  // fork the zygote while the process is still small
+  Spawner spawner;
+  spawner.start(debug);
+
   // apply log config from wa-hub.json if present (only for values not set by CLI)
   if(!cfg.empty()){
     json j = load_json_file(cfg);
@@ -375,6 +1193,8 @@ int main(int argc, char** argv){
         log_prefix = j["runner_log_prefix"].get<std::string>();
       if(!cli_log_ext && j.contains("runner_log_ext") && j["runner_log_ext"].is_string())
         log_ext = j["runner_log_ext"].get<std::string>();
+      if(!cli_utf8 && j.contains("utf8_policy") && j["utf8_policy"].is_string())
+        utf8_policy() = utf8_policy_from_name(j["utf8_policy"].get<std::string>());
     }
   }
 
@@ -387,14 +1207,18 @@ int main(int argc, char** argv){
     return 2;
   }
   if(debug) std::cerr<<"loaded commands keys: "<<cmdmap.size()<<"\n";
+  check_builtins(cmdmap);
+  RunnerStats stats;
+  ReplyPager pager((size_t)std::max(0, reply_bytes), (size_t)std::max(0, reply_pages));
 
-  // build wa-sub command
+  // build wa-sub command (only the members read below travel through the pipe)
   std::vector<std::string> sub_argv;
   if(!file.empty()){
     sub_argv = { wa_sub.string(), "--file", file.string(), "--kind", "received", "--follow" };
   } else {
     sub_argv = { wa_sub.string(), "--peer", peer, "--kind", "received", "--follow", "--config", cfg.string() };
   }
+  sub_argv.insert(sub_argv.end(), { "--fields", "kind,peer,text,ts" });
 
   if(debug){
     std::cerr<<"spawn: ";
@@ -403,35 +1227,36 @@ int main(int argc, char** argv){
   }
 
 #if defined(__unix__) || defined(__APPLE__)
-  int pipefd[2];
-  if(pipe(pipefd)!=0){ std::perror("pipe"); return 1; }
-  pid_t pid=fork();
-  if(pid<0){ std::perror("fork"); return 1; }
-  if(pid==0){
-    // child: wa-sub -> stdout -> pipe
-    dup2(pipefd[1], STDOUT_FILENO);
-    close(pipefd[0]); close(pipefd[1]);
-    std::vector<char*> cargv; cargv.reserve(sub_argv.size()+1);
-    for(auto& s: sub_argv) cargv.push_back(const_cast<char*>(s.c_str()));
-    cargv.push_back(nullptr);
-    execvp(cargv[0], cargv.data());
-    std::perror("execvp wa-sub");
-    _exit(127);
-  }
-  // parent:
-  close(pipefd[1]);
+  // wa-sub -> stdout -> pipe
+  Child sub;
+  if(!spawner.spawn(sub_argv, 0, sub)){ std::perror("spawn wa-sub"); return 1; }
 
   signal(SIGINT, on_sigint);
   signal(SIGTERM, on_sigint);
+  signal(SIGPIPE, SIG_IGN);            // a worker that died under us is an error, not a signal
 
-  FILE* in = fdopen(pipefd[0], "r");
-  if(!in){ std::perror("fdopen"); return 1; }
+  WorkerPool pool(spawner);
+  pool.load(cmdmap, debug);
 
-  char* line=nullptr; size_t n=0;
+  // Lines from wa-sub; between them (at least once a second) the pool
+  // checks its workers.
+  std::string inbuf;
+  bool in_eof = false;
   while(g_running){
-    ssize_t r=getline(&line,&n,in);
-    if(r<=0){ if(feof(in)) break; clearerr(in); std::this_thread::sleep_for(std::chrono::milliseconds(50)); continue; }
-    std::string raw(line, r);
+    size_t nl;
+    while((nl = inbuf.find('\n'))==std::string::npos && !in_eof && g_running){
+      pollfd pfd{sub.out, POLLIN, 0};
+      if(poll(&pfd, 1, 1000) > 0){
+        char buf[65536];
+        ssize_t r = read(sub.out, buf, sizeof(buf));
+        if(r>0) inbuf.append(buf, (size_t)r);
+        else if(r==0 || errno!=EINTR) in_eof = true;
+      }
+      pool.tick();
+    }
+    if(nl==std::string::npos) break;
+    std::string raw = inbuf.substr(0, nl+1);
+    inbuf.erase(0, nl+1);
 
     // wa-sub prints one JSON obj per line
     json ev = json::parse(raw, nullptr, false);
@@ -470,41 +1295,68 @@ int main(int argc, char** argv){
 
     fs::path logf = log_dir / (log_prefix + peer_in + log_ext);
 
-    if(mapping.is_null() || !mapping.is_array() || mapping.empty()){
+    // /more: the next pages of this peer's last long reply (unless the map has its own)
+    if(name=="more" && mapping.is_null() && auto_reply && !fifo.empty()){
+      std::vector<std::string> msgs = pager.next(peer_in);
+      json rec = {{"ts",ts},{"peer",peer_in},{"incoming",text},{"cmd",name},{"rc",0},{"pages",msgs.size()}};
+      { std::ofstream lf(logf, std::ios::app); lf<<rec.dump()<<'\n'; }
+      fifo_send_batch(fifo, peer_in, msgs);
+      continue;
+    }
+
+    std::vector<std::string> tmpl = entry_argv(mapping);
+    if(tmpl.empty()){
+      stats.unknown++;
       json rec = {{"ts",ts},{"peer",peer_in},{"incoming",text},{"cmd",name},{"rc",-1},{"stderr","unknown command"}};
       std::ofstream lf(logf, std::ios::app); lf<<rec.dump()<<'\n';
       continue;
     }
 
-    std::vector<std::string> tmpl;
-    for(auto& v: mapping) if(v.is_string()) tmpl.push_back(v.get<std::string>());
-    auto argv_run = build_argv(tmpl, argline);
-
     std::string sout, serr;
-    int rc = run_argv(argv_run, sout, serr, timeout_sec);
+    int rc;
+    std::optional<ReplyStream> stream;
+    auto t0 = std::chrono::steady_clock::now();
+    if(is_builtin(tmpl)){
+      rc = run_builtin(tmpl, argline, peer_in, cmdmap, stats, sout, serr);
+    } else if(Worker* w = pool.find(mapping)){
+      json req = {{"cmd",name},{"peer",peer_in},{"args",argline},{"argv",shlex_split(argline)},{"ts",ts}};
+      rc = w->call(std::move(req), sout, serr, timeout_sec);
+    } else {
+      bool want = mapping.is_object() && mapping.contains("stream") && mapping["stream"].is_boolean()
+                  ? mapping["stream"].get<bool>() : stream_all;
+      if(want && auto_reply && !fifo.empty())
+        stream.emplace([&](std::string part){ fifo_send(fifo, peer_in, part); },
+                       entry_int(mapping, "stream_ms", stream_ms), (size_t)std::max(0, entry_int(mapping, "stream_bytes", stream_bytes)));
+      rc = run_argv(spawner, build_argv(tmpl, argline), sout, serr, entry_int(mapping, "timeout", timeout_sec),
+                    stream ? &*stream : nullptr);
+      if(stream){
+        stream->flush();
+        sout = stream->total > stream->head.size() ? stream->head.substr(0, utf8_complete(stream->head)) : stream->head;
+      }
+    }
+    stats.add(name, rc, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+    // command output is arbitrary bytes; json::dump() throws on bad UTF-8
+    sout = utf8_clean(sout); serr = utf8_clean(serr);
 
     json rec = {
       {"ts",ts},{"peer",peer_in},{"incoming",text},{"cmd",name},
       {"argv",tmpl},{"args",argline},{"rc",rc},
       {"stdout",sout},{"stderr",serr}
     };
+    if(stream){ rec["stdout_bytes"] = stream->total; rec["streamed"] = stream->sent; }
     { std::ofstream lf(logf, std::ios::app); lf<<rec.dump()<<'\n'; }
 
     if(auto_reply && !fifo.empty()){
-      std::ostringstream reply;
-      reply<<"ok "<<name<<" rc="<<rc;
-      if(!sout.empty()){
-        std::string cut = sout.substr(0, std::min<size_t>(800, sout.size()));
-        cut.erase(std::remove(cut.begin(), cut.end(), '\r'), cut.end());
-        if(!cut.empty() && cut.back()=='\n') cut.pop_back();
-        reply<<"\n"<<cut;
-      }
-      fifo_send(fifo, peer_in, reply.str());
+      std::string head = "ok " + name + " rc=" + std::to_string(rc);
+      if(stream) fifo_send(fifo, peer_in, head + " (" + std::to_string(stream->sent) + (stream->sent==1 ? " part)" : " parts)"));
+      else fifo_send_batch(fifo, peer_in, pager.reply(peer_in, name, head, sout));
     }
   }
-  if(line) free(line);
-  fclose(in);
-  int st=0; waitpid(pid,&st,0);
+  pool.stop();
+  Spawner::close_pipes(sub);
+  spawner.signal(sub, SIGTERM);
+  spawner.reap(sub);
+  spawner.stop();
 #else
   std::cerr<<"wa-runner only implemented on Unix-like systems.\n";
   return 1;
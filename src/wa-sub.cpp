@@ -1,21 +1,54 @@
 // wa-sub.cpp  v1.4 — NAS-safe tail, alias-aware peer resolution, configurable dirs/names
 #include <nlohmann/json.hpp>
+#include "wa-ring.hpp"
+#include "wa-layout.hpp"
+#include "wa-pubsub.hpp"
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
 #include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <regex>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#ifdef WA_HAVE_ZSTD
+  #include <zstd.h>
+#endif
+#ifdef WA_HAVE_ZLIB
+  #include <zlib.h>
+#endif
+
 using json = nlohmann::json;
+using ojson = nlohmann::ordered_json;   // keeps "op" first in control lines
 namespace fs = std::filesystem;
 
 static long long now_ms(){
@@ -34,6 +67,15 @@ struct HubCfg {
   std::string global_name = "events.jsonl";
   std::string per_prefix = "events.";
   std::string per_suffix = ".jsonl";
+  int per_fanout = 0;
+
+  fs::path shm_ring;                   // wa-hub's shared-memory event ring, if enabled
+  fs::path spool_dir;                  // wa-hub writes here and ships copies to global_dir/per_dir
+
+  // wa-sub --serve
+  fs::path serve_socket;               // default: base_dir/wa-sub.sock
+  size_t serve_window_events = 50000;  // recent events held for since_ts / from_seq
+  size_t serve_client_buffer = 1<<20;  // max unsent bytes per client
 
   // legacy
   std::string legacy_global_log;
@@ -65,7 +107,7 @@ static HubCfg load_hub_cfg(const fs::path& cfg_path_in){
         auto P=[&](const char* k, fs::path& v){
           if(j.contains(k)){
             fs::path tmp = j[k].get<std::string>();
-            v = tmp.is_absolute()? tmp : (cfg_dir / tmp);
+            v = tmp.empty()? fs::path() : tmp.is_absolute()? tmp : (cfg_dir / tmp);   // "" = unset
           }
         };
         auto S=[&](const char* k, std::string& v){ if(j.contains(k)) v=j[k].get<std::string>(); };
@@ -79,6 +121,12 @@ static HubCfg load_hub_cfg(const fs::path& cfg_path_in){
         S("global_name", c.global_name);
         S("per_prefix",  c.per_prefix);
         S("per_suffix",  c.per_suffix);
+        if(j.contains("per_fanout")) c.per_fanout = std::clamp(j["per_fanout"].get<int>(), 0, 2);
+        P("shm_ring", c.shm_ring);
+        P("spool_dir", c.spool_dir);
+        P("serve_socket", c.serve_socket);
+        if(j.contains("serve_window_events")) c.serve_window_events = j["serve_window_events"].get<size_t>();
+        if(j.contains("serve_client_buffer")) c.serve_client_buffer = j["serve_client_buffer"].get<size_t>();
 
         S("global_log", c.legacy_global_log);
       }catch(...){}
@@ -88,6 +136,7 @@ static HubCfg load_hub_cfg(const fs::path& cfg_path_in){
   if(c.data_dir.empty()) c.data_dir = c.base_dir;
   if(c.global_dir.empty()) c.global_dir = c.data_dir;
   if(c.per_dir.empty())    c.per_dir    = c.data_dir;
+  if(c.serve_socket.empty()) c.serve_socket = c.base_dir / "wa-sub.sock";
 
   if(!c.legacy_global_log.empty()){
     fs::path gl = c.legacy_global_log;
@@ -104,13 +153,35 @@ static HubCfg load_hub_cfg(const fs::path& cfg_path_in){
 }
 
 // ---------- args/help ----------
+enum class OutFmt { Raw, Ndjson, Tsv, Lp };   // --format (Raw = whole lines)
+
 struct Args{
   fs::path file;
   std::string peer;
   fs::path cfg;
   std::optional<std::string> kind;     // received|sent|status
   std::optional<std::string> grep_pat; // regex on .text (use (?i) prefix for case-insensitive)
+  std::optional<std::string> where;    // --where EXPR
   std::optional<long long> since_ts;   // epoch ms
+  std::optional<size_t> last;          // --last N
+  std::optional<long long> until_ts;   // epoch ms, exclusive
+  std::optional<size_t> limit;         // page size
+  std::string before_cursor, after_cursor;
+  bool page = false;                   // one bounded read of history, no mode
+  std::string aggregate;               // --aggregate LIST
+  int every_sec = 60;                  // --follow --aggregate: report period
+  std::vector<std::string> fields;     // --fields a,b,c
+  OutFmt format = OutFmt::Raw;
+  std::optional<long long> flush;      // -1 event, 0 batch, else ms
+  std::string on_slow = "block";       // block|drop|spill
+  fs::path spill;
+  size_t out_buffer = 1<<20;
+  fs::path ring;                       // explicit shared-memory ring
+  bool no_ring=false;
+  fs::path socket;                     // --serve socket (default from CFG)
+  fs::path cursor_file;
+  int checkpoint_ms = 1000;
+  bool serve=false, no_serve=false;
   bool follow=false, once=false, json_array=false, debug=false, help=false;
   std::optional<int> window_sec;
   std::optional<int> timeout_sec;
@@ -122,31 +193,135 @@ R"(wa-sub v1.4 — tail and filter wa-hub JSONL logs
 
 USAGE
   wa-sub --file <path> | --peer <name|number> [--config <wa-hub.json>]
-         [--kind received|sent|status] [--grep <regex>] [--since-ts <epoch_ms>]
-         (--follow | --once --timeout <sec> | --window <sec> [--json-array])
-         [--debug] [--help]
+         [--kind received|sent|status] [--grep <regex>] [--where <expr>] [--since-ts <epoch_ms>]
+         (--follow | --once --timeout <sec> | --window <sec> [--json-array] | --last N [--follow|--window <sec>])
+         [--cursor-file <path> [--checkpoint-ms MS]]
+  wa-sub --file <path> | --peer <name|number> [filters] [--json-array]
+         [--since-ts MS] [--until-ts MS] [--limit N] [--before-cursor C | --after-cursor C]
+  (any of the above) [--fields a,b,c [--format ndjson|tsv|lp]]
+         [--flush event|batch|MS] [--out-buffer BYTES] [--on-slow block|drop|spill[:PATH]]
+  wa-sub --file <path> | --peer <name|number> [filters] --aggregate LIST
+         [history bounds | --window S | --follow [--every S]]
+         [--ring <path> | --no-ring] [--socket <path> | --no-serve] [--debug] [--help]
+  wa-sub --serve [--config <wa-hub.json>] [--socket <path>] [--ring <path> | --no-ring]
 
 SOURCES
-  --file PATH                    Read this JSONL file directly.
+  --file PATH                    Read this JSONL file directly. A compressed archive (.zst/.gz)
+                                 is decoded frame by frame and read once.
   --peer NAME|NUMBER --config CFG
                                  Resolve to per-peer file using CFG:
-                                   tail (per_dir)/(per_prefix + KEY + per_suffix)
+                                   tail (per_dir)/[shard/](per_prefix + KEY + per_suffix)
+                                 shard = hashed subdirectories when per_fanout > 0.
                                  If NUMBER matches an alias in aliases_path, KEY is that alias.
 
 FILTERS
   --kind received|sent|status    Only those event kinds.
   --grep REGEX                   Match .text with REGEX. Prefix (?i) for case-insensitive.
-  --since-ts MS                  Only events with ts >= MS (epoch milliseconds).
+  --since-ts MS                  Only events with ts >= MS (epoch milliseconds). Also scans
+                                 rotated archives (plain, .zst or .gz) last written at or after MS,
+                                 chosen from wa-hub's .manifest when present.
+  --where EXPR                   Only events for which EXPR holds, e.g.
+                                   kind in (received,sent) and peer ~ "^44" and len(text) > 100
+                                 Tests: FIELD (== | != | < | <= | > | >= | ~ | !~) VALUE,
+                                 FIELD in (V1,V2,..), len(FIELD) OP N; joined with and/or/not
+                                 (&&, ||, !) and parentheses. FIELD is any top-level member
+                                 (kind, peer, text, status, ts, ...); an absent one reads as "".
+                                 ~ is a regex search ((?i) prefix: ignore case); < > compare numbers,
+                                 == and in compare text. Values: "quoted", 'quoted' or bare words.
+                                 Compiled once; the cheapest tests run first.
 
 MODES (choose exactly one)
   --follow                       Stream new matching lines until Ctrl-C.
   --once --timeout S             Exit on first matching line or after S seconds (exit code 1 on timeout).
   --window S [--json-array]      Collect for S seconds, then exit. With --json-array prints one JSON array.
+  --last N                       Print the last N matching lines, oldest first, then exit (or go on with
+                                 --follow / --window). Reads backwards from the end of the file and on
+                                 into archives only as far as needed (zstd archives frame by frame).
+                                 With --since-ts, stops at the first older line.
+
+PAGES (no mode: read one page of history and exit)
+  --until-ts MS                  Only events with ts < MS; reading stops at the first newer line.
+  --limit N                      At most N matching lines. Without --since-ts or --after-cursor these
+                                 are the newest N (before --until-ts or the cursor), still printed
+                                 oldest first.
+  --before-cursor C              The lines just before the line C names.
+  --after-cursor C               The lines just after the line C names.
+                                 A page ends with one line on stderr:
+                                   {"page":{"count":N,"more":BOOL,"before":C,"after":C}}
+                                 Pass "before" to --before-cursor for the page in front of it, "after"
+                                 to --after-cursor for the next one. Cursors stay valid across
+                                 rotation and compression; "more" = another match lies beyond.
+                                 Archives are chosen by their ts range in wa-hub's .manifest and the
+                                 start point inside one is found by bisection, not by scanning.
+
+AGGREGATE
+  --aggregate LIST               Count matching events instead of printing them; prints compact JSON.
+                                 LIST is comma-separated:
+                                   kind        events per kind
+                                   status      status events per status value
+                                   peer[:K]    the K (default 10) busiest peers, space-saving sketch:
+                                               "err" bounds how much a count may be overstated
+                                               (0 while there are at most 4096 peers, or 4*K)
+                                   distinct    number of distinct peers (HyperLogLog, ~1.6% error)
+                                   bucket:S    one line per S-second bucket as soon as it closes:
+                                                 {"bucket":START_MS,"secs":S,"events":N,...}
+                                 Then a summary {"from_ts","to_ts","events",...}. Memory stays fixed.
+                                 Without a mode it reads history (--since-ts/--until-ts/cursors, as a
+                                 page without --limit); with --window S it covers the window; with
+                                 --follow it reports every --every S seconds (default 60) and on
+                                 Ctrl-C, each report covering the events since the last one.
+
+OUTPUT
+  --fields a,b,c                 Print only these top-level members of each line, copied byte for
+                                 byte from it (string values keep their JSON escapes).
+  --format ndjson|tsv|lp         With --fields (default ndjson):
+                                   ndjson  {"a":..,"b":..} with the selected keys; absent ones left out
+                                   tsv     values separated by tabs, strings without quotes; absent = empty
+                                   lp      binary: per line a u32 record length, then per field a u32
+                                           length and its bytes (as in tsv); all little-endian
+  --flush event|batch|MS         When buffered output is written: after every event (default for
+                                 --follow/--once), per burst read from the log and whenever the
+                                 buffer fills (default otherwise), or at most MS ms after an event.
+                                 Always on exit.
+  --out-buffer BYTES             Output buffer size (default 1048576).
+  --on-slow block|drop|spill[:PATH]
+                                 When the reader falls behind and the buffer is full: wait for it
+                                 (default), drop events until it catches up (the count goes to
+                                 stderr), or queue them in a spill file (default $TMPDIR/wa-sub-spill-PID,
+                                 unlinked at once) and feed them in order when it drains. drop/spill
+                                 keep the tail going but need stdout to be a pipe or socket to notice;
+                                 they do not combine with --cursor-file.
+
+CURSOR
+  --cursor-file PATH             Resume where the last run with this cursor stopped (segment, inode,
+                                 byte offset, last ts), across rotations and without rescanning; the
+                                 cursor is saved as lines are taken. Takes precedence over --since-ts
+                                 once it exists. Lines after the saved position are delivered at least
+                                 once. Always reads the files itself (no --serve client).
+  --checkpoint-ms MS             Save the cursor at most every MS milliseconds (default 1000; 0 = after
+                                 every line). It is also saved on exit, SIGINT and SIGTERM.
+
+SERVER
+  --serve                        Follow the global log once and serve any number of followers over
+                                 a Unix socket (serve_socket in CFG, default base_dir/wa-sub.sock),
+                                 keeping the last serve_window_events events in memory.
+                                 While it runs, --peer (and --file on the global log) become thin
+                                 clients of it; history older than its window is read from the files.
+  --socket PATH                  Server socket to listen on / connect to.
+  --no-serve                     Never use a running server.
 
 OTHER
   --config CFG                   Path to wa-hub.json (for --peer). If omitted, tries:
                                    $WA_HUB_CONFIG, ~/.wa-hub/wa-hub.json, ./wa-hub.json
   --json-array                   Buffer matched lines and print as a single JSON array (for --window/--once).
+  --ring PATH                    Take new events from wa-hub's shared-memory ring at PATH instead of
+                                 polling the file (events of --peer, or every event with --file).
+                                 By default the ring named by shm_ring in CFG is used for --peer, and
+                                 for --file when it is the global log. The file is still read up to
+                                 the hand-off and whenever this reader falls a whole ring behind.
+                                 With spool_dir set in CFG the ring describes the spool files, so it
+                                 is only used for a --file inside spool_dir.
+  --no-ring                      Always poll the file.
   --debug                        Print the resolved file path to stderr.
   --help                         This help.
 
@@ -174,20 +349,86 @@ static Args parse(int argc,char**argv){
     else if(s=="--config"){ need("--config"); a.cfg=argv[++i]; }
     else if(s=="--kind"){ need("--kind"); a.kind=argv[++i]; }
     else if(s=="--grep"){ need("--grep"); a.grep_pat=argv[++i]; }
+    else if(s=="--where"){ need("--where"); a.where=argv[++i]; }
     else if(s=="--since-ts"){ need("--since-ts"); a.since_ts=std::stoll(argv[++i]); }
+    else if(s=="--until-ts"){ need("--until-ts"); a.until_ts=std::stoll(argv[++i]); }
+    else if(s=="--limit"){ need("--limit"); a.limit=(size_t)std::max(0LL, std::stoll(argv[++i])); }
+    else if(s=="--before-cursor"){ need("--before-cursor"); a.before_cursor=argv[++i]; }
+    else if(s=="--after-cursor"){ need("--after-cursor"); a.after_cursor=argv[++i]; }
+    else if(s=="--aggregate"){ need("--aggregate"); a.aggregate=argv[++i]; }
+    else if(s=="--every"){ need("--every"); a.every_sec=std::max(1, std::stoi(argv[++i])); }
+    else if(s=="--fields"){
+      need("--fields"); std::stringstream ss(argv[++i]); std::string f;
+      while(std::getline(ss, f, ',')) if(!f.empty()) a.fields.push_back(f);
+    }
+    else if(s=="--format"){
+      need("--format"); std::string v = argv[++i];
+      if(v=="ndjson") a.format = OutFmt::Ndjson;
+      else if(v=="tsv") a.format = OutFmt::Tsv;
+      else if(v=="lp") a.format = OutFmt::Lp;
+      else die_usage("invalid --format (use ndjson|tsv|lp)");
+    }
+    else if(s=="--flush"){
+      need("--flush"); std::string v = argv[++i];
+      if(v=="event") a.flush = -1;
+      else if(v=="batch") a.flush = 0;
+      else if(std::atoll(v.c_str()) > 0) a.flush = std::atoll(v.c_str());
+      else die_usage("invalid --flush (use event|batch|MS)");
+    }
+    else if(s=="--out-buffer"){ need("--out-buffer"); a.out_buffer=(size_t)std::max(4096LL, std::stoll(argv[++i])); }
+    else if(s=="--on-slow"){
+      need("--on-slow"); std::string v = argv[++i];
+      if(v.rfind("spill:",0)==0){ a.spill = v.substr(6); v = "spill"; }
+      if(v!="block" && v!="drop" && v!="spill") die_usage("invalid --on-slow (use block|drop|spill[:PATH])");
+      a.on_slow = v;
+    }
+    else if(s=="--last"){ need("--last"); a.last=(size_t)std::max(1LL, std::stoll(argv[++i])); }
     else if(s=="--follow"){ a.follow=true; }
     else if(s=="--once"){ a.once=true; }
     else if(s=="--window"){ need("--window"); a.window_sec=std::stoi(argv[++i]); }
     else if(s=="--timeout"){ need("--timeout"); a.timeout_sec=std::stoi(argv[++i]); }
     else if(s=="--json-array"){ a.json_array=true; }
+    else if(s=="--ring"){ need("--ring"); a.ring=argv[++i]; }
+    else if(s=="--no-ring"){ a.no_ring=true; }
+    else if(s=="--serve"){ a.serve=true; }
+    else if(s=="--socket"){ need("--socket"); a.socket=argv[++i]; }
+    else if(s=="--no-serve"){ a.no_serve=true; }
+    else if(s=="--cursor-file"){ need("--cursor-file"); a.cursor_file=argv[++i]; }
+    else if(s=="--checkpoint-ms"){ need("--checkpoint-ms"); a.checkpoint_ms=std::max(0, std::stoi(argv[++i])); }
     else if(s=="--debug"){ a.debug=true; }
     else { die_usage(std::string("unknown arg: ")+s); }
   }
 
   if(a.help){ print_help(); std::exit(0); }
+  if(a.serve){
+    if(a.follow||a.once||a.window_sec||!a.file.empty()||!a.peer.empty()||a.kind||a.grep_pat||a.since_ts)
+      die_usage("--serve takes no source, filter or mode (clients bring their own)");
+    return a;
+  }
 
   int modes=(a.follow?1:0)+(a.once?1:0)+(a.window_sec?1:0);
-  if(modes!=1) die_usage("choose exactly one mode: --follow OR --once --timeout S OR --window S");
+  if(a.format!=OutFmt::Raw && a.fields.empty()) die_usage("--format needs --fields");
+  if(a.on_slow!="block" && !a.cursor_file.empty()) die_usage("--on-slow drop|spill do not combine with --cursor-file");
+  if(!a.fields.empty()){
+    if(a.format==OutFmt::Raw) a.format = OutFmt::Ndjson;
+    if(a.format!=OutFmt::Ndjson && a.json_array) die_usage("--json-array needs --format ndjson");
+    if(!a.aggregate.empty()) die_usage("--fields does not apply to --aggregate");
+  }
+  if(!a.aggregate.empty()){
+    if(a.once || a.last || a.limit || a.json_array || !a.cursor_file.empty())
+      die_usage("--aggregate takes no --once, --last, --limit, --json-array or --cursor-file");
+  }
+  a.page = a.until_ts || a.limit || !a.before_cursor.empty() || !a.after_cursor.empty() || (!a.aggregate.empty() && !modes);
+  if(a.page){
+    if(modes || a.last) die_usage("--until-ts/--limit/--before-cursor/--after-cursor read one page: no mode, no --last");
+    if(!a.cursor_file.empty()) die_usage("pages do not combine with --cursor-file");
+    if(!a.before_cursor.empty() && !a.after_cursor.empty()) die_usage("use --before-cursor or --after-cursor, not both");
+  }
+  else if(a.last){
+    if(modes>1 || a.once) die_usage("--last N goes alone or with --follow or --window S");
+    if(!a.cursor_file.empty()) die_usage("--last does not combine with --cursor-file");
+  }
+  else if(modes!=1) die_usage("choose exactly one mode: --follow OR --once --timeout S OR --window S");
 
   if(a.file.empty() && a.peer.empty()) die_usage("specify --file PATH or --peer NAME");
   if(a.once && !a.timeout_sec) die_usage("--once requires --timeout <sec>");
@@ -197,15 +438,348 @@ static Args parse(int argc,char**argv){
   return a;
 }
 
+// ---------- raw lines ----------
+// wa-hub writes one flat JSON object per line. Members are located in the
+// raw bytes; nothing is parsed into a document.
+// ts of a wa-hub event line (the last member) without parsing it; 0 if absent.
+// An escaped \"ts\": inside a string value is not it.
+static long long line_ts(std::string_view line){
+  size_t p = line.size();
+  while((p = line.rfind("\"ts\":", p))!=std::string_view::npos){
+    if(p==0 || line[p-1]!='\\') return std::strtoll(line.data()+p+5, nullptr, 10);
+    if(p-- == 0) break;
+  }
+  return 0;
+}
+
+// End of the JSON value starting at s[i] (one past it).
+static size_t value_end(std::string_view s, size_t i){
+  int depth = 0;
+  for(; i<s.size(); i++){
+    char c = s[i];
+    if(c=='"'){
+      for(i++; i<s.size() && s[i]!='"'; i++) if(s[i]=='\\') i++;
+      if(depth==0) return std::min(i+1, s.size());
+    }
+    else if(c=='{' || c=='[') depth++;
+    else if(c=='}' || c==']'){ if(depth==0) return i; if(--depth==0) return i+1; }
+    else if(c==',' && depth==0) return i;
+  }
+  return s.size();
+}
+
+// Raw bytes of top-level member `key` of a one-line JSON object: strings
+// keep their quotes and escapes, so the slice can be copied into other JSON
+// as is. Empty if absent. No parse, no copy.
+static std::string_view raw_field(std::string_view s, std::string_view key){
+  size_t i = s.find('{');
+  if(i==std::string_view::npos) return {};
+  for(i++; i<s.size(); ){
+    while(i<s.size() && (s[i]==' ' || s[i]==',')) i++;
+    if(i>=s.size() || s[i]!='"') return {};
+    size_t k = ++i;
+    for(; i<s.size() && s[i]!='"'; i++) if(s[i]=='\\') i++;
+    std::string_view name = s.substr(k, std::min(i, s.size())-k);
+    i++;
+    while(i<s.size() && (s[i]==' ' || s[i]==':')) i++;
+    size_t e = value_end(s, i);
+    if(name==key) return s.substr(i, e-i);
+    i = e;
+  }
+  return {};
+}
+
+// A string member without its quotes (escapes kept); empty if absent or not a string.
+static std::string_view raw_string(std::string_view s, std::string_view key){
+  std::string_view v = raw_field(s, key);
+  return v.size()>=2 && v.front()=='"' ? v.substr(1, v.size()-2) : std::string_view();
+}
+
+static void put_utf8(std::string& o, uint32_t c){
+  if(c < 0x80) o += (char)c;
+  else if(c < 0x800){ o += (char)(0xC0|c>>6); o += (char)(0x80|(c&0x3F)); }
+  else if(c < 0x10000){ o += (char)(0xE0|c>>12); o += (char)(0x80|(c>>6&0x3F)); o += (char)(0x80|(c&0x3F)); }
+  else { o += (char)(0xF0|c>>18); o += (char)(0x80|(c>>12&0x3F)); o += (char)(0x80|(c>>6&0x3F)); o += (char)(0x80|(c&0x3F)); }
+}
+
+// JSON string contents (as raw_string returns them) to UTF-8.
+static void json_unescape(std::string_view s, std::string& o){
+  o.clear();
+  for(size_t i=0; i<s.size(); i++){
+    if(s[i]!='\\' || i+1>=s.size()){ o += s[i]; continue; }
+    char c = s[++i];
+    switch(c){
+      case 'b': o += '\b'; break;  case 'f': o += '\f'; break;
+      case 'n': o += '\n'; break;  case 'r': o += '\r'; break;
+      case 't': o += '\t'; break;
+      case 'u': {
+        auto hex4=[&](size_t at)->long{
+          if(at+4 > s.size()) return -1;
+          char h[5] = {s[at], s[at+1], s[at+2], s[at+3], 0}; char* e;
+          long v = std::strtol(h, &e, 16); return *e ? -1 : v;
+        };
+        long u = hex4(i+1);
+        if(u<0){ o += c; break; }
+        i += 4;
+        if(u>=0xD800 && u<0xDC00 && i+2<s.size() && s[i+1]=='\\' && s[i+2]=='u'){
+          long lo = hex4(i+3);
+          if(lo>=0xDC00 && lo<0xE000){ u = 0x10000 + ((u-0xD800)<<10) + (lo-0xDC00); i += 6; }
+        }
+        put_utf8(o, (uint32_t)u);
+        break;
+      }
+      default: o += c;                                 // \" \\ \/
+    }
+  }
+}
+
+// ---------- where expressions ----------
+// --where EXPR, e.g.  kind in (received,sent) and peer ~ "^44" and len(text) > 100
+// is compiled once into a short program for a one-register machine: TEST
+// runs one comparison, JF/JT leave an and/or chain as soon as its outcome
+// is known, NOT negates. The operands of every and/or are put cheapest
+// first (a kind or ts test before a regex over text). Members are sliced
+// out of the line on first use, and unescaped only when a string test
+// needs the text.
+class Where {
+  enum Op : uint8_t { Eq, Ne, Lt, Le, Gt, Ge, Match, NoMatch, In };
+  struct Test {
+    uint16_t field; bool len = false; Op op;
+    double num = 0; std::string str; std::vector<std::string> set;
+    std::shared_ptr<const std::regex> re;
+  };
+  enum Code : uint8_t { TEST, JF, JT, NOT };
+  struct Ins { Code code; uint32_t arg; };     // TEST: test index; JF/JT: target pc
+
+  std::vector<std::string> fields;             // member names used by the tests
+  std::vector<Test> tests;
+  std::vector<Ins> code;
+  // per-line scratch: raw slice and unescaped text of each member, fetched lazily
+  mutable std::vector<uint8_t> state;          // bit 1: raw fetched, bit 2: text decoded
+  mutable std::vector<std::string_view> raw;
+  mutable std::vector<std::string> text;
+
+  // ----- parser -----
+  struct Node { enum { And, Or, Not, Leaf } kind; std::vector<Node> kids; uint32_t test = 0; int cost = 0; };
+  struct Parser {
+    Where& w; std::string_view s; size_t i = 0; std::string err;
+    void ws(){ while(i<s.size() && std::isspace((unsigned char)s[i])) i++; }
+    bool word_char(char c){ return std::isalnum((unsigned char)c) || c=='_' || c=='-' || c=='.' || c=='+'; }
+    bool eat(std::string_view t){
+      ws();
+      if(s.substr(i, t.size())!=t) return false;
+      if(std::isalpha((unsigned char)t.back()) && i+t.size()<s.size() && word_char(s[i+t.size()])) return false;
+      i += t.size(); return true;
+    }
+    bool bang(){                                // "!" as not, but not "!=" or "!~"
+      ws();
+      if(i>=s.size() || s[i]!='!' || (i+1<s.size() && (s[i+1]=='=' || s[i+1]=='~'))) return false;
+      i++; return true;
+    }
+    bool fail(const std::string& m){ if(err.empty()) err = m + " at offset " + std::to_string(i); return false; }
+    // a literal: "quoted", 'quoted' or a bare word/number; `quoted` says which
+    bool literal(std::string& out, bool* quoted = nullptr){
+      ws(); out.clear();
+      if(i<s.size() && (s[i]=='"' || s[i]=='\'')){
+        char q = s[i++];
+        while(i<s.size() && s[i]!=q){                 // \" and \\ are escapes; other backslashes stay (regexes)
+          if(s[i]=='\\' && i+1<s.size() && (s[i+1]==q || s[i+1]=='\\')) i++;
+          out += s[i++];
+        }
+        if(i>=s.size()) return fail("unterminated string");
+        i++; if(quoted) *quoted = true; return true;
+      }
+      while(i<s.size() && word_char(s[i])) out += s[i++];
+      if(quoted) *quoted = false;
+      return !out.empty() || fail("expected a value");
+    }
+    bool expr(Node& n){ return chain(n, Node::Or, "or", "||"); }
+    bool conj(Node& n){ return chain(n, Node::And, "and", "&&"); }
+    bool chain(Node& n, decltype(Node::kind) k, std::string_view w1, std::string_view w2){
+      Node a;
+      if(!(k==Node::Or ? conj(a) : unary(a))) return false;
+      if(!(eat(w1) || eat(w2))){ n = std::move(a); return true; }
+      n = Node{k, {}}; n.kids.push_back(std::move(a));
+      do{
+        Node b;
+        if(!(k==Node::Or ? conj(b) : unary(b))) return false;
+        n.kids.push_back(std::move(b));
+      } while(eat(w1) || eat(w2));
+      return true;
+    }
+    bool unary(Node& n){
+      if(eat("not") || bang()){
+        n = Node{Node::Not, {}}; n.kids.emplace_back();
+        return unary(n.kids[0]);
+      }
+      if(eat("(")){
+        if(!expr(n)) return false;
+        return eat(")") || fail("expected )");
+      }
+      return compare(n);
+    }
+    bool compare(Node& n){
+      Test t; std::string name;
+      bool len = eat("len(");
+      if(!literal(name)) return false;
+      if(len && !eat(")")) return fail("expected )");
+      t.len = len;
+      static const std::pair<std::string_view, Op> ops[] = {
+        {"==",Eq},{"!=",Ne},{"<=",Le},{">=",Ge},{"<",Lt},{">",Gt},{"!~",NoMatch},{"~",Match},{"=",Eq},{"in",In}};
+      bool found = false;
+      for(auto& [tok, op] : ops) if(eat(tok)){ t.op = op; found = true; break; }
+      if(!found) return fail("expected a comparison after '" + name + "'");
+      if(t.op==In){
+        if(!eat("(")) return fail("expected ( after in");
+        do{ std::string v; if(!literal(v)) return false; t.set.push_back(v); } while(eat(","));
+        if(!eat(")")) return fail("expected )");
+      }
+      else if(!literal(t.str)) return false;
+      if(t.op==Match || t.op==NoMatch){
+        std::string pat = t.str; auto flags = std::regex::ECMAScript;
+        if(pat.rfind("(?i)",0)==0){ flags |= std::regex::icase; pat = pat.substr(4); }
+        try{ t.re = std::make_shared<const std::regex>(pat, flags); }
+        catch(const std::regex_error& e){ return fail(std::string("bad regex: ") + e.what()); }
+      }
+      if(len && (t.op==In || t.op==Match || t.op==NoMatch)) return fail("len() compares with numbers only");
+      if(len || t.op==Lt || t.op==Le || t.op==Gt || t.op==Ge){
+        char* e = nullptr; t.num = std::strtod(t.str.c_str(), &e);
+        if(t.str.empty() || *e) return fail("'" + t.str + "' is not a number");
+      }
+      auto it = std::find(w.fields.begin(), w.fields.end(), name);
+      t.field = (uint16_t)(it - w.fields.begin());
+      if(it==w.fields.end()) w.fields.push_back(name);
+      // rough cost: ts is found from the end of the line, other members by a
+      // scan; text is long, len() walks it, a regex dominates everything
+      n = Node{Node::Leaf, {}};
+      n.cost = (name=="ts" ? 1 : name=="text" ? 3 : 2) + (len ? 2 : 0) + (t.re ? 20 : 0);
+      n.test = (uint32_t)w.tests.size();
+      w.tests.push_back(std::move(t));
+      return true;
+    }
+  };
+
+  static int order(Node& n){
+    if(n.kind==Node::Leaf) return n.cost;
+    n.cost = 0;
+    for(auto& k : n.kids) n.cost += order(k);
+    if(n.kind!=Node::Not)
+      std::stable_sort(n.kids.begin(), n.kids.end(), [](const Node& a, const Node& b){ return a.cost < b.cost; });
+    return n.cost;
+  }
+  void emit(const Node& n){
+    switch(n.kind){
+      case Node::Leaf: code.push_back({TEST, n.test}); break;
+      case Node::Not:  emit(n.kids[0]); code.push_back({NOT, 0}); break;
+      default: {
+        std::vector<size_t> jumps;
+        for(size_t k=0; k<n.kids.size(); k++){
+          emit(n.kids[k]);
+          if(k+1<n.kids.size()){ jumps.push_back(code.size()); code.push_back({n.kind==Node::And ? JF : JT, 0}); }
+        }
+        for(size_t j : jumps) code[j].arg = (uint32_t)code.size();
+      }
+    }
+  }
+
+  // ----- evaluation -----
+  std::string_view member(std::string_view line, uint16_t f) const {
+    if(!(state[f] & 1)){
+      raw[f] = fields[f]=="ts" ? [&]{                  // usually the last member: search from the end
+        size_t p = line.rfind("\"ts\":");
+        return p==std::string_view::npos || (p && line[p-1]=='\\') ? raw_field(line, "ts")
+             : line.substr(p+5, value_end(line, p+5)-(p+5));
+      }() : raw_field(line, fields[f]);
+      state[f] |= 1;
+    }
+    return raw[f];
+  }
+  // text of a member: string contents unescaped, other values as written
+  const std::string& value(std::string_view line, uint16_t f) const {
+    if(!(state[f] & 2)){
+      std::string_view v = member(line, f);
+      if(v.size()>=2 && v.front()=='"') json_unescape(v.substr(1, v.size()-2), text[f]);
+      else text[f].assign(v);
+      state[f] |= 2;
+    }
+    return text[f];
+  }
+  bool run(std::string_view line, const Test& t) const {
+    if(t.len || t.op==Lt || t.op==Le || t.op==Gt || t.op==Ge){
+      double x;
+      if(t.len){
+        const std::string& v = value(line, t.field);
+        x = (double)std::count_if(v.begin(), v.end(), [](char c){ return ((unsigned char)c & 0xC0)!=0x80; });
+      } else {
+        std::string_view v = member(line, t.field);
+        if(!v.empty() && v.front()=='"') v = v.substr(1, v.size()-2);
+        if(v.empty()) return false;
+        char* e = nullptr; std::string tmp(v); x = std::strtod(tmp.c_str(), &e);
+        if(*e) return false;
+      }
+      double y = t.num;
+      switch(t.op){
+        case Lt: return x<y;  case Le: return x<=y;
+        case Gt: return x>y;  case Ge: return x>=y;
+        case Ne: return x!=y; default: return x==y;
+      }
+    }
+    const std::string& v = value(line, t.field);
+    switch(t.op){
+      case Eq: return v==t.str;
+      case Ne: return v!=t.str;
+      case In: return std::find(t.set.begin(), t.set.end(), v)!=t.set.end();
+      case Match: return std::regex_search(v, *t.re);
+      case NoMatch: return !std::regex_search(v, *t.re);
+      default: return false;
+    }
+  }
+
+public:
+  // Compiles `src`; on error returns nullopt and sets `err`.
+  static std::optional<Where> compile(const std::string& src, std::string& err){
+    Where w; Parser p{w, src, 0, {}};
+    Node root;
+    bool ok = p.expr(root);
+    if(ok && (p.ws(), p.i<src.size())) ok = p.fail("unexpected '" + std::string(1, src[p.i]) + "'");
+    if(!ok){ err = p.err; return std::nullopt; }
+    order(root);
+    w.emit(root);
+    w.state.resize(w.fields.size()); w.raw.resize(w.fields.size()); w.text.resize(w.fields.size());
+    return w;
+  }
+
+  bool eval(std::string_view line) const {
+    std::fill(state.begin(), state.end(), 0);
+    bool acc = false;
+    for(size_t pc=0; pc<code.size(); pc++){
+      const Ins& in = code[pc];
+      switch(in.code){
+        case TEST: acc = run(line, tests[in.arg]); break;
+        case NOT:  acc = !acc; break;
+        case JF:   if(!acc) pc = in.arg-1; break;
+        case JT:   if(acc)  pc = in.arg-1; break;
+      }
+    }
+    return acc;
+  }
+};
+
 // ---------- filter ----------
 struct Filter {
   std::optional<std::string> kind;
   std::optional<std::regex> re;
   std::optional<long long> since_ts;
+  std::optional<Where> where;
 };
 
 static Filter make_filter(const Args& a){
   Filter f; f.kind=a.kind; f.since_ts=a.since_ts;
+  if(a.where){
+    std::string err;
+    f.where = Where::compile(*a.where, err);
+    if(!f.where) die_usage("bad --where: "+err);
+  }
   if(a.grep_pat){
     std::regex::flag_type flags=std::regex::ECMAScript;
     std::string pat=*a.grep_pat;
@@ -217,18 +791,71 @@ static Filter make_filter(const Args& a){
   return f;
 }
 
-static bool match_line(const std::string& raw, const Filter& f){
-  json j=json::parse(raw,nullptr,false);
-  if(j.is_discarded()) return false;
-  if(f.kind && j.value("kind",std::string())!=*f.kind) return false;
-  if(f.since_ts && j.value("ts",0LL) < *f.since_ts) return false;
+// Cheapest tests first; members are read in place, the line is never parsed.
+static bool match_line(std::string_view raw, const Filter& f){
+  while(!raw.empty() && (raw.back()=='\n' || raw.back()=='\r' || raw.back()==' ')) raw.remove_suffix(1);
+  if(raw.size()<2 || raw.front()!='{' || raw.back()!='}') return false;   // not a whole object
+  if(f.since_ts && line_ts(raw) < *f.since_ts) return false;
+  if(f.kind && raw_string(raw, "kind")!=*f.kind) return false;
+  if(f.where && !f.where->eval(raw)) return false;
   if(f.re){
-    std::string t=j.value("text",std::string());
+    std::string t; json_unescape(raw_string(raw, "text"), t);
     if(!std::regex_search(t,*f.re)) return false;
   }
   return true;
 }
 
+// Ring events carry kind, ts and value next to the line: no JSON parse.
+static bool match_event(const RingEvent& ev, const Filter& f){
+  if(ev.no_value) return match_line(ev.line, f);
+  if(f.kind && ev.kind!=*f.kind) return false;
+  if(f.since_ts && ev.ts < *f.since_ts) return false;
+  if(f.where && !f.where->eval(ev.line)) return false;
+  if(f.re){
+    std::string_view t = ev.kind=="status" ? std::string_view() : ev.value;
+    if(!std::regex_search(t.begin(), t.end(), *f.re)) return false;
+  }
+  return true;
+}
+
+// ---------- projection ----------
+// --fields: the output line is assembled from byte ranges of the raw line
+// (raw_field), never re-serialized. String values keep their JSON escapes,
+// so they hold no raw tab or newline and are safe in TSV as they are.
+
+static void put_le32(std::string& o, uint32_t v){
+  char b[4] = {(char)(v&0xff), (char)(v>>8&0xff), (char)(v>>16&0xff), (char)(v>>24&0xff)};
+  o.append(b, 4);
+}
+
+static void project_line(std::string_view line, const std::vector<std::string>& fields, OutFmt fmt, std::string& o){
+  if(!line.empty() && line.back()=='\n') line.remove_suffix(1);
+  size_t rec = o.size();
+  if(fmt==OutFmt::Lp) put_le32(o, 0);                  // record length, patched below
+  if(fmt==OutFmt::Ndjson) o += '{';
+  bool first = true;
+  for(const auto& f : fields){
+    std::string_view v = raw_field(line, f);
+    if(fmt==OutFmt::Ndjson){
+      if(v.empty()) continue;                          // absent: left out
+      if(!first) o += ',';
+      o += '"'; o += f; o += "\":"; o.append(v);
+    }
+    else {
+      if(v.size()>=2 && v.front()=='"') v = v.substr(1, v.size()-2);
+      if(fmt==OutFmt::Tsv){ if(!first) o += '\t'; }
+      else put_le32(o, (uint32_t)v.size());
+      o.append(v);
+    }
+    first = false;
+  }
+  if(fmt==OutFmt::Ndjson) o += '}';
+  if(fmt==OutFmt::Lp){
+    uint32_t n = (uint32_t)(o.size() - rec - 4);
+    for(int i=0; i<4; i++) o[rec+i] = (char)(n>>(8*i) & 0xff);
+  }
+}
+
 // ---------- aliases ----------
 static std::string map_number_to_alias(const fs::path& aliases_path, const std::string& in){
   std::ifstream f(aliases_path);
@@ -259,100 +886,1507 @@ static std::string map_number_to_alias(const fs::path& aliases_path, const std::
 // ---------- file utils ----------
 static uint64_t inode_of(const fs::path& p){ struct stat st{}; return (::stat(p.c_str(),&st)==0)? st.st_ino : 0; }
 static uint64_t size_of (const fs::path& p){ struct stat st{}; return (::stat(p.c_str(),&st)==0)? st.st_size: 0; }
+static long long mtime_ms(const fs::path& p){
+  struct stat st{}; if(::stat(p.c_str(),&st)!=0) return 0;
+  return (long long)st.st_mtim.tv_sec*1000 + st.st_mtim.tv_nsec/1000000;
+}
+
+// ---------- segment reader ----------
+// wa-hub may compress rotated archives (zstd frames with a seek table, or
+// multi-member gzip). Both are decoded frame by frame into a small window, so
+// memory stays bounded no matter how large the archive is.
+enum class SegKind { Plain, Zstd, Gzip };
+
+static SegKind sniff_kind(const fs::path& p){
+  unsigned char m[4]={0,0,0,0};
+  FILE* f=fopen(p.c_str(),"rb"); if(!f) return SegKind::Plain;
+  size_t n=fread(m,1,4,f); fclose(f);
+  if(n>=4 && m[0]==0x28 && m[1]==0xB5 && m[2]==0x2F && m[3]==0xFD) return SegKind::Zstd;
+  if(n>=2 && m[0]==0x1F && m[1]==0x8B) return SegKind::Gzip;
+  return SegKind::Plain;
+}
+
+class SegmentReader {
+  FILE* f=nullptr;
+  SegKind kind=SegKind::Plain;
+  std::string in;          // raw bytes not yet consumed by the decoder
+  size_t in_pos=0;
+  std::string pending;     // decoded bytes not yet returned as lines
+  size_t pend_pos=0;
+  uint64_t consumed=0;     // decoded bytes returned so far (lines and their '\n')
+  bool eof=false, broken=false;
+#ifdef WA_HAVE_ZSTD
+  ZSTD_DStream* zs=nullptr;
+#endif
+#ifdef WA_HAVE_ZLIB
+  z_stream gz{}; bool gz_init=false;
+#endif
+
+  bool refill_raw(){
+    if(in_pos<in.size()) return true;
+    in.resize(1<<16); in_pos=0;
+    size_t n=fread(in.data(),1,in.size(),f);
+    in.resize(n);
+    return n>0;
+  }
+  // Decode at least one more chunk into `pending`; false at end of segment.
+  bool decode_more(){
+    if(eof||broken) return false;
+    if(kind==SegKind::Plain){
+      if(!refill_raw()){ eof=true; return false; }
+      pending.append(in, in_pos, std::string::npos); in_pos=in.size();
+      return true;
+    }
+#ifdef WA_HAVE_ZSTD
+    if(kind==SegKind::Zstd){
+      char out[1<<16];
+      while(true){
+        if(!refill_raw()){ eof=true; return false; }
+        ZSTD_inBuffer ib{in.data(), in.size(), in_pos};
+        ZSTD_outBuffer ob{out, sizeof(out), 0};
+        size_t r=ZSTD_decompressStream(zs,&ob,&ib);
+        in_pos=ib.pos;
+        if(ZSTD_isError(r)){ std::cerr<<"zstd: "<<ZSTD_getErrorName(r)<<"\n"; broken=true; return false; }
+        if(ob.pos){ pending.append(out, ob.pos); return true; }
+      }
+    }
+#endif
+#ifdef WA_HAVE_ZLIB
+    if(kind==SegKind::Gzip){
+      unsigned char out[1<<16];
+      while(true){
+        if(!refill_raw()){ eof=true; return false; }
+        gz.next_in=(Bytef*)in.data()+in_pos; gz.avail_in=(uInt)(in.size()-in_pos);
+        gz.next_out=out; gz.avail_out=sizeof(out);
+        int r=inflate(&gz, Z_NO_FLUSH);
+        in_pos=in.size()-gz.avail_in;
+        size_t got=sizeof(out)-gz.avail_out;
+        if(r==Z_STREAM_END) inflateReset(&gz);        // next gzip member = next frame
+        else if(r!=Z_OK && r!=Z_BUF_ERROR){ std::cerr<<"gzip: inflate error "<<r<<"\n"; broken=true; return false; }
+        if(got){ pending.append((char*)out, got); return true; }
+      }
+    }
+#endif
+    std::cerr<<"compressed segment not supported by this build\n";
+    broken=true; return false;
+  }
+
+public:
+  explicit SegmentReader(const fs::path& p){
+    kind=sniff_kind(p);
+    f=fopen(p.c_str(),"rb");
+#ifdef WA_HAVE_ZSTD
+    if(kind==SegKind::Zstd){ zs=ZSTD_createDStream(); ZSTD_initDStream(zs); }
+#endif
+#ifdef WA_HAVE_ZLIB
+    if(kind==SegKind::Gzip) gz_init = inflateInit2(&gz, 15+32)==Z_OK;
+#endif
+  }
+  ~SegmentReader(){
+    if(f) fclose(f);
+#ifdef WA_HAVE_ZSTD
+    if(zs) ZSTD_freeDStream(zs);
+#endif
+#ifdef WA_HAVE_ZLIB
+    if(gz_init) inflateEnd(&gz);
+#endif
+  }
+  SegmentReader(const SegmentReader&)=delete;
+  SegmentReader& operator=(const SegmentReader&)=delete;
+
+  bool good() const { return f!=nullptr; }
+  // Decoded offset of the next line; the same for an archive and its compressed form.
+  uint64_t tell() const { return consumed; }
+  // Skips to decoded offset `off` (a seek for plain files, decode-and-drop otherwise).
+  bool seek(uint64_t off){
+    if(!f) return false;
+    if(kind==SegKind::Plain){
+      if(fseeko(f,(off_t)off,SEEK_SET)!=0) return false;
+      pending.clear(); pend_pos=0; in.clear(); in_pos=0; consumed=off;
+      return true;
+    }
+    while(consumed<off){
+      size_t avail=pending.size()-pend_pos;
+      if(!avail){ pending.clear(); pend_pos=0; if(!decode_more()) return false; continue; }
+      size_t k=(size_t)std::min<uint64_t>(avail, off-consumed);
+      pend_pos+=k; consumed+=k;
+    }
+    return true;
+  }
+  // Next line without its trailing '\n'; a final unterminated line is returned as-is.
+  bool getline(std::string& line){
+    if(!f) return false;
+    for(;;){
+      size_t nl=pending.find('\n', pend_pos);
+      if(nl!=std::string::npos){
+        line.assign(pending, pend_pos, nl-pend_pos);
+        consumed+=nl+1-pend_pos;
+        pend_pos=nl+1;
+        if(pend_pos>(1<<16)){ pending.erase(0,pend_pos); pend_pos=0; }
+        return true;
+      }
+      if(!decode_more()){
+        if(pend_pos<pending.size()){
+          line.assign(pending, pend_pos, std::string::npos); consumed+=line.size();
+          pending.clear(); pend_pos=0; return true;
+        }
+        return false;
+      }
+    }
+  }
+};
+
+// Segments of `live` as listed by wa-hub's manifest
+// (<dir>/.manifest/<live name>.json): rotated archives (live + "." + stamp
+// [.zst|.gz]) oldest first, each with the ts range it holds.
+struct SegInfo { fs::path path; long long first_ts = 0, last_ts = 0; };   // 0 = range unknown
+
+static std::optional<std::vector<SegInfo>> manifest_segments(const fs::path& live){
+  fs::path dir = live.has_parent_path()? live.parent_path() : fs::path(".");
+  std::ifstream f(dir / ".manifest" / (live.filename().string() + ".json"));
+  if(!f.good()) return std::nullopt;
+  json j; try{ f>>j; }catch(...){ return std::nullopt; }
+  if(!j.is_object() || !j.contains("segments") || !j["segments"].is_array()) return std::nullopt;
+  std::vector<SegInfo> out;
+  for(const auto& e : j["segments"]){
+    if(!e.is_object() || !e.contains("path") || !e["path"].is_string()) continue;
+    try{ out.push_back({dir / e["path"].get<std::string>(), e.value("first_ts", 0LL), e.value("last_ts", 0LL)}); }
+    catch(...){ out.push_back({dir / e["path"].get<std::string>(), 0, 0}); }   // range unknown: read it
+  }
+  return out;
+}
+
+// Rotated archives of `live` oldest first. The manifest lists every segment
+// with its ts range, so planning needs no directory listing or file opens.
+// Without a manifest, fall back to listing: an archive's mtime is its last
+// append, so segments that ended before since_ts are skipped unopened.
+static std::optional<std::vector<fs::path>> manifest_since(const fs::path& live, long long since_ts){
+  auto m = manifest_segments(live);
+  if(!m) return std::nullopt;
+  std::vector<fs::path> out;
+  for(const auto& e : *m){
+    if(e.last_ts && e.last_ts < since_ts) continue;   // 0 = unknown range, must be read
+    out.push_back(e.path);
+  }
+  return out;
+}
+
+static std::vector<fs::path> archives_since(const fs::path& live, long long since_ts){
+  if(auto m = manifest_since(live, since_ts)) return *m;
+  std::vector<std::pair<long long,fs::path>> v;
+  std::string pre = live.filename().string() + ".";
+  fs::path dir = live.has_parent_path()? live.parent_path() : fs::path(".");
+  std::error_code ec;
+  for(auto it=fs::directory_iterator(dir, ec); !ec && it!=fs::directory_iterator(); it.increment(ec)){
+    std::string n = it->path().filename().string();
+    if(n.rfind(pre,0)!=0 || n.size()<4 || n.compare(n.size()-4,4,".tmp")==0) continue;
+    long long mt = mtime_ms(it->path());
+    if(mt < since_ts) continue;
+    v.emplace_back(mt, it->path());
+  }
+  std::sort(v.begin(), v.end());
+  std::vector<fs::path> out; for(auto& e : v) out.push_back(e.second);
+  return out;
+}
+
+// ---------- reverse reader ----------
+// zstd archives from wa-hub are independent frames, each holding whole lines,
+// followed by a seek table (skippable frame: per frame compressed and
+// decompressed size). With it any frame can be found and decoded alone.
+struct ZFrame { uint64_t off, csize, dsize, dstart; };   // file offset, sizes, decoded offset
+
+static uint32_t le32(const unsigned char* p){ return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24; }
+
+static bool zstd_seek_table(int fd, uint64_t size, std::vector<ZFrame>& frames){
+  unsigned char foot[9];
+  if(size < 17 || ::pread(fd, foot, 9, (off_t)(size-9))!=9 || le32(foot+5)!=0x8F92EAB1u) return false;
+  uint32_t n = le32(foot); bool sums = foot[4] & 0x80;
+  uint64_t esz = sums? 12 : 8, tbl = (uint64_t)n*esz;
+  if(tbl + 17 > size) return false;
+  std::vector<unsigned char> t(tbl);
+  if(tbl && ::pread(fd, t.data(), tbl, (off_t)(size-9-tbl))!=(ssize_t)tbl) return false;
+  uint64_t off = 0, dstart = 0;
+  frames.clear();
+  for(uint32_t i=0; i<n; i++){
+    uint64_t c = le32(&t[i*esz]), d = le32(&t[i*esz+4]);
+    frames.push_back({off, c, d, dstart}); off += c; dstart += d;
+  }
+  if(off + tbl + 17 != size){ frames.clear(); return false; }
+  return true;
+}
+
+static bool zstd_frame(int fd, const ZFrame& f, std::string& out){
+#ifdef WA_HAVE_ZSTD
+  std::string src(f.csize, '\0');
+  if(::pread(fd, src.data(), f.csize, (off_t)f.off)!=(ssize_t)f.csize) return false;
+  out.assign(f.dsize, '\0');
+  size_t got = ZSTD_decompress(out.data(), out.size(), src.data(), src.size());
+  if(ZSTD_isError(got)){ std::cerr<<"zstd: "<<ZSTD_getErrorName(got)<<"\n"; out.clear(); return false; }
+  out.resize(got);
+  return true;
+#else
+  (void)fd; (void)f; out.clear();
+  return false;
+#endif
+}
+
+// Lines of one segment from the end (or from decoded offset `end`)
+// backwards, for --last and --before-cursor pages. Plain files are read in
+// 64 KiB blocks towards the start; zstd archives are decoded one frame at a
+// time from the back. Anything else (gzip, zstd without a table) reports
+// !good() and is read forwards instead.
+class ReverseReader {
+  int fd = -1;
+  bool zstd = false;
+  std::string r;                 // bytes not returned yet; they end on a line boundary
+  uint64_t pos = 0;              // decoded offset of r[0]
+  uint64_t end_ = 0, ino = 0, at = 0;
+  std::vector<ZFrame> frames;
+  size_t left = 0;               // zstd: frames not decoded yet
+
+  // More bytes in front of r: the previous block, or the previous frame.
+  bool refill(){
+    if(!zstd){
+      if(pos==0) return false;
+      size_t n = (size_t)std::min<uint64_t>(pos, 1<<16);
+      std::string b(n, '\0');
+      if(::pread(fd, b.data(), n, (off_t)(pos-n))!=(ssize_t)n) return false;
+      pos -= n; r.insert(0, b);
+      return true;
+    }
+    if(left==0) return false;
+    const ZFrame& f = frames[--left];
+    if(!zstd_frame(fd, f, r)){ left = 0; return false; }
+    if(f.dstart + r.size() > end_) r.resize(end_ - f.dstart);
+    pos = f.dstart;
+    return true;
+  }
+
+public:
+  explicit ReverseReader(const fs::path& p, uint64_t end = UINT64_MAX){
+    fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC);
+    struct stat st{};
+    if(fd<0 || ::fstat(fd, &st)!=0){ if(fd>=0) ::close(fd); fd = -1; return; }
+    end_ = pos = std::min<uint64_t>((uint64_t)st.st_size, end); ino = st.st_ino;
+    switch(sniff_kind(p)){
+      case SegKind::Plain: break;
+#ifdef WA_HAVE_ZSTD
+      case SegKind::Zstd:
+        zstd = true;
+        if(zstd_seek_table(fd, (uint64_t)st.st_size, frames)){
+          end_ = end;
+          while(left < frames.size() && frames[left].dstart < end_) left++;
+          break;
+        }
+        [[fallthrough]];
+#endif
+      default: ::close(fd); fd = -1;
+    }
+  }
+  ~ReverseReader(){ if(fd>=0) ::close(fd); }
+  ReverseReader(const ReverseReader&) = delete;
+  ReverseReader& operator=(const ReverseReader&) = delete;
+
+  bool good() const { return fd>=0; }
+  uint64_t inode() const { return ino; }
+  // Decoded offset of the line prev() returned last.
+  uint64_t offset() const { return at; }
+  // Plain file: offset just past its last complete line (a line still being
+  // written is left out). Only valid before the first prev().
+  uint64_t end_of_lines(){
+    while(!zstd && fd>=0){
+      size_t nl = r.rfind('\n');
+      if(nl!=std::string::npos){ end_ = pos + nl + 1; r.resize(nl + 1); break; }
+      if(!refill()){ end_ = 0; r.clear(); break; }
+    }
+    return end_;
+  }
+
+  // Previous non-empty line, without its '\n'.
+  bool prev(std::string& line){
+    if(fd<0) return false;
+    for(;;){
+      size_t end = r.size();
+      if(end && r[end-1]=='\n') end--;
+      size_t nl = end? r.rfind('\n', end-1) : std::string::npos;
+      if(nl==std::string::npos && !zstd && pos>0 && refill()) continue;   // line starts further back
+      if(nl!=std::string::npos){ line.assign(r, nl+1, end-nl-1); r.resize(nl+1); at = pos + nl + 1; }
+      else if(end){ line.assign(r, 0, end); r.clear(); at = pos; }
+      else { r.clear(); if(!refill()) return false; continue; }
+      if(!line.empty()) return true;
+    }
+  }
+};
+
+// ---------- cursor file ----------
+// Where a consumer got to: the segment being read (live file or archive),
+// its inode, the byte offset past the last line taken and that line's ts.
+// Written to a temp file, fsynced and renamed over the old one, so a crash
+// leaves either cursor, never a torn one. Lines after it are delivered at
+// least once.
+struct Cursor {
+  std::string file;          // the followed file (live path)
+  std::string segment;       // file name of the segment the offset refers to
+  uint64_t inode = 0, offset = 0;
+  long long ts = 0;
+};
+
+static std::optional<Cursor> load_cursor(const fs::path& p){
+  std::ifstream f(p); if(!f.good()) return std::nullopt;
+  json j; try{ f>>j; }catch(...){ return std::nullopt; }
+  if(!j.is_object()) return std::nullopt;
+  Cursor c;
+  c.file = j.value("file", std::string()); c.segment = j.value("segment", std::string());
+  c.inode = j.value("inode", 0ULL); c.offset = j.value("offset", 0ULL); c.ts = j.value("ts", 0LL);
+  return c;
+}
+
+static bool save_cursor(const fs::path& p, const Cursor& c){
+  json j={{"file",c.file},{"segment",c.segment},{"inode",c.inode},{"offset",c.offset},{"ts",c.ts},{"updated",now_ms()}};
+  std::string s = j.dump() + "\n";
+  fs::path tmp = p; tmp += ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if(fd<0) return false;
+  bool ok = ::write(fd, s.data(), s.size())==(ssize_t)s.size() && ::fdatasync(fd)==0;
+  ::close(fd);
+  if(ok && ::rename(tmp.c_str(), p.c_str())==0) return true;
+  ::unlink(tmp.c_str());
+  return false;
+}
+
+// Start of the line containing offset `off`. Saved positions are always
+// just past a line; this only guards cursor files edited by hand.
+static uint64_t line_start(const fs::path& p, uint64_t off){
+  int fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC);
+  if(fd<0) return 0;
+  char buf[4096];
+  while(off>0){
+    size_t n = (size_t)std::min<uint64_t>(off, sizeof(buf));
+    if(::pread(fd, buf, n, (off_t)(off-n))!=(ssize_t)n){ off = 0; break; }
+    size_t i = n;
+    while(i>0 && buf[i-1]!='\n') i--;
+    if(i>0){ off = off-n+i; break; }
+    off -= n;
+  }
+  ::close(fd);
+  return off;
+}
+
+// ---------- pages ----------
+// Bounded reads for --until-ts, --limit and --before-cursor/--after-cursor.
+// The segments come from wa-hub's manifest with their ts ranges; inside one,
+// the first line at or after a ts is found by bisection (on byte offsets in
+// plain files, on frames via the seek table in zstd archives; gzip is
+// scanned). A page thus costs O(page + log n) reads, and stops at the first
+// line past its bound.
+
+static uint64_t fnv1a64(std::string_view s){
+  uint64_t h = 1469598103934665603ULL;
+  for(unsigned char c : s){ h ^= c; h *= 1099511628211ULL; }
+  return h;
+}
+
+// Segments of `live`, oldest first, the live file last.
+static std::vector<SegInfo> segment_catalog(const fs::path& live){
+  std::vector<SegInfo> v;
+  if(sniff_kind(live)!=SegKind::Plain) return {{live}};   // a compressed archive given directly
+  if(auto m = manifest_segments(live)) v = std::move(*m);
+  else for(auto& p : archives_since(live, 0)) v.push_back({p});
+  v.push_back({live});
+  return v;
+}
+
+// Plain file: the first whole line starting at or after `off`, and its ts.
+// False at EOF or when that line is not complete yet.
+static bool probe_line(int fd, uint64_t off, uint64_t& start, long long& ts){
+  char buf[4096];
+  std::string line;
+  start = off;
+  if(off > 0){
+    for(start = off-1;;){                    // skip to just past the next '\n'
+      ssize_t n = ::pread(fd, buf, sizeof(buf), (off_t)start);
+      if(n<=0) return false;
+      const char* nl = (const char*)std::memchr(buf, '\n', (size_t)n);
+      if(nl){ start += (uint64_t)(nl-buf) + 1; break; }
+      start += (uint64_t)n;
+    }
+  }
+  for(uint64_t at = start;;){
+    ssize_t n = ::pread(fd, buf, sizeof(buf), (off_t)at);
+    if(n<=0) return false;
+    const char* nl = (const char*)std::memchr(buf, '\n', (size_t)n);
+    line.append(buf, nl? (size_t)(nl-buf) : (size_t)n);
+    if(nl){ ts = line_ts(line); return true; }
+    at += (uint64_t)n;
+  }
+}
+
+// Decoded offset of the first line with ts >= t (the end of the segment if none).
+static uint64_t lower_bound_ts(const fs::path& p, long long t){
+  int fd = ::open(p.c_str(), O_RDONLY|O_CLOEXEC);
+  if(fd<0) return 0;
+  struct stat st{}; ::fstat(fd, &st);
+  uint64_t lo = 0, found = UINT64_MAX;
+  std::string line;
+  switch(sniff_kind(p)){
+    case SegKind::Plain: {
+      // lo: a line start with only older lines before it; the answer is in [lo, hi]
+      uint64_t hi = (uint64_t)st.st_size, s; long long ts;
+      while(hi - lo > (1<<16)){
+        if(!probe_line(fd, lo + (hi-lo)/2, s, ts) || s >= hi) break;
+        if(ts < t) lo = s; else hi = s;
+      }
+      break;
+    }
+    case SegKind::Zstd: {
+      std::vector<ZFrame> fr; std::string d;
+      if(!zstd_seek_table(fd, (uint64_t)st.st_size, fr)) break;
+      size_t a = 0, b = fr.size();           // the answer is in frame a or later
+      while(b - a > 1){
+        size_t m = a + (b-a)/2;
+        if(!zstd_frame(fd, fr[m], d)) break;
+        if(line_ts(std::string_view(d).substr(0, d.find('\n'))) < t) a = m; else b = m;
+      }
+      for(size_t i = a; i < fr.size() && found==UINT64_MAX && zstd_frame(fd, fr[i], d); i++){
+        for(size_t at = 0, nl; at < d.size(); at = nl+1){
+          nl = d.find('\n', at); if(nl==std::string::npos) nl = d.size();
+          if(nl > at && line_ts(std::string_view(d).substr(at, nl-at)) >= t){ found = fr[i].dstart + at; break; }
+        }
+        if(found==UINT64_MAX) lo = fr[i].dstart + d.size();
+      }
+      ::close(fd);
+      return found!=UINT64_MAX ? found : lo;
+    }
+    default: break;
+  }
+  ::close(fd);
+  // the last stretch (or a whole gzip archive) line by line
+  SegmentReader r(p);
+  if(!r.seek(lo)) return lo;
+  for(uint64_t o = r.tell(); r.getline(line); o = r.tell())
+    if(!line.empty() && line_ts(line) >= t) return o;
+  return r.tell();
+}
+
+// A page cursor names one line: segment, decoded offset, ts and a hash of
+// the line. The offset is tried first; once the segment has been rotated,
+// compressed or renamed, the line is found again by its ts. Handed out as
+// an opaque base64url token.
+struct PageMark { std::string segment; uint64_t offset = 0; long long ts = 0; uint64_t hash = 0; };
+
+static const char kB64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static std::string encode_mark(const PageMark& m){
+  char h[17]; std::snprintf(h, sizeof(h), "%016llx", (unsigned long long)m.hash);
+  std::string s = std::to_string(m.ts) + "." + h + "." + std::to_string(m.offset) + "." + m.segment, out;
+  uint32_t acc = 0; int bits = 0;
+  for(unsigned char c : s){
+    acc = acc<<8 | c; bits += 8;
+    while(bits >= 6){ bits -= 6; out += kB64[(acc>>bits) & 63]; }
+  }
+  if(bits) out += kB64[(acc<<(6-bits)) & 63];
+  return out;
+}
+
+static std::optional<PageMark> decode_mark(const std::string& tok){
+  std::string s; uint32_t acc = 0; int bits = 0;
+  for(char c : tok){
+    const char* p = c ? std::strchr(kB64, c) : nullptr;
+    if(!p) return std::nullopt;
+    acc = acc<<6 | (uint32_t)(p-kB64); bits += 6;
+    if(bits >= 8){ bits -= 8; s += (char)((acc>>bits) & 0xff); }
+  }
+  PageMark m; char* e = nullptr;
+  const char* q = s.c_str();
+  m.ts = std::strtoll(q, &e, 10);     if(*e!='.') return std::nullopt;
+  m.hash = std::strtoull(e+1, &e, 16); if(*e!='.') return std::nullopt;
+  m.offset = std::strtoull(e+1, &e, 10); if(*e!='.') return std::nullopt;
+  m.segment = e+1;
+  if(m.segment.empty() || m.segment.find('/')!=std::string::npos) return std::nullopt;
+  return m;
+}
+
+// Where the marked line is now: segment index, start of the line, start of the next.
+struct MarkPos { size_t seg; uint64_t start, next; };
+
+static std::optional<MarkPos> find_mark(const std::vector<SegInfo>& segs, const PageMark& m){
+  std::string line;
+  for(size_t i=0; i<segs.size(); i++){               // same segment, maybe compressed since
+    std::string n = segs[i].path.filename().string();
+    if(n!=m.segment && n!=m.segment+".zst" && n!=m.segment+".gz") continue;
+    SegmentReader r(segs[i].path);
+    if(r.seek(m.offset) && r.getline(line) && fnv1a64(line)==m.hash) return MarkPos{i, m.offset, r.tell()};
+  }
+  for(size_t i=0; i<segs.size(); i++){               // moved: look it up by ts
+    if((segs[i].first_ts && segs[i].first_ts > m.ts) || (segs[i].last_ts && segs[i].last_ts < m.ts)) continue;
+    SegmentReader r(segs[i].path);
+    if(!r.seek(lower_bound_ts(segs[i].path, m.ts))) continue;
+    for(uint64_t o = r.tell(); r.getline(line); o = r.tell()){
+      if(line.empty()) continue;
+      if(line_ts(line) > m.ts) break;
+      if(fnv1a64(line)==m.hash) return MarkPos{i, o, r.tell()};
+    }
+  }
+  return std::nullopt;
+}
+
+struct PageHit { std::string line; PageMark mark; };
+
+static PageHit hit_at(const SegInfo& s, uint64_t off, const std::string& line){
+  return {line, {s.path.filename().string(), off, line_ts(line), fnv1a64(line)}};
+}
+
+// One page: up to `limit` matching lines after a start point (forward, from
+// segment si at offset off) or before it (backward, ending at off), handed
+// to `out` oldest first. `more` says whether the scan saw another match.
+struct Page {
+  size_t count = 0; PageMark first, last; bool more = false;
+  void take(const PageHit& h){ if(!count++) first = h.mark; last = h.mark; }
+};
+using PageOut = std::function<void(const PageHit&)>;
+
+static Page page_forward(const std::vector<SegInfo>& segs, size_t si, uint64_t off, const Filter& f,
+                         std::optional<long long> until, size_t limit, const PageOut& out){
+  Page pg; std::string line;
+  for(size_t i = si; i < segs.size(); i++, off = 0){
+    if(until && segs[i].first_ts && segs[i].first_ts >= *until) break;
+    SegmentReader r(segs[i].path);
+    if(!r.good() || !r.seek(off)) continue;
+    for(uint64_t o = r.tell(); r.getline(line); o = r.tell()){
+      if(line.empty()) continue;
+      if(until && line_ts(line) >= *until) return pg;       // past the upper bound
+      if(!match_line(line, f)) continue;
+      if(pg.count==limit){ pg.more = true; return pg; }
+      PageHit h = hit_at(segs[i], o, line);
+      out(h); pg.take(h);
+    }
+  }
+  return pg;
+}
+
+static Page page_backward(const std::vector<SegInfo>& segs, size_t si, uint64_t end, const Filter& f,
+                          std::optional<long long> since, std::optional<long long> until, size_t limit,
+                          const PageOut& out){
+  Page pg; std::vector<PageHit> got; std::string line;
+  bool older = false;
+  auto keep=[&](const std::string& l){ return !(until && line_ts(l) >= *until) && match_line(l, f); };
+  for(size_t i = si+1; i-- > 0 && !older && !pg.more; end = UINT64_MAX){
+    if(since && segs[i].last_ts && segs[i].last_ts < *since) break;
+    ReverseReader rr(segs[i].path, end);
+    if(rr.good()){
+      if(end==UINT64_MAX) rr.end_of_lines();
+      while(rr.prev(line)){
+        if(since && line_ts(line) < *since){ older = true; break; }
+        if(!keep(line)) continue;
+        if(got.size()==limit){ pg.more = true; break; }
+        got.push_back(hit_at(segs[i], rr.offset(), line));
+      }
+      continue;
+    }
+    // no way to read it backwards: one forward pass keeping the newest matches
+    std::deque<PageHit> tail;
+    size_t room = limit - got.size();
+    SegmentReader r(segs[i].path);
+    for(uint64_t o = r.tell(); o < end && r.getline(line); o = r.tell()){
+      if(line.empty()) continue;
+      if(since && line_ts(line) < *since){ older = true; continue; }
+      if(!keep(line)) continue;
+      tail.push_back(hit_at(segs[i], o, line));
+      if(tail.size() > room){ tail.pop_front(); pg.more = true; }
+    }
+    got.insert(got.end(), tail.rbegin(), tail.rend());
+  }
+  for(auto it = got.rbegin(); it != got.rend(); ++it){ out(*it); pg.take(*it); }
+  return pg;
+}
+
+// Runs the page query for `target`; prints the lines through `emit` and
+// then one summary line on stderr with the cursors of both ends.
+static int page_main(const Args& a, const Filter& f, const fs::path& target,
+                     const std::function<void(std::string_view)>& emit){
+  if(!fs::exists(target)) die_usage("file not found: "+target.string());
+  auto segs = segment_catalog(target);
+  size_t limit = a.limit.value_or(SIZE_MAX);
+  std::optional<long long> since = a.since_ts, until = a.until_ts;
+
+  auto resolve=[&](const std::string& tok)->std::optional<MarkPos>{
+    auto m = decode_mark(tok);
+    if(!m) die_usage("bad cursor: "+tok);
+    auto mp = find_mark(segs, *m);
+    if(!mp){
+      // the line is gone (pruned): carry on from its ts
+      std::cerr<<"wa-sub: cursor line no longer found, paging by its ts\n";
+      if(!a.after_cursor.empty()) since = std::max(since.value_or(LLONG_MIN), m->ts + 1);
+      else until = std::min(until.value_or(LLONG_MAX), m->ts);
+    }
+    return mp;
+  };
+  // where lines at or after ts t begin: in the first segment that may hold
+  // them (forward), or in the newest that may hold older ones (backward)
+  auto locate=[&](long long t, size_t& si, uint64_t& off, bool newest){
+    si = 0; off = 0;
+    if(newest){
+      for(si = segs.size(); si-- > 0; ) if(!segs[si].first_ts || segs[si].first_ts < t) break;
+      if(si==SIZE_MAX){ si = 0; return; }                 // everything is newer
+    }
+    else while(si+1 < segs.size() && segs[si].last_ts && segs[si].last_ts < t) si++;
+    off = lower_bound_ts(segs[si].path, t);
+  };
+
+  Page pg; size_t si = 0; uint64_t off = 0;
+  PageOut out = [&](const PageHit& h){ emit(h.line); };
+  std::optional<MarkPos> mp;
+  if(!a.after_cursor.empty()) mp = resolve(a.after_cursor);
+  if(!a.before_cursor.empty()) mp = resolve(a.before_cursor);
+
+  if(!a.after_cursor.empty() || (a.before_cursor.empty() && (since || !a.limit))){
+    // forward: after the cursor, from --since-ts, or from the start of history
+    if(mp){ si = mp->seg; off = mp->next; }
+    else if(since) locate(*since, si, off, false);
+    if(a.debug) std::cerr<<"page: forward from "<<segs[si].path.string()<<" @"<<off<<"\n";
+    pg = page_forward(segs, si, off, f, until, limit, out);
+  }
+  else {
+    // backward: the newest lines before the cursor, --until-ts, or EOF
+    if(mp){ si = mp->seg; off = mp->start; }
+    else if(until) locate(*until, si, off, true);
+    else { si = segs.size()-1; off = UINT64_MAX; }
+    if(a.debug) std::cerr<<"page: backward from "<<segs[si].path.string()<<" @"<<off<<"\n";
+    pg = page_backward(segs, si, off, f, since, until, limit, out);
+  }
+
+  if(!a.aggregate.empty()) return 0;
+  ojson info = {{"count", pg.count}, {"more", pg.more}};
+  if(pg.count){ info["before"] = encode_mark(pg.first); info["after"] = encode_mark(pg.last); }
+  std::cerr<<ojson{{"page", info}}.dump()<<"\n";
+  return 0;
+}
+
+// ---------- aggregate ----------
+// --aggregate folds matching lines into counters instead of printing them,
+// reading kind, peer, status and ts straight from the raw line. Memory is
+// fixed whatever the input: kinds and statuses are tiny vocabularies (capped
+// anyway), peers go through a space-saving top-K sketch and a HyperLogLog,
+// and time buckets are printed and dropped as soon as a later one starts.
+struct AggSpec {
+  bool kind = false, status = false, distinct = false;
+  size_t top = 0;                  // peer[:K]: K busiest peers
+  long long bucket_ms = 0;         // bucket:SECS
+};
+
+static std::optional<AggSpec> parse_agg(const std::string& list){
+  AggSpec s; std::stringstream ss(list); std::string it;
+  while(std::getline(ss, it, ',')){
+    if(it=="kind") s.kind = true;
+    else if(it=="status") s.status = true;
+    else if(it=="distinct") s.distinct = true;
+    else if(it=="peer") s.top = 10;
+    else if(it.rfind("peer:",0)==0 && std::atoi(it.c_str()+5)>0) s.top = (size_t)std::atoi(it.c_str()+5);
+    else if(it.rfind("bucket:",0)==0 && std::atoi(it.c_str()+7)>0) s.bucket_ms = std::atoll(it.c_str()+7)*1000;
+    else return std::nullopt;
+  }
+  return s;
+}
+
+// Counts over a small vocabulary; anything past the cap goes to "(other)".
+struct Tally {
+  std::vector<std::pair<std::string,uint64_t>> v;
+  void add(std::string_view k){
+    for(auto& e : v) if(e.first==k){ e.second++; return; }
+    // 63 named keys; the last slot is "(other)", which takes everything after
+    if(v.size() < 63) v.emplace_back(std::string(k), 1);
+    else if(v.size() == 63) v.emplace_back("(other)", 1);
+    else v.back().second++;
+  }
+  // keys are raw JSON string contents, so they are written back verbatim
+  void dump(std::string& o) const {
+    o += '{';
+    for(size_t i=0; i<v.size(); i++){ if(i) o += ','; o += '"'; o += v[i].first; o += "\":"; o += std::to_string(v[i].second); }
+    o += '}';
+  }
+};
+
+// Space-saving (Metwally et al.): m counters; an unseen key evicts the
+// smallest and inherits its count as its error bound. Any key more frequent
+// than n/m is guaranteed to be kept, and with no more than m keys every
+// count is exact. m covers a few thousand peers; the counters are a min-heap
+// on count, so an eviction costs log m.
+class TopK {
+  static constexpr size_t kMinCounters = 4096;
+  using Map = std::unordered_map<std::string,size_t>;      // key -> heap index
+  struct C { Map::value_type* e; uint64_t count, err; };   // map nodes do not move
+  std::vector<C> c; Map at; size_t m;
+
+  void swap_at(size_t i, size_t j){ std::swap(c[i], c[j]); c[i].e->second = i; c[j].e->second = j; }
+  void sift_down(size_t i){
+    for(;;){
+      size_t lo = i, l = 2*i+1, r = l+1;
+      if(l<c.size() && c[l].count < c[lo].count) lo = l;
+      if(r<c.size() && c[r].count < c[lo].count) lo = r;
+      if(lo==i) return;
+      swap_at(i, lo); i = lo;
+    }
+  }
+  void sift_up(size_t i){
+    for(size_t p; i>0 && c[i].count < c[p=(i-1)/2].count; i = p) swap_at(i, p);
+  }
+public:
+  explicit TopK(size_t k) : m(std::max(kMinCounters, 4*k)) { at.reserve(m); }
+  void add(std::string_view k){
+    std::string key(k);
+    auto it = at.find(key);
+    if(it!=at.end()){ c[it->second].count++; sift_down(it->second); return; }
+    if(c.size() < m){
+      c.push_back({&*at.emplace(std::move(key), c.size()).first, 1, 0}); sift_up(c.size()-1); return;
+    }
+    uint64_t lo = c[0].count;
+    at.erase(c[0].e->first);
+    c[0] = {&*at.emplace(std::move(key), 0).first, lo+1, lo};
+    sift_down(0);
+  }
+  void dump(std::string& o, size_t k) const {
+    std::vector<const C*> v; for(auto& e : c) v.push_back(&e);
+    std::sort(v.begin(), v.end(), [](const C* a, const C* b){ return a->count!=b->count ? a->count>b->count : a->e->first<b->e->first; });
+    o += '[';
+    for(size_t i=0; i<v.size() && i<k; i++){
+      if(i) o += ',';
+      o += "{\"peer\":\""; o += v[i]->e->first; o += "\",\"count\":"; o += std::to_string(v[i]->count);
+      o += ",\"err\":"; o += std::to_string(v[i]->err); o += '}';
+    }
+    o += ']';
+  }
+  void clear(){ c.clear(); at.clear(); }
+};
+
+// HyperLogLog, 2^12 one-byte registers: about 1.6% standard error.
+class Hll {
+  static constexpr int P = 12;
+  std::array<uint8_t, 1<<P> r{};
+public:
+  void add(std::string_view k){
+    uint64_t h = fnv1a64(k);                       // spread the bits (splitmix64 finalizer)
+    h ^= h>>30; h *= 0xbf58476d1ce4e5b9ULL; h ^= h>>27; h *= 0x94d049bb133111ebULL; h ^= h>>31;
+    uint8_t rank = (uint8_t)(__builtin_clzll((h<<P) | (1ULL<<(P-1))) + 1);
+    uint8_t& x = r[h>>(64-P)];
+    if(rank > x) x = rank;
+  }
+  uint64_t estimate() const {
+    const double m = 1<<P, alpha = 0.7213/(1+1.079/m);
+    double sum = 0; int zeros = 0;
+    for(uint8_t x : r){ sum += std::ldexp(1.0, -x); zeros += x==0; }
+    double e = alpha*m*m/sum;
+    if(e <= 2.5*m && zeros) e = m*std::log(m/zeros);   // small range: linear counting
+    return (uint64_t)std::llround(e);
+  }
+  void clear(){ r.fill(0); }
+};
+
+class Aggregator {
+  AggSpec spec;
+  struct Counts { uint64_t events = 0; Tally kinds, statuses; };
+  Counts total, bucket;
+  TopK top; Hll hll;
+  long long first_ts = 0, last_ts = 0, bucket_start = 0;
+  std::function<void(std::string_view)> out;
+
+  void counts(std::string& o, const Counts& c) const {
+    o += "\"events\":"; o += std::to_string(c.events);
+    if(spec.kind){ o += ",\"kinds\":"; c.kinds.dump(o); }
+    if(spec.status){ o += ",\"statuses\":"; c.statuses.dump(o); }
+  }
+  void close_bucket(){
+    if(!bucket.events) return;
+    std::string o = "{\"bucket\":" + std::to_string(bucket_start) + ",\"secs\":" + std::to_string(spec.bucket_ms/1000) + ",";
+    counts(o, bucket); o += '}';
+    out(o); bucket = Counts{};
+  }
+
+public:
+  Aggregator(const AggSpec& s, std::function<void(std::string_view)> o) : spec(s), top(s.top), out(std::move(o)) {}
+
+  void add(std::string_view line){
+    long long ts = line_ts(line);
+    std::string_view kind = raw_string(line, "kind");
+    if(spec.bucket_ms){
+      long long b = ts - ((ts % spec.bucket_ms) + spec.bucket_ms) % spec.bucket_ms;
+      if(b > bucket_start) { close_bucket(); bucket_start = b; }
+    }
+    auto count=[&](Counts& c){
+      c.events++;
+      if(spec.kind) c.kinds.add(kind);
+      if(spec.status && kind=="status") c.statuses.add(raw_string(line, "status"));
+    };
+    count(total);
+    if(spec.bucket_ms) count(bucket);
+    if(spec.top || spec.distinct){
+      std::string_view peer = raw_string(line, "peer");
+      if(spec.top) top.add(peer);
+      if(spec.distinct) hll.add(peer);
+    }
+    if(!first_ts) first_ts = ts;
+    last_ts = ts;
+  }
+
+  // Prints the summary and starts over; the final one closes the open bucket first.
+  void report(bool final = true){
+    if(final) close_bucket();
+    std::string o = "{\"from_ts\":" + std::to_string(first_ts) + ",\"to_ts\":" + std::to_string(last_ts) + ",";
+    counts(o, total);
+    if(spec.top){ o += ",\"peers\":"; top.dump(o, spec.top); }
+    if(spec.distinct){ o += ",\"distinct_peers\":"; o += std::to_string(hll.estimate()); }
+    o += '}';
+    out(o);
+    total = Counts{}; top.clear(); hll.clear(); first_ts = last_ts = 0;
+  }
+};
+
+// ---------- live tail ----------
+// New lines come from the file, or from wa-hub's shared-memory ring when
+// one is available. Hand-off: attach to the ring first, then read the file
+// to EOF; ring events whose line ends at or before that point (same inode)
+// were read already. Each ring event says where wa-hub wrote its line, so
+// the position stays exact on the ring too.
+// Falling a whole ring behind (or a hub restart) goes back to the file at
+// the last event taken from the ring, then hands off again.
+// When the live file was rotated under us, the archives after the last
+// position are read before the new live file (catch_up), so no segment is
+// skipped however far behind the reader is.
+struct TailPos {
+  std::string segment;                 // live file name or archive name
+  uint64_t inode = 0, offset = 0;      // offset just past the last line handed out
+  long long ts = 0;                    // ts of that line
+};
+
+class Follower {
+  struct Pending { fs::path seg; uint64_t from; };
+  fs::path target;
+  std::string live_name;
+  std::string ring_path, key;          // key: only this peer's ring events (per-peer file)
+  bool debug;
+  RingReader ring;
+  bool on_ring = false;
+  long long next_attach = 0;
+  LogPos read_to;                        // live file end when the ring took over
+  std::deque<Pending> backlog;           // archives to read before the live file
+  long long min_ts = 0;                  // position only known by time: skip older lines
+  TailPos pos;
+
+  // Reads the file from `offset` to EOF; returns true if anything was read.
+  // Clears `more` when fn says stop.
+  template<class F> bool tail_file(F& fn, bool& more){
+    if(!fs::exists(target)) return false;
+    uint64_t ino = inode_of(target);
+    uint64_t sz  = size_of(target);
+
+    if(ino != cur_inode){
+      if(cur_inode){ catch_up(cur_inode, live_name, offset, pos.ts); return true; }
+      cur_inode = ino; offset = 0;
+    }
+    if(sz < offset) offset = 0;
+    if(sz <= offset) return false;
+
+    std::ifstream f(target);
+    f.seekg((std::streamoff)offset, std::ios::beg);
+    std::string line;
+    while(std::getline(f,line)){
+      if(f.eof()) break;                  // partly written last line: take it once complete
+      offset = (uint64_t)f.tellg();
+      long long ts = line_ts(line);
+      if(ts < min_ts) continue;
+      pos.segment = live_name; pos.inode = cur_inode; pos.offset = offset; pos.ts = ts;
+      if(!fn(std::string_view(line), (const RingEvent*)nullptr)){ more = false; return true; }
+    }
+    min_ts = 0;
+    return true;
+  }
+
+  // Reads the oldest queued archive completely.
+  template<class F> void read_backlog(F& fn, bool& more){
+    Pending p = backlog.front(); backlog.pop_front();
+    if(!fs::exists(p.seg)){                          // compressed since it was planned
+      for(const char* ext : {".zst", ".gz"}) if(fs::exists(fs::path(p.seg.string()+ext))){ p.seg += ext; break; }
+    }
+    if(debug) std::cerr<<"archive: \""<<p.seg.string()<<"\" from "<<p.from<<"\n";
+    SegmentReader r(p.seg); std::string line;
+    if(!r.good() || (p.from && !r.seek(p.from))) return;
+    std::string name = p.seg.filename().string();
+    uint64_t ino = inode_of(p.seg);
+    while(r.getline(line)){
+      long long ts = line_ts(line);
+      if(ts < min_ts) continue;
+      pos.segment = name; pos.inode = ino; pos.offset = r.tell(); pos.ts = ts;
+      if(!fn(std::string_view(line), (const RingEvent*)nullptr)){ more = false; return; }
+    }
+  }
+
+  template<class F> void hand_off(F& fn, bool& more){
+    if(!ring.attach(ring_path)){ next_attach = now_ms() + 1000; return; }
+    tail_file(fn, more);
+    if(!backlog.empty()){ ring.detach(); return; }   // rotated meanwhile: archives first
+    on_ring = true; read_to = {cur_inode, offset};
+    if(debug) std::cerr<<"ring: following from file offset "<<offset<<"\n";
+  }
+
+  void fall_back(const char* why){
+    if(debug) std::cerr<<"ring: "<<why<<", back to the file\n";
+    ring.detach(); on_ring = false;
+    uint64_t ino = inode_of(target);
+    if(ino && ino==pos.inode){ offset = pos.offset; cur_inode = ino; }
+    else catch_up(pos.inode, pos.segment, pos.offset, pos.ts);
+  }
+
+public:
+  uint64_t cur_inode = 0, offset = 0;   // live file position (when not on the ring)
+
+  Follower(fs::path t, std::string rp, std::string k, bool dbg)
+    :target(std::move(t)), live_name(target.filename().string()), ring_path(std::move(rp)), key(std::move(k)), debug(dbg)
+  { cur_inode = inode_of(target); pos.segment = live_name; pos.inode = cur_inode; }
+  Follower(const Follower&) = delete;
+  Follower& operator=(const Follower&) = delete;
+
+  // Position just past the last line handed out. Taken from the ring it is
+  // where wa-hub wrote that line; wa-hub writes and publishes each event
+  // under one lock, so every line before it has been handed out too.
+  const TailPos& position() const { return pos; }
+
+  // Continue from (inode or segment name, offset) of a rotated-away file:
+  // that archive from `off`, every later one, then the live file from 0.
+  // If no archive matches (compressed since, or gone), every archive
+  // reaching `ts` is read instead and lines older than `ts` are skipped.
+  void catch_up(uint64_t inode, const std::string& name, uint64_t off, long long ts){
+    std::vector<fs::path> segs;
+    size_t k = 0;
+    for(int attempt=0; attempt<2; attempt++){
+      if(attempt) usleep(50*1000);                 // wa-hub lists an archive just after the rename
+      segs = archives_since(target, ts);
+      k = segs.size();
+      for(size_t i=0; i<segs.size() && k==segs.size(); i++){
+        std::string n = segs[i].filename().string();
+        if((inode && inode_of(segs[i])==inode) || n==name || n==name+".zst" || n==name+".gz") k = i;
+      }
+      if(k<segs.size() || !inode) break;
+    }
+    backlog.clear();
+    for(size_t i = k<segs.size()? k : 0; i<segs.size(); i++) backlog.push_back({segs[i], i==k? off : 0});
+    min_ts = k<segs.size()? 0 : ts;
+    cur_inode = inode_of(target); offset = 0;
+    if(debug) std::cerr<<"catch-up: "<<backlog.size()<<" archive(s)"<<(k<segs.size()? "" : " by ts")<<"\n";
+  }
+
+  // Passes new lines (no trailing '\n') to fn(line, ev), ev being the ring
+  // record or nullptr for a file line; waits up to ~200 ms when there are
+  // none. fn returns false to stop, and poll then returns false.
+  template<class F> bool poll(F&& fn){
+    bool more = true;
+    if(!backlog.empty()){ read_backlog(fn, more); return more; }
+    if(on_ring){
+      for(int n=0; n<4096; n++){             // return now and then so callers see their deadlines
+        RingEvent ev;
+        auto r = ring.next(ev);
+        if(r==RingReader::Event){
+          if(!key.empty() && ev.peer!=key) continue;
+          const LogPos& at = key.empty()? ev.global_at : ev.peer_at;
+          if(at.ino==read_to.ino && at.end<=read_to.end) continue;   // read from the file already
+          std::string_view body = ev.line;
+          if(!body.empty() && body.back()=='\n') body.remove_suffix(1);
+          pos.segment = live_name; pos.inode = at.ino; pos.offset = at.end; pos.ts = ev.ts;
+          if(!fn(body, (const RingEvent*)&ev)) return false;
+          continue;
+        }
+        if(r==RingReader::Lapped){ fall_back("lapped"); return true; }
+        if(ring.stale()){ fall_back("replaced"); return true; }
+        if(n==0) ring.wait(200);
+        return true;
+      }
+      return true;
+    }
+
+    if(!ring_path.empty() && now_ms()>=next_attach){
+      hand_off(fn, more);
+      if(!more) return false;
+      if(on_ring || !backlog.empty()) return true;
+    }
+    bool got = tail_file(fn, more);
+    if(!more) return false;
+    if(!got) usleep(200*1000);
+    return true;
+  }
+};
+
+// ---------- serve ----------
+// `wa-sub --serve` follows the global log once (through the ring when there
+// is one) and fans it out over a Unix socket, so any number of followers
+// cost one tail. The server and its protocol are wa-hub's sub_socket
+// (SubServer, wa-pubsub.hpp), plus three request keys:
+//   {"where":EXPR, "since_ts":MS, "run":R}
+// and "run":R,"from_ts":T in the hello. since_ts starts at the first held
+// event at or after MS; run + from_seq resume a cursor from this server
+// run. The window holds every event with ts >= from_ts, so earlier history
+// has to come from the files.
+static SubServer::Hooks serve_hooks(long long run_id, std::shared_ptr<long long> from_ts){
+  SubServer::Hooks h;
+  h.request = [run_id](const json& j, SubExtra& x) -> std::string {
+    if(j.contains("where") && j["where"].is_string()){
+      std::string err;
+      auto w = Where::compile(j["where"].get<std::string>(), err);
+      if(!w) return "bad where: " + err;
+      auto wp = std::make_shared<const Where>(std::move(*w));
+      x.accept = [wp](const SubEvent& e){ return wp->eval(e.line); };
+    }
+    if(j.contains("since_ts") && j["since_ts"].is_number_integer()){
+      long long since = j["since_ts"].get<long long>();
+      x.start_ts = since;
+      auto more = std::move(x.accept);
+      x.accept = [since, more](const SubEvent& e){ return e.ts >= since && (!more || more(e)); };
+    }
+    bool resume = j.contains("from_seq") && j["from_seq"].is_number_unsigned();
+    if(resume && j.value("run", 0LL)!=run_id) return "cursor is from another server run";
+    return {};
+  };
+  // both run under the window lock
+  h.hello = [run_id, from_ts](ojson& hello){ hello["run"] = run_id; hello["from_ts"] = *from_ts; };
+  h.evicted = [from_ts](const SubEvent& e){ *from_ts = std::max(*from_ts, e.ts + 1); };
+  return h;
+}
+
+// Ring positions name the files wa-hub writes. With spool_dir those are the
+// spool files, and the copies under global_dir/per_dir lag them by up to
+// ship_interval_ms (longer while the NAS is failing): an event published
+// before the reader attached but not shipped yet would be in neither the
+// copy nor the ring. So the ring is only used for files wa-hub writes itself.
+static bool ring_matches(const HubCfg& c, const fs::path& target){
+  if(c.spool_dir.empty()) return true;
+  std::error_code ec;
+  auto rel = fs::weakly_canonical(target, ec).lexically_relative(fs::weakly_canonical(c.spool_dir, ec));
+  return !rel.empty() && *rel.begin()!="..";
+}
+
+static volatile std::sig_atomic_t g_stop = 0;
+
+static int serve_main(const Args& a, const HubCfg& c){
+  fs::path sock = a.socket.empty()? c.serve_socket : a.socket;
+  fs::path global = c.global_dir / c.global_name;
+  std::string ring_path = a.no_ring || !ring_matches(c, global)? std::string()
+                        : !a.ring.empty()? a.ring.string() : c.shm_ring.string();
+  long long run_id = now_ms();
+  SubServer srv(sock, c.serve_window_events, c.serve_client_buffer, "serve socket",
+                serve_hooks(run_id, std::make_shared<long long>(run_id)));
+  if(!srv.good()) return 2;
+  std::signal(SIGINT,  [](int){ g_stop = 1; });
+  std::signal(SIGTERM, [](int){ g_stop = 1; });
+  if(a.debug) std::cerr<<"serving \""<<global.string()<<"\" on \""<<sock.string()<<"\"\n";
+
+  Follower fol(global, ring_path, "", a.debug);
+  fol.offset = size_of(global);
+  while(!g_stop){
+    fol.poll([&](std::string_view line, const RingEvent* ev){
+      if(ev && !ev->no_value){
+        srv.publish(ev->ts, ev->kind, ev->peer, ev->kind=="status"? std::string_view() : ev->value, line);
+        return true;
+      }
+      json j = json::parse(line.begin(), line.end(), nullptr, false);
+      if(j.is_discarded() || !j.is_object()) return true;
+      srv.publish(j.value("ts",0LL), j.value("kind",std::string()), j.value("peer",std::string()),
+                  j.value("text",std::string()), line);
+      return true;
+    });
+  }
+  return 0;
+}
+
+// ---------- output ----------
+// Matched lines are gathered in one buffer and written with write(2) as the
+// flush policy says: after every event, after every burst read from the
+// log (and when full), or at most every N ms. When the reader falls behind
+// and the buffer is full, --on-slow decides: block (wait for it), drop (count
+// and skip events until it catches up) or spill (queue events in a file and
+// feed them in order once the pipe drains), so a stuck reader cannot stall
+// the tail. drop/spill make stdout non-blocking, but only if it is a pipe or
+// socket (a terminal is shared with the shell).
+class Output {
+public:
+  enum class Slow { Block, Drop, Spill };
+  static constexpr long long kEvent = -1, kBatch = 0;   // flush policies; > 0 = ms
+
+private:
+  int fd; size_t cap; Slow slow; long long flush_ms;
+  std::string buf; size_t off = 0;
+  long long pending_since = 0;
+  uint64_t dropped = 0;
+  bool stalled = false;                 // the last write attempt left bytes behind
+  fs::path spill_path; int spill_fd = -1; uint64_t spill_rd = 0, spill_wr = 0;
+  int saved_flags = -1;
+
+  size_t pending() const { return buf.size() - off; }
+
+  // Writes what the fd takes; true once the buffer is empty. Refills from
+  // the spill file as the buffer drains.
+  bool drain(bool wait){
+    for(;;){
+      while(off < buf.size()){
+        ssize_t n = ::write(fd, buf.data()+off, buf.size()-off);
+        if(n > 0){ off += (size_t)n; continue; }
+        if(n < 0 && errno==EINTR) continue;
+        if(n < 0 && errno==EAGAIN && wait){ pollfd pf{fd, POLLOUT, 0}; ::poll(&pf, 1, 1000); continue; }
+        if(n < 0 && errno!=EAGAIN){ std::perror("wa-sub: stdout"); std::exit(errno==EPIPE ? 0 : 2); }
+        buf.erase(0, off); off = 0; stalled = true;
+        return false;
+      }
+      buf.clear(); off = 0; stalled = false;
+      if(dropped){ std::cerr<<"wa-sub: dropped "<<dropped<<" events (reader too slow)\n"; dropped = 0; }
+      if(spill_rd == spill_wr) return true;
+      size_t n = (size_t)std::min<uint64_t>(spill_wr - spill_rd, std::max<size_t>(cap, 1<<16));
+      buf.resize(n);
+      ssize_t got = ::pread(spill_fd, buf.data(), n, (off_t)spill_rd);
+      if(got <= 0){ std::perror("wa-sub: spill"); buf.clear(); spill_rd = spill_wr; continue; }
+      buf.resize((size_t)got); spill_rd += (uint64_t)got;
+      if(spill_rd == spill_wr && ::ftruncate(spill_fd, 0)==0) spill_rd = spill_wr = 0;
+    }
+  }
+
+public:
+  Output(int fd_, size_t cap_, Slow slow_, long long flush_ms_, fs::path spill)
+    : fd(fd_), cap(std::max<size_t>(cap_, 4096)), slow(slow_), flush_ms(flush_ms_), spill_path(std::move(spill)){
+    buf.reserve(cap);
+    struct stat st{};
+    if(slow!=Slow::Block && ::fstat(fd, &st)==0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))){
+      saved_flags = ::fcntl(fd, F_GETFL);
+      if(saved_flags>=0) ::fcntl(fd, F_SETFL, saved_flags | O_NONBLOCK);
+    }
+  }
+  ~Output(){ close(); }
+  Output(const Output&) = delete;
+  Output& operator=(const Output&) = delete;
+
+  // One event (or other record); `nl` appends the newline it lacks.
+  void put(std::string_view data, bool nl = false){
+    size_t need = data.size() + (nl ? 1 : 0);
+    bool spilling = spill_wr > spill_rd;
+    if(!spilling && pending() + need > cap && !drain(slow==Slow::Block)){
+      if(slow==Slow::Drop){ dropped++; return; }
+      spilling = slow==Slow::Spill;
+    }
+    if(spilling){
+      if(spill_fd < 0){
+        spill_fd = ::open(spill_path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+        if(spill_fd < 0){ std::perror(("wa-sub: spill " + spill_path.string()).c_str()); std::exit(2); }
+        ::unlink(spill_path.c_str());          // lives as long as the fd
+      }
+      std::string rec(data); if(nl) rec += '\n';
+      if(::pwrite(spill_fd, rec.data(), rec.size(), (off_t)spill_wr)!=(ssize_t)rec.size()){
+        std::perror("wa-sub: spill"); std::exit(2);
+      }
+      spill_wr += rec.size();
+      return;
+    }
+    if(!pending()) pending_since = now_ms();
+    buf.append(data); if(nl) buf += '\n';
+    if(flush_ms!=kBatch) tick();
+  }
+  // End of a burst of events.
+  void batch(){ if(flush_ms==kBatch && pending()) drain(slow==Slow::Block); else tick(); }
+  // Flushes what the policy says is due, retries a stalled reader and feeds
+  // spilled events; call now and then.
+  void tick(){
+    bool due = stalled || spill_wr > spill_rd ||
+               (pending() && (flush_ms==kEvent || (flush_ms > 0 && now_ms() - pending_since >= flush_ms)));
+    if(due) drain(slow==Slow::Block);
+  }
+  // Everything out, waiting for the reader.
+  void sync(){ drain(true); }
+  void close(){
+    drain(true);
+    if(spill_fd>=0){ ::close(spill_fd); spill_fd = -1; }
+    if(saved_flags>=0){ ::fcntl(fd, F_SETFL, saved_flags); saved_flags = -1; }
+  }
+};
+
+// ---------- thin client ----------
+static int connect_unix(const fs::path& p){
+  sockaddr_un a{}; a.sun_family = AF_UNIX;
+  if(p.string().size() >= sizeof(a.sun_path)) return -1;
+  std::strncpy(a.sun_path, p.c_str(), sizeof(a.sun_path)-1);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if(fd<0) return -1;
+  if(::connect(fd, (sockaddr*)&a, sizeof(a))!=0){ ::close(fd); return -1; }
+  return fd;
+}
 
 int main(int argc,char**argv){
   Args a=parse(argc,argv);
+  HubCfg c=load_hub_cfg(a.cfg);
+  if(a.serve) return serve_main(a, c);
   Filter filt=make_filter(a);
 
   fs::path target;
+  std::string key;                     // ring events are for this peer only (--peer)
   if(!a.file.empty()) {
     target=a.file;
   } else {
-    HubCfg c=load_hub_cfg(a.cfg);
-    std::string key = map_number_to_alias(c.aliases_path, a.peer);
-    target = (c.per_dir / (c.per_prefix + key + c.per_suffix));
+    key = map_number_to_alias(c.aliases_path, a.peer);
+    target = (c.per_dir / peer_shard(key, c.per_fanout) / (c.per_prefix + key + c.per_suffix));
   }
 
-  if(a.debug) std::cerr<<"tailing: \""<<target.string()<<"\"\n";
+  std::error_code ec;
+  bool hub_stream = a.file.empty() || fs::equivalent(target, c.global_dir / c.global_name, ec);
+  std::string ring_path;
+  if(!a.no_ring && ring_matches(c, target)){
+    if(!a.ring.empty()) ring_path = a.ring.string();
+    else if(!c.shm_ring.empty() && (hub_stream || (!c.spool_dir.empty() && fs::equivalent(target, c.spool_dir / "global" / c.global_name, ec))))
+      ring_path = c.shm_ring.string();
+  }
+  else if(!a.ring.empty() && !a.no_ring) std::cerr<<"--ring ignored: its positions are in spool_dir, not \""<<target.string()<<"\"\n";
 
-  // wait for file in live modes
-  while(!fs::exists(target)){
-    if(!(a.follow||a.once||a.window_sec)) die_usage("file not found: "+target.string());
-    usleep(200*1000);
+  if(a.debug){
+    std::cerr<<"tailing: \""<<target.string()<<"\"\n";
+    if(!ring_path.empty()) std::cerr<<"ring: \""<<ring_path<<"\"\n";
   }
 
-  uint64_t cur_inode = inode_of(target);
-  uint64_t offset = 0;
+  fs::path spill = a.spill;
+  if(spill.empty()){ std::error_code tec; spill = fs::temp_directory_path(tec) / ("wa-sub-spill-" + std::to_string(::getpid())); }
+  Output out(STDOUT_FILENO, a.out_buffer,
+             a.on_slow=="drop" ? Output::Slow::Drop : a.on_slow=="spill" ? Output::Slow::Spill : Output::Slow::Block,
+             a.flush.value_or((a.follow || a.once) ? Output::kEvent : Output::kBatch), spill);
 
-  // starting position
-  if(a.since_ts) offset = 0;           // need to scan history
-  else           offset = size_of(target); // start at EOF by default
+  std::optional<Aggregator> agg;
+  if(!a.aggregate.empty()){
+    auto spec = parse_agg(a.aggregate);
+    if(!spec) die_usage("bad --aggregate list: "+a.aggregate);
+    agg.emplace(*spec, [&out](std::string_view o){ out.put(o, true); out.batch(); });
+  }
 
   std::vector<std::string> outbuf;
-  auto emit = [&](const std::string& line){
-    if(a.json_array) outbuf.push_back(line);
-    else {
-      std::cout<<line;
-      if(line.empty() || line.back()!='\n') std::cout<<"\n";
-      std::cout.flush();
-    }
+  std::string proj;
+  auto emit = [&](std::string_view line){
+    if(agg){ agg->add(line); return; }
+    if(a.format!=OutFmt::Raw){ proj.clear(); project_line(line, a.fields, a.format, proj); line = proj; }
+    if(a.json_array) outbuf.emplace_back(line);
+    else out.put(line, a.format!=OutFmt::Lp && (line.empty() || line.back()!='\n'));
   };
   auto flush_array=[&](){
-    if(a.json_array){
-      std::cout<<"[";
+    if(agg) agg->report();
+    else if(a.json_array){
+      std::string o = "[";
       for(size_t i=0;i<outbuf.size();++i){
-        if(i) std::cout<<",";
-        std::cout<<outbuf[i];
+        if(i) o += ",";
+        o += outbuf[i];
       }
-      std::cout<<"]\n";
-      std::cout.flush();
+      o += "]\n";
+      out.put(o);
     }
+    out.close();
   };
 
   long long t0 = now_ms();
   long long deadline_once = a.once ? (t0 + (*a.timeout_sec*1000LL)) : LLONG_MAX;
   long long deadline_win  = a.window_sec ? (t0 + (*a.window_sec*1000LL)) : LLONG_MAX;
+  long long next_report   = t0 + a.every_sec*1000LL;
+  auto report_due=[&](){
+    if(!agg || !a.follow || now_ms() < next_report) return;
+    agg->report(false); next_report += a.every_sec*1000LL;
+  };
+  if(!a.cursor_file.empty() || (agg && a.follow)){
+    std::signal(SIGINT,  [](int){ g_stop = 1; });
+    std::signal(SIGTERM, [](int){ g_stop = 1; });
+  }
 
-  // historical scan if since-ts
-  if(a.since_ts){
-    std::ifstream f(target);
-    f.seekg(0, std::ios::beg);
-    std::string line;
-    while(std::getline(f,line)){
+  // A running `wa-sub --serve` already follows the hub's logs: ask it.
+  // Returns the exit code, or -1 to carry on locally: no server, history
+  // older than its window, or it went away (then resume at the ts of the
+  // last line shown, which may repeat lines sharing that millisecond).
+  auto via_server=[&]()->int{
+    int fd = connect_unix(a.socket.empty()? c.serve_socket : a.socket);
+    if(fd<0) return -1;
+    if(a.debug) std::cerr<<"via server\n";
+    json req = json::object();
+    if(!key.empty()) req["peers"] = json::array({key});
+    if(a.kind) req["kinds"] = json::array({*a.kind});
+    if(a.grep_pat) req["grep"] = *a.grep_pat;
+    if(a.where) req["where"] = *a.where;
+    if(a.since_ts) req["since_ts"] = *a.since_ts;
+    std::string r = req.dump() + "\n";
+    if(::send(fd, r.data(), r.size(), MSG_NOSIGNAL)!=(ssize_t)r.size()){ ::close(fd); return -1; }
+
+    std::optional<long long> resume;
+    std::string in; size_t pos = 0;
+    char buf[1<<16];
+    for(;;){
+      long long now = now_ms();
+      if(a.once && now>=deadline_once){ ::close(fd); flush_array(); return 1; }
+      if(a.window_sec && now>=deadline_win){ ::close(fd); flush_array(); return 0; }
+      if(g_stop){ ::close(fd); flush_array(); return 0; }
+      report_due();
+      out.tick();
+      pollfd pf{fd, POLLIN, 0};
+      if(::poll(&pf, 1, (int)std::min<long long>(200, std::min(deadline_once, deadline_win) - now)) <= 0) continue;
+      ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+      if(n<0 && errno==EINTR) continue;
+      if(n<=0) break;
+      in.append(buf, (size_t)n);
+      for(size_t nl; (nl = in.find('\n', pos))!=std::string::npos; pos = nl+1){
+        std::string_view line(in.data()+pos, nl-pos);
+        if(line.rfind("{\"op\":",0)==0){
+          json j = json::parse(line.begin(), line.end(), nullptr, false);
+          std::string op = j.is_object()? j.value("op",std::string()) : std::string();
+          if(op=="hello" && a.since_ts && *a.since_ts < j.value("from_ts",0LL)){ ::close(fd); return -1; }
+          if(op=="dropped") std::cerr<<"wa-sub: server dropped "<<j.value("count",0ULL)<<" events (client too slow)\n";
+          if(op=="error"){ std::cerr<<"wa-sub: server: "<<j.value("message",std::string())<<"\n"; ::close(fd); return -1; }
+          continue;
+        }
+        emit(line);
+        if(a.once){ ::close(fd); flush_array(); return 0; }
+        resume = line_ts(line);
+      }
+      in.erase(0, pos); pos = 0;
+      out.batch();
+    }
+    ::close(fd);
+    if(a.debug) std::cerr<<"server went away\n";
+    if(!resume) resume = a.since_ts.value_or(t0);
+    a.since_ts = filt.since_ts = *resume;
+    return -1;
+  };
+  if(a.page){
+    int rc = page_main(a, filt, target, emit);
+    flush_array();
+    return rc;
+  }
+
+  if(!a.no_serve && a.cursor_file.empty() && !a.last && hub_stream && (a.follow||a.once||a.window_sec)){
+    int rc = via_server();
+    if(rc>=0) return rc;
+  }
+
+  // wait for file in live modes (a peer's file appears with its first event;
+  // with a ring there is nothing to wait for)
+  while(ring_path.empty() && !fs::exists(target)){
+    if(!(a.follow||a.once||a.window_sec)) die_usage("file not found: "+target.string());
+    usleep(200*1000);
+  }
+
+  Follower fol(target, ring_path, key, a.debug);
+
+  // starting position
+  if(a.since_ts) fol.offset = 0;           // need to scan history
+  else           fol.offset = size_of(target); // start at EOF by default
+
+  // compressed segment given directly: it can no longer grow, so read it once
+  if(sniff_kind(target)!=SegKind::Plain){
+    SegmentReader r(target); std::string line;
+    while(r.getline(line)){
       if(match_line(line,filt)){
         emit(line+"\n");
         if(a.once){ flush_array(); return 0; }
       }
     }
-    offset = (uint64_t)f.tellg();
-    if((long long)offset<0) offset = size_of(target);
+    flush_array();
+    return a.once? 1 : 0;
   }
 
-  // main loop
-  for(;;){
-    if(a.once && now_ms()>=deadline_once){ flush_array(); return 1; }
-    if(a.window_sec && now_ms()>=deadline_win){ flush_array(); return 0; }
+  // cursor: `pos` follows every line taken; saved every checkpoint_ms and on exit
+  Cursor pos; pos.file = target.string();
+  bool dirty = false;
+  long long next_save = 0;
+  auto checkpoint=[&](bool force){
+    if(a.cursor_file.empty() || !dirty) return;
+    if(a.json_array && !force) return;       // lines are out only once the array is
+    long long now = now_ms();
+    if(!force && now < next_save) return;
+    out.sync();                              // the cursor may only pass lines that are out
+    if(!save_cursor(a.cursor_file, pos)) std::perror(("cursor " + a.cursor_file.string()).c_str());
+    dirty = false; next_save = now + a.checkpoint_ms;
+  };
+  auto finish=[&](int rc){ flush_array(); checkpoint(true); return rc; };
 
-    if(!fs::exists(target)){ usleep(200*1000); continue; }
-    uint64_t ino = inode_of(target);
-    uint64_t sz  = size_of(target);
+  std::optional<Cursor> saved;
+  if(!a.cursor_file.empty()){
+    saved = load_cursor(a.cursor_file);
+    if(saved && saved->file!=target.string()){
+      std::cerr<<"wa-sub: cursor is for \""<<saved->file<<"\", starting afresh\n";
+      saved.reset();
+    }
+  }
 
-    if(ino != cur_inode || sz < offset){ cur_inode = ino; offset = 0; }
-
-    if(sz > offset){
-      std::ifstream f(target);
-      f.seekg((std::streamoff)offset, std::ios::beg);
-      std::string line;
-      while(std::getline(f,line)){
-        offset = (uint64_t)f.tellg();
-        if((long long)offset<0) offset = size_of(target);
-        if(match_line(line,filt)){
-          emit(line+"\n");
-          if(a.once){ flush_array(); return 0; }
+  if(saved){
+    // resume: still in the live file, or through the archives after it
+    if(a.debug) std::cerr<<"cursor: "<<saved->segment<<" @"<<saved->offset<<" inode "<<saved->inode<<"\n";
+    pos = *saved;
+    if(saved->segment==target.filename().string() && saved->inode==inode_of(target) && saved->offset<=size_of(target))
+      fol.offset = line_start(target, saved->offset);
+    else
+      fol.catch_up(saved->inode, saved->segment, saved->offset, saved->ts);
+  }
+  else if(a.last){
+    // newest first: the live file up to its last complete line, then the
+    // archives backwards, until N lines matched (or one predates --since-ts)
+    std::vector<std::string> got;
+    bool older = false;
+    auto take=[&](const std::string& line){
+      if(a.since_ts && line_ts(line) < *a.since_ts){ older = true; return false; }
+      if(match_line(line,filt)) got.push_back(line);
+      return got.size() < *a.last;
+    };
+    std::string line;
+    {
+      ReverseReader rr(target);
+      fol.offset = rr.end_of_lines(); fol.cur_inode = rr.inode();
+      while(rr.prev(line) && take(line)){}
+    }
+    if(got.size() < *a.last && !older){
+      auto segs = archives_since(target, a.since_ts.value_or(0));
+      for(auto it=segs.rbegin(); it!=segs.rend() && got.size()<*a.last && !older; ++it){
+        if(a.debug) std::cerr<<"archive: \""<<it->string()<<"\"\n";
+        ReverseReader rr(*it);
+        if(rr.good()){ while(rr.prev(line) && take(line)){} continue; }
+        // no way to read it backwards: one forward pass keeping the newest matches
+        size_t need = *a.last - got.size();
+        std::deque<std::string> keep;
+        SegmentReader sr(*it);
+        while(sr.getline(line)){
+          if(a.since_ts && line_ts(line) < *a.since_ts){ older = true; continue; }
+          if(!match_line(line,filt)) continue;
+          keep.push_back(line);
+          if(keep.size() > need) keep.pop_front();
         }
+        got.insert(got.end(), keep.rbegin(), keep.rend());
       }
-      continue;
     }
-    usleep(200*1000);
+    for(auto it=got.rbegin(); it!=got.rend(); ++it) emit(*it);
+    if(!(a.follow || a.window_sec)) return finish(0);
+  }
+  // historical scan if since-ts: archived segments first, then the live file
+  else if(a.since_ts){
+    fol.catch_up(0, std::string(), 0, *a.since_ts);
+  }
+  if(!a.cursor_file.empty() && !dirty && !saved){
+    // first run: record the starting point, so even a restart before the
+    // first line resumes here instead of at the then-current EOF
+    if(a.since_ts){ pos.segment.clear(); pos.inode = 0; pos.offset = 0; pos.ts = *a.since_ts; }
+    else { pos.segment = target.filename().string(); pos.inode = inode_of(target); pos.offset = fol.offset; pos.ts = now_ms(); }
+    dirty = true;
+  }
+  checkpoint(true);
+
+  // main loop
+  for(;;){
+    if(a.once && now_ms()>=deadline_once) return finish(1);
+    if(a.window_sec && now_ms()>=deadline_win) return finish(0);
+    if(g_stop) return finish(0);
+    report_due();
+
+    bool more = fol.poll([&](std::string_view line, const RingEvent* ev){
+      bool hit = ev? match_event(*ev,filt) : match_line(line,filt);
+      if(hit) emit(line);
+      const TailPos& tp = fol.position();
+      pos.segment = tp.segment; pos.inode = tp.inode; pos.offset = tp.offset; pos.ts = tp.ts; dirty = true;
+      if(hit && a.once) return false;
+      checkpoint(false);
+      report_due();
+      // a steady stream keeps poll() reading: deadlines and signals are checked here too
+      return !g_stop && !(a.window_sec && now_ms()>=deadline_win);
+    });
+    if(!more) return finish(0);
+    out.batch();
+    checkpoint(false);
   }
 }
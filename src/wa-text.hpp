@@ -0,0 +1,291 @@
+// wa-text.hpp — UTF-8 validation/repair and JSON string escaping.
+//
+// Shared by wa-hub and wa-runner. Message bodies and command output are
+// arbitrary bytes; nlohmann's dump() throws on invalid UTF-8, so everything
+// that ends up in a log line or a send payload goes through utf8_clean() or
+// put_json_str() first.
+//
+// Kernels are picked once at runtime: AVX2 (lookup-table validator after
+// Keiser & Lemire, 32-byte escape scan), SSE2 (ASCII fast path + scalar
+// decode, 16-byte escape scan) or portable scalar. WA_TEXT_ISA=scalar|sse2|avx2
+// forces a tier (benchmarks, debugging). Repair itself is scalar: it only
+// runs on input that already failed validation.
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define WA_TEXT_X86 1
+#endif
+
+// What to do with bytes that are not valid UTF-8.
+//   replace: each maximal invalid subsequence becomes U+FFFD (default)
+//   drop:    invalid bytes are removed
+//   latin1:  each invalid byte is taken as ISO-8859-1 and re-encoded
+enum class Utf8Policy { Replace, Drop, Latin1 };
+
+inline Utf8Policy utf8_policy_from_name(std::string_view n){
+  if(n=="drop") return Utf8Policy::Drop;
+  if(n=="latin1") return Utf8Policy::Latin1;
+  return Utf8Policy::Replace;
+}
+// Process-wide policy; set once from config at startup.
+inline Utf8Policy& utf8_policy(){ static Utf8Policy p = Utf8Policy::Replace; return p; }
+
+// ---------- Scalar ----------
+// Length of the valid sequence starting at p[0] (1..4), or 0 if invalid.
+// On 0, *bad is the length of the maximal invalid subpart (>=1).
+inline int utf8_seq(const unsigned char* p, size_t n, int* bad){
+  unsigned char c = p[0];
+  if(c<0x80) return 1;
+  int len; unsigned char lo=0x80, hi=0xBF;
+  if(c>=0xC2 && c<=0xDF) len=2;
+  else if(c>=0xE0 && c<=0xEF){ len=3; if(c==0xE0) lo=0xA0; else if(c==0xED) hi=0x9F; }
+  else if(c>=0xF0 && c<=0xF4){ len=4; if(c==0xF0) lo=0x90; else if(c==0xF4) hi=0x8F; }
+  else { *bad=1; return 0; }
+  for(int k=1;k<len;k++){
+    if((size_t)k>=n){ *bad=k; return 0; }
+    unsigned char b = p[k];
+    if(b<(k==1?lo:0x80) || b>(k==1?hi:0xBF)){ *bad=k; return 0; }
+  }
+  return len;
+}
+
+inline size_t ascii_prefix_scalar(const unsigned char* p, size_t n){
+  size_t i=0;
+  for(; i+8<=n; i+=8){ uint64_t w; std::memcpy(&w, p+i, 8); if(w & 0x8080808080808080ull) break; }
+  while(i<n && p[i]<0x80) ++i;
+  return i;
+}
+// Offset of the first invalid byte, or n.
+inline size_t utf8_valid_prefix_scalar(const unsigned char* p, size_t n){
+  size_t i=0;
+  while(i<n){
+    i += ascii_prefix_scalar(p+i, n-i);
+    if(i>=n) break;
+    int bad=0, k=utf8_seq(p+i, n-i, &bad);
+    if(!k) return i;
+    i += k;
+  }
+  return n;
+}
+inline bool utf8_valid_scalar(const unsigned char* p, size_t n){ return utf8_valid_prefix_scalar(p, n)==n; }
+
+// Offset of the first byte that needs a JSON escape (" \ or < 0x20), or n.
+inline size_t escape_scan_scalar(const unsigned char* p, size_t n){
+  for(size_t i=0;i<n;++i) if(p[i]<0x20 || p[i]=='"' || p[i]=='\\') return i;
+  return n;
+}
+
+#ifdef WA_TEXT_X86
+// ---------- SSE2 ----------
+__attribute__((target("sse2")))
+inline size_t escape_scan_sse2(const unsigned char* p, size_t n){
+  const __m128i q=_mm_set1_epi8('"'), bs=_mm_set1_epi8('\\'), ctl=_mm_set1_epi8(0x1f);
+  size_t i=0;
+  for(; i+16<=n; i+=16){
+    __m128i v = _mm_loadu_si128((const __m128i*)(p+i));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,q), _mm_cmpeq_epi8(v,bs)),
+                               _mm_cmpeq_epi8(_mm_min_epu8(v,ctl), v)); // v <= 0x1f
+    if(int m=_mm_movemask_epi8(hit)) return i + __builtin_ctz(m);
+  }
+  return i + escape_scan_scalar(p+i, n-i);
+}
+__attribute__((target("sse2")))
+inline bool utf8_valid_sse2(const unsigned char* p, size_t n){
+  size_t i=0;
+  while(i<n){
+    for(; i+16<=n; i+=16) if(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p+i)))) break;
+    while(i<n && p[i]<0x80) ++i;
+    if(i>=n) break;
+    int bad=0, k=utf8_seq(p+i, n-i, &bad);
+    if(!k) return false;
+    i += k;
+  }
+  return true;
+}
+
+// ---------- AVX2 ----------
+// Lookup-table validation: three nibble lookups classify each (prev, cur)
+// byte pair; 3- and 4-byte sequences are checked via prev2/prev3.
+__attribute__((target("avx2")))
+inline size_t escape_scan_avx2(const unsigned char* p, size_t n){
+  const __m256i q=_mm256_set1_epi8('"'), bs=_mm256_set1_epi8('\\'), ctl=_mm256_set1_epi8(0x1f);
+  size_t i=0;
+  for(; i+32<=n; i+=32){
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p+i));
+    __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v,q), _mm256_cmpeq_epi8(v,bs)),
+                                  _mm256_cmpeq_epi8(_mm256_min_epu8(v,ctl), v));
+    if(unsigned m=(unsigned)_mm256_movemask_epi8(hit)) return i + __builtin_ctz(m);
+  }
+  return i + escape_scan_sse2(p+i, n-i);
+}
+
+#define WA_B(x) static_cast<char>(x)
+__attribute__((target("avx2")))
+inline void utf8_check_avx2(const __m256i& in, const __m256i& prev_in, __m256i& err){
+  enum : unsigned { TOO_SHORT=1, TOO_LONG=2, OVERLONG_3=4, TOO_LARGE=8, SURROGATE=16,
+                    OVERLONG_2=32, TOO_LARGE_1000=64, OVERLONG_4=64, TWO_CONTS=128,
+                    CARRY=TOO_SHORT|TOO_LONG|TWO_CONTS };
+  const __m256i t1 = _mm256_setr_epi8(
+    WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),
+    WA_B(TWO_CONTS),WA_B(TWO_CONTS),WA_B(TWO_CONTS),WA_B(TWO_CONTS),
+    WA_B(TOO_SHORT|OVERLONG_2),WA_B(TOO_SHORT),WA_B(TOO_SHORT|OVERLONG_3|SURROGATE),
+    WA_B(TOO_SHORT|TOO_LARGE|TOO_LARGE_1000|OVERLONG_4),
+    WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),WA_B(TOO_LONG),
+    WA_B(TWO_CONTS),WA_B(TWO_CONTS),WA_B(TWO_CONTS),WA_B(TWO_CONTS),
+    WA_B(TOO_SHORT|OVERLONG_2),WA_B(TOO_SHORT),WA_B(TOO_SHORT|OVERLONG_3|SURROGATE),
+    WA_B(TOO_SHORT|TOO_LARGE|TOO_LARGE_1000|OVERLONG_4));
+  const unsigned L = CARRY|TOO_LARGE|TOO_LARGE_1000;
+  const __m256i t2 = _mm256_setr_epi8(
+    WA_B(CARRY|OVERLONG_3|OVERLONG_2|OVERLONG_4),WA_B(CARRY|OVERLONG_2),WA_B(CARRY),WA_B(CARRY),
+    WA_B(CARRY|TOO_LARGE),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L|SURROGATE),WA_B(L),WA_B(L),
+    WA_B(CARRY|OVERLONG_3|OVERLONG_2|OVERLONG_4),WA_B(CARRY|OVERLONG_2),WA_B(CARRY),WA_B(CARRY),
+    WA_B(CARRY|TOO_LARGE),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L),WA_B(L|SURROGATE),WA_B(L),WA_B(L));
+  const unsigned C8 = TOO_LONG|OVERLONG_2|TWO_CONTS|OVERLONG_3|TOO_LARGE_1000|OVERLONG_4,
+                 C9 = TOO_LONG|OVERLONG_2|TWO_CONTS|OVERLONG_3|TOO_LARGE,
+                 CA = TOO_LONG|OVERLONG_2|TWO_CONTS|SURROGATE|TOO_LARGE;
+  const __m256i t3 = _mm256_setr_epi8(
+    WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),
+    WA_B(C8),WA_B(C9),WA_B(CA),WA_B(CA),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),
+    WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),
+    WA_B(C8),WA_B(C9),WA_B(CA),WA_B(CA),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT),WA_B(TOO_SHORT));
+  const __m256i nib = _mm256_set1_epi8(0x0f);
+  __m256i carry = _mm256_permute2x128_si256(prev_in, in, 0x21);
+  __m256i prev1 = _mm256_alignr_epi8(in, carry, 15);
+  __m256i prev2 = _mm256_alignr_epi8(in, carry, 14);
+  __m256i prev3 = _mm256_alignr_epi8(in, carry, 13);
+  __m256i b1h = _mm256_shuffle_epi8(t1, _mm256_and_si256(_mm256_srli_epi16(prev1,4), nib));
+  __m256i b1l = _mm256_shuffle_epi8(t2, _mm256_and_si256(prev1, nib));
+  __m256i b2h = _mm256_shuffle_epi8(t3, _mm256_and_si256(_mm256_srli_epi16(in,4), nib));
+  __m256i sc  = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+  __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(WA_B(0xe0-0x80))),
+                                   _mm256_subs_epu8(prev3, _mm256_set1_epi8(WA_B(0xf0-0x80))));
+  __m256i must23_80 = _mm256_and_si256(must23, _mm256_set1_epi8(WA_B(0x80)));
+  err = _mm256_or_si256(err, _mm256_xor_si256(must23_80, sc));
+}
+__attribute__((target("avx2")))
+inline bool utf8_valid_avx2(const unsigned char* p, size_t n){
+  // a block ending in the middle of a sequence of length 2/3/4
+  const __m256i max_tail = _mm256_setr_epi8(
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,WA_B(0xf0-1),WA_B(0xe0-1),WA_B(0xc0-1));
+  __m256i prev=_mm256_setzero_si256(), incomplete=prev, err=prev;
+  unsigned char tail[32];
+  for(size_t i=0; i<n; i+=32){
+    const unsigned char* b = p+i;
+    if(n-i<32){ std::memset(tail, 0, 32); std::memcpy(tail, b, n-i); b = tail; }
+    __m256i in = _mm256_loadu_si256((const __m256i*)b);
+    if(!_mm256_movemask_epi8(in)){ err=_mm256_or_si256(err, incomplete); incomplete=_mm256_setzero_si256(); }
+    else { utf8_check_avx2(in, prev, err); incomplete=_mm256_subs_epu8(in, max_tail); }
+    prev = in;
+  }
+  err = _mm256_or_si256(err, incomplete);
+  return _mm256_testz_si256(err, err);
+}
+#undef WA_B
+#endif // WA_TEXT_X86
+
+// ---------- Dispatch ----------
+struct TextKernels {
+  const char* name;
+  bool   (*utf8_valid)(const unsigned char*, size_t);
+  size_t (*escape_scan)(const unsigned char*, size_t);
+};
+inline const TextKernels& text_kernels(){
+  static const TextKernels k = []{
+    std::string_view force = std::getenv("WA_TEXT_ISA") ? std::getenv("WA_TEXT_ISA") : "";
+#ifdef WA_TEXT_X86
+    __builtin_cpu_init();
+    if(force!="scalar" && force!="sse2" && __builtin_cpu_supports("avx2"))
+      return TextKernels{"avx2", utf8_valid_avx2, escape_scan_avx2};
+    if(force!="scalar" && __builtin_cpu_supports("sse2"))
+      return TextKernels{"sse2", utf8_valid_sse2, escape_scan_sse2};
+#endif
+    (void)force;
+    return TextKernels{"scalar", utf8_valid_scalar, escape_scan_scalar};
+  }();
+  return k;
+}
+
+// ---------- API ----------
+inline bool utf8_valid(std::string_view s){
+  return text_kernels().utf8_valid((const unsigned char*)s.data(), s.size());
+}
+// Appends a valid-UTF-8 version of s to out according to pol.
+inline void utf8_repair_append(std::string& out, std::string_view s, Utf8Policy pol){
+  const unsigned char* p = (const unsigned char*)s.data();
+  size_t n = s.size(), i = 0;
+  while(i<n){
+    size_t ok = utf8_valid_prefix_scalar(p+i, n-i);
+    out.append((const char*)p+i, ok); i += ok;
+    if(i>=n) break;
+    int bad=1; utf8_seq(p+i, n-i, &bad);
+    if(pol==Utf8Policy::Replace) out.append("\xEF\xBF\xBD");
+    else if(pol==Utf8Policy::Latin1)
+      for(int k=0;k<bad;k++){ unsigned char c=p[i+k]; out.push_back((char)(0xC0|(c>>6))); out.push_back((char)(0x80|(c&0x3F))); }
+    i += bad;
+  }
+}
+// s itself if valid, else a repaired copy.
+inline std::string utf8_clean(std::string_view s, Utf8Policy pol = utf8_policy()){
+  if(utf8_valid(s)) return std::string(s);
+  std::string out; out.reserve(s.size()+8);
+  utf8_repair_append(out, s, pol);
+  return out;
+}
+
+// Largest prefix length <= max that does not split a UTF-8 sequence.
+inline size_t utf8_floor(std::string_view s, size_t max){
+  if(max>=s.size()) return s.size();
+  size_t i = max;
+  while(i>0 && max-i<3 && ((unsigned char)s[i] & 0xC0)==0x80) --i;
+  return ((unsigned char)s[i] & 0xC0)==0x80 ? max : i;
+}
+
+// Length of s without a trailing incomplete UTF-8 sequence (one that more
+// bytes could still complete).
+inline size_t utf8_complete(std::string_view s){
+  size_t n = s.size(), i = n;
+  while(i>0 && n-i<3 && ((unsigned char)s[i-1] & 0xC0)==0x80) --i;
+  if(i==0) return n;
+  unsigned char c = (unsigned char)s[i-1];
+  size_t len = c>=0xF0 ? 4 : c>=0xE0 ? 3 : c>=0xC0 ? 2 : 1;
+  return len > n-i+1 ? i-1 : n;
+}
+
+// Appends s as a JSON string literal, byte-identical to nlohmann's dump():
+// \" \\ \b \f \n \r \t, other controls as \u00xx, UTF-8 passed through.
+// Invalid UTF-8 is repaired first according to utf8_policy().
+inline void put_json_str(std::string& out, std::string_view s){
+  thread_local std::string fixed;
+  if(!utf8_valid(s)){ fixed.clear(); utf8_repair_append(fixed, s, utf8_policy()); s = fixed; }
+  auto scan = text_kernels().escape_scan;
+  out.push_back('"');
+  while(!s.empty()){
+    size_t k = scan((const unsigned char*)s.data(), s.size());
+    out.append(s.data(), k);
+    if(k==s.size()) break;
+    unsigned char c = s[k];
+    switch(c){
+      case '"':  out.append("\\\"", 2); break;
+      case '\\': out.append("\\\\", 2); break;
+      case '\b': out.append("\\b", 2); break;
+      case '\f': out.append("\\f", 2); break;
+      case '\n': out.append("\\n", 2); break;
+      case '\r': out.append("\\r", 2); break;
+      case '\t': out.append("\\t", 2); break;
+      default: { static const char hex[]="0123456789abcdef"; char u[6]={'\\','u','0','0',hex[c>>4],hex[c&15]}; out.append(u, 6); }
+    }
+    s.remove_prefix(k+1);
+  }
+  out.push_back('"');
+}
+inline void put_i64(std::string& out, long long v){
+  char b[24]; auto r = std::to_chars(b, b+sizeof(b), v);
+  out.append(b, r.ptr);
+}